@@ -3,11 +3,33 @@
    activate-scene
    deactivate-scene
    update-scenes
+   nodes-in-volume
+   raycast
+   raycast-all
+   raycast-batch
+   nodes-in-sphere
+   nodes-in-box
+   nodes-in-oriented-box
+   set-worker-count!
    add-pipeline
+   set-pipeline-matrices!
    delete-pipeline
    activate-extension
    set-node-pool-size!
+   set-contiguous-node-storage!
    set-aabb-tree-pool-size!
+   set-aabb-tree-maintenance-budget!
+   set-bvh-pool-size!
+   set-octree-pool-size!
+   set-octree-size!
+   set-octree-depth!
+   set-grid-pool-size!
+   set-grid-cell-size!
+   portal-interface
+   set-portal-pool-size!
+   add-portal-cell
+   add-portal
+   set-occlusion-buffer-size!
 
    add-node
    delete-node
@@ -17,6 +39,9 @@
    node-bounding-sphere
    move-node!
    set-node-position!
+   set-node-sort-bits!
+   set-node-inverse-transpose-caching!
+   set-node-occluder!
    node-position
    node-needs-update!
    node-rotation
@@ -26,12 +51,19 @@
    make-camera
    render-cameras
    render-camera
+   make-render-context
+   delete-render-context
+   render-camera-in-context
+   render-camera-set
    update-cameras
    update-camera
    activate-camera
    deactivate-camera
    resize-cameras
    set-camera-clip-planes!
+   set-camera-alpha-sorting!
+   set-camera-face-function!
+   set-camera-occlusion-culling!
    set-camera-view-angle!
    set-camera-viewport-ratio!
    set-camera-viewport-dimensions!
@@ -63,6 +95,7 @@
    current-camera-view-projection
    current-camera-model-view-projection
    current-inverse-transpose-model
+   current-model
 
    lighting
    max-lights
@@ -101,6 +134,17 @@
      c-pointer c-pointer c-pointer bool)
    pre-render render post-render alpha?))
 
+(define +mvp-matrix+ 1)
+(define +model-matrix+ 2)
+(define +inverse-transpose-matrix+ 4)
+
+(define (set-pipeline-matrices! pipeline #!key (mvp? #t) (model? #t)
+                                (inverse-transpose? #t))
+  ((foreign-lambda void "hpsSetPipelineMatrices" c-pointer int)
+   pipeline (bitwise-ior (if mvp? +mvp-matrix+ 0)
+                         (if model? +model-matrix+ 0)
+                         (if inverse-transpose? +inverse-transpose-matrix+ 0))))
+
 (define delete-pipeline
   (foreign-lambda void "hpsDeletePipeline" c-pointer))
 
@@ -123,6 +167,18 @@
 (define (aabb-tree-interface)
   (foreign-value "hpsAABBpartitionInterface" c-pointer))
 
+(define (bvh-interface)
+  (foreign-value "hpsBVHpartitionInterface" c-pointer))
+
+(define (octree-interface)
+  (foreign-value "hpsOctreePartitionInterface" c-pointer))
+
+(define (grid-interface)
+  (foreign-value "hpsGridPartitionInterface" c-pointer))
+
+(define (portal-interface)
+  (foreign-value "hpsPortalPartitionInterface" c-pointer))
+
 (define deactivate-scene
   (foreign-lambda void "hpsDeactivateScene" c-pointer))
 
@@ -132,6 +188,72 @@
 (define update-scenes
   (foreign-lambda void "hpsUpdateScenes"))
 
+(define (nodes-in-volume scene planes function #!optional data)
+  ((foreign-safe-lambda void "hpsNodesInVolume" c-pointer f32vector unsigned-int c-pointer c-pointer)
+   scene planes (quotient (f32vector-length planes) 4) function data))
+
+(define (raycast scene origin direction #!optional (length +inf.0))
+  (let* ((distance (make-f32vector 1 0))
+         (node ((foreign-lambda c-pointer "hpsRaycast"
+                  c-pointer f32vector f32vector float f32vector)
+                scene origin direction length distance)))
+    (if node
+        (values node (f32vector-ref distance 0))
+        (values #f #f))))
+
+(define (raycast-all scene origin direction max-hits #!optional (length +inf.0))
+  (let* ((nodes (make-pointer-vector max-hits))
+         (distances (make-f32vector max-hits 0))
+         (n ((foreign-lambda unsigned-int "hpsRaycastAll"
+               c-pointer f32vector f32vector float pointer-vector f32vector unsigned-int)
+             scene origin direction length nodes distances max-hits)))
+    (let loop ((i (sub1 n)) (hits '()))
+      (if (< i 0)
+          hits
+          (loop (sub1 i) (cons (cons (pointer-vector-ref nodes i)
+                                     (f32vector-ref distances i))
+                               hits))))))
+
+(define (raycast-batch scene rays nodes #!optional distances)
+  ((foreign-lambda void "hpsRaycastBatch"
+     c-pointer f32vector unsigned-int pointer-vector f32vector)
+   scene rays (quotient (f32vector-length rays) 7) nodes distances))
+
+(define (overlapping-nodes query max-nodes)
+  (let* ((nodes (make-pointer-vector max-nodes))
+         (n (query nodes)))
+    (let loop ((i (sub1 (min n max-nodes))) (found '()))
+      (if (< i 0)
+          (values found n)
+          (loop (sub1 i) (cons (pointer-vector-ref nodes i) found))))))
+
+(define (nodes-in-sphere scene center radius max-nodes)
+  (overlapping-nodes
+   (lambda (nodes)
+     ((foreign-lambda unsigned-int "hpsNodesInSphere"
+        c-pointer f32vector float pointer-vector unsigned-int)
+      scene center radius nodes max-nodes))
+   max-nodes))
+
+(define (nodes-in-box scene min max max-nodes)
+  (overlapping-nodes
+   (lambda (nodes)
+     ((foreign-lambda unsigned-int "hpsNodesInBox"
+        c-pointer f32vector f32vector pointer-vector unsigned-int)
+      scene min max nodes max-nodes))
+   max-nodes))
+
+(define (nodes-in-oriented-box scene center half-extents rotation max-nodes)
+  (overlapping-nodes
+   (lambda (nodes)
+     ((foreign-lambda unsigned-int "hpsNodesInOrientedBox"
+        c-pointer f32vector f32vector f32vector pointer-vector unsigned-int)
+      scene center half-extents rotation nodes max-nodes))
+   max-nodes))
+
+(define set-worker-count!
+  (foreign-lambda void "hpsSetWorkerCount" unsigned-int))
+
 (define activate-extension
   (foreign-lambda void "hpsActivateExtension" c-pointer c-pointer))
 
@@ -140,11 +262,69 @@
      "hpsNodePoolSize = n;")
    n))
 
+(define (set-contiguous-node-storage! on?)
+  ((foreign-lambda* void ((bool on))
+     "hpsContiguousNodeStorage = on;")
+   on?))
+
 (define (set-aabb-tree-pool-size! n)
   ((foreign-lambda* void ((unsigned-int n))
      "hpsAABBpartitionPoolSize = n;")
    n))
 
+(define (set-aabb-tree-maintenance-budget! ms)
+  ((foreign-lambda* void ((float ms))
+     "hpsAABBmaintenanceBudget = ms;")
+   ms))
+
+(define (set-bvh-pool-size! n)
+  ((foreign-lambda* void ((unsigned-int n))
+     "hpsBVHpartitionPoolSize = n;")
+   n))
+
+(define (set-octree-pool-size! n)
+  ((foreign-lambda* void ((unsigned-int n))
+     "hpsOctreePartitionPoolSize = n;")
+   n))
+
+(define (set-octree-size! size)
+  ((foreign-lambda* void ((float size))
+     "hpsOctreeSize = size;")
+   size))
+
+(define (set-octree-depth! depth)
+  ((foreign-lambda* void ((unsigned-int depth))
+     "hpsOctreeDepth = depth;")
+   depth))
+
+(define (set-grid-pool-size! n)
+  ((foreign-lambda* void ((unsigned-int n))
+     "hpsGridPartitionPoolSize = n;")
+   n))
+
+(define (set-grid-cell-size! size)
+  ((foreign-lambda* void ((float size))
+     "hpsGridCellSize = size;")
+   size))
+
+(define (set-portal-pool-size! n)
+  ((foreign-lambda* void ((unsigned-int n))
+     "hpsPortalPartitionPoolSize = n;")
+   n))
+
+(define (add-portal-cell scene planes)
+  ((foreign-lambda c-pointer "hpsAddPortalCell" c-pointer f32vector unsigned-int)
+   scene planes (quotient (f32vector-length planes) 4)))
+
+(define (add-portal scene a b vertices)
+  ((foreign-lambda void "hpsAddPortal" c-pointer c-pointer c-pointer f32vector unsigned-int)
+   scene a b vertices (quotient (f32vector-length vertices) 3)))
+
+(define (set-occlusion-buffer-size! width height)
+  ((foreign-lambda* void ((unsigned-int width) (unsigned-int height))
+     "hpsOcclusionBufferWidth = width; hpsOcclusionBufferHeight = height;")
+   width height))
+
 ;;; Nodes
 (define add-node
   (foreign-lambda c-pointer "hpsAddNode" c-pointer c-pointer c-pointer c-pointer))
@@ -176,6 +356,22 @@
 (define set-node-position!
   (foreign-lambda void "hpsSetNodePosition" c-pointer f32vector))
 
+(define set-node-inverse-transpose-caching!
+  (foreign-lambda void "hpsSetNodeInverseTransposeCaching" c-pointer bool))
+
+(define set-node-sort-bits!
+  (foreign-lambda void "hpsSetNodeSortBits" c-pointer unsigned-short))
+
+(define (set-node-occluder! node vertices indices)
+  (if vertices
+      ((foreign-lambda void "hpsSetNodeOccluder"
+         c-pointer f32vector unsigned-int u32vector unsigned-int)
+       node vertices (quotient (f32vector-length vertices) 3)
+       indices (u32vector-length indices))
+      ((foreign-lambda void "hpsSetNodeOccluder"
+         c-pointer c-pointer unsigned-int c-pointer unsigned-int)
+       node #f 0 #f 0)))
+
 (define node-needs-update!
   (foreign-lambda void "hpsNodeNeedsUpdate" c-pointer))
 
@@ -200,6 +396,7 @@
 ;;; Cameras
 (define +ortho+ 0)
 (define +perspective+ 1)
+(define +cube+ 2)
 
 (define +position+ 0)
 (define +look-at+ 1)
@@ -215,7 +412,8 @@
                     unsigned-int unsigned-int c-pointer float float)
                   (ecase type
                     ((ortho:) +ortho+)
-                    ((perspective:) +perspective+))
+                    ((perspective:) +perspective+)
+                    ((cube:) +cube+))
                   (ecase style
                     ((position:) +position+)
                     ((look-at:) +look-at+)
@@ -242,6 +440,20 @@
 (define set-camera-clip-planes!
   (foreign-lambda void "hpsSetCameraClipPlanes" c-pointer float float))
 
+(define +rough-alpha+ 1)
+(define +volumetric-alpha+ 2)
+
+(define (set-camera-alpha-sorting! camera #!key rough? volumetric?)
+  ((foreign-lambda void "hpsSetCameraAlphaSorting" c-pointer int)
+   camera (bitwise-ior (if rough? +rough-alpha+ 0)
+                       (if volumetric? +volumetric-alpha+ 0))))
+
+(define set-camera-face-function!
+  (foreign-lambda void "hpsSetCameraFaceFunction" c-pointer c-pointer))
+
+(define set-camera-occlusion-culling!
+  (foreign-lambda void "hpsSetCameraOcclusionCulling" c-pointer bool))
+
 (define set-camera-view-angle!
   (foreign-lambda void "hpsSetCameraViewAngle" c-pointer float))
 
@@ -269,6 +481,25 @@
 (define render-camera
   (foreign-safe-lambda void "hpsRenderCamera" c-pointer))
 
+(define (make-render-context)
+  (set-finalizer! ((foreign-lambda c-pointer "hpsMakeRenderContext"))
+                  delete-render-context))
+
+(define delete-render-context
+  (foreign-lambda void "hpsDeleteRenderContext" c-pointer))
+
+(define render-camera-in-context
+  (foreign-safe-lambda void "hpsRenderCameraInContext" c-pointer c-pointer))
+
+(define (render-camera-set cameras)
+  (let ((v (make-pointer-vector (length cameras))))
+    (let loop ((cameras cameras) (i 0))
+      (unless (null? cameras)
+        (pointer-vector-set! v i (car cameras))
+        (loop (cdr cameras) (add1 i))))
+    ((foreign-safe-lambda void "hpsRenderCameraSet" pointer-vector unsigned-int)
+     v (pointer-vector-length v))))
+
 (define resize-cameras
   (foreign-lambda void "hpsResizeCameras" float float))
 
@@ -355,6 +586,9 @@
 (define current-inverse-transpose-model
   (foreign-lambda c-pointer "hpsCurrentInverseTransposeModel"))
 
+(define current-model
+  (foreign-lambda c-pointer "hpsCurrentModel"))
+
 ;;; Lighting
 (define (lighting)
   (foreign-value "hpsLighting" c-pointer))
@@ -370,23 +604,23 @@
   (foreign-lambda* void ((unsigned-int max))
     "hpsMaxLights = max;"))
 
-(define (n-current-lights)
-  (foreign-value "hpsNCurrentLights" c-pointer))
+(define n-current-lights
+  (foreign-lambda c-pointer "hpsNCurrentLights"))
 
-(define (current-light-positions)
-  (foreign-value "hpsCurrentLightPositions" c-pointer))
+(define current-light-positions
+  (foreign-lambda c-pointer "hpsCurrentLightPositions"))
 
-(define (current-light-colors)
-  (foreign-value "hpsCurrentLightColors" c-pointer))
+(define current-light-colors
+  (foreign-lambda c-pointer "hpsCurrentLightColors"))
 
-(define (current-light-intensities)
-  (foreign-value "hpsCurrentLightIntensities" c-pointer))
+(define current-light-intensities
+  (foreign-lambda c-pointer "hpsCurrentLightIntensities"))
 
-(define (current-light-directions)
-  (foreign-value "hpsCurrentLightDirections" c-pointer))
+(define current-light-directions
+  (foreign-lambda c-pointer "hpsCurrentLightDirections"))
 
-(define (current-ambient-light)
-  (foreign-value "hpsCurrentAmbientLight" c-pointer))
+(define current-ambient-light
+  (foreign-lambda c-pointer "hpsCurrentAmbientLight"))
 
 (define origin (f32vector 0 0 0))
 
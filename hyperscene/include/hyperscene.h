@@ -1,3 +1,6 @@
+#ifndef HPS_HYPERSCENE
+#define HPS_HYPERSCENE 1
+
 #include <stdbool.h>
 
 #define HPS_DEFAULT_NEAR_PLANE 1.0
@@ -5,18 +8,33 @@
 #define HPS_DEFAULT_VIEW_ANGLE 70.0
 
 typedef enum {
-    HPS_ORTHO, HPS_PERSPECTIVE
+    HPS_ORTHO, HPS_PERSPECTIVE, HPS_CUBE
 } HPScameraType;
 
+typedef enum {
+    HPS_POSITIVE_X, HPS_NEGATIVE_X, HPS_POSITIVE_Y, HPS_NEGATIVE_Y,
+    HPS_POSITIVE_Z, HPS_NEGATIVE_Z
+} HPScubeFace;
+
 typedef enum {
     HPS_POSITION, HPS_LOOK_AT, HPS_ORBIT, HPS_FIRST_PERSON
 } HPScameraStyle;
 
+typedef enum {
+    HPS_ROUGH_ALPHA = 1, HPS_VOLUMETRIC_ALPHA = 2
+} HPSalphaSorting;
+
+typedef enum {
+    HPS_MVP_MATRIX = 1, HPS_MODEL_MATRIX = 2, HPS_INVERSE_TRANSPOSE_MATRIX = 4
+} HPSpipelineMatrices;
+
 typedef struct node HPSnode;
 typedef struct scene HPSscene;
 typedef struct camera HPScamera;
+typedef struct renderContext HPSrenderContext;
 typedef struct pipeline HPSpipeline;
 typedef struct partitionInterface HPSpartitionInterface;
+typedef struct portalCell HPSportalCell;
 
 typedef struct HPSextension {
     void (*init)(void **);
@@ -25,10 +43,13 @@ typedef struct HPSextension {
     void (*visibleNode)(void *, HPSnode *node);
     void (*updateNode)(void *, HPSnode *node);
     void (*delete)(void *);
+    bool concurrentUpdates; // Optional: updateNode may be called from several workers at once, with different nodes
 } HPSextension;
 
 extern unsigned int hpsNodePoolSize;
 
+extern bool hpsContiguousNodeStorage;
+
 extern HPSpartitionInterface *hpsPartitionInterface;
 
 void hpsInit();
@@ -49,6 +70,13 @@ void hpsMoveNode(HPSnode *node, float *vec);
 
 void hpsSetNodePosition(HPSnode *node, float *p);
 
+void hpsSetNodeSortBits(HPSnode *node, unsigned short bits);
+
+void hpsSetNodeInverseTransposeCaching(HPSnode *node, bool cache);
+
+void hpsSetNodeOccluder(HPSnode *node, float *vertices, unsigned int nVertices,
+                        unsigned int *indices, unsigned int nIndices);
+
 void hpsNodeNeedsUpdate(HPSnode *node);
 
 float* hpsNodeRotation(HPSnode *node);
@@ -69,12 +97,37 @@ void hpsDeactivateScene(HPSscene *s);
 
 void hpsUpdateScenes();
 
+void hpsNodesInVolume(HPSscene *scene, float *planes, unsigned int nPlanes,
+                      void (*func)(HPSnode *node, void *data), void *data);
+
+HPSnode *hpsRaycast(HPSscene *scene, float *origin, float *direction, float length,
+                    float *distance);
+
+unsigned int hpsRaycastAll(HPSscene *scene, float *origin, float *direction, float length,
+                           HPSnode **nodes, float *distances, unsigned int maxHits);
+
+void hpsRaycastBatch(HPSscene *scene, float *rays, unsigned int nRays, HPSnode **nodes,
+                     float *distances);
+
+unsigned int hpsNodesInSphere(HPSscene *scene, float *center, float radius,
+                              HPSnode **nodes, unsigned int maxNodes);
+
+unsigned int hpsNodesInBox(HPSscene *scene, float *min, float *max,
+                           HPSnode **nodes, unsigned int maxNodes);
+
+unsigned int hpsNodesInOrientedBox(HPSscene *scene, float *center, float *halfExtents,
+                                   float *rotation, HPSnode **nodes, unsigned int maxNodes);
+
+void hpsSetWorkerCount(unsigned int n);
+
 /* Pipelines */
 HPSpipeline *hpsAddPipeline(void (*preRender)(void *),
 			    void (*render)(void *),
 			    void (*postRender)(),
                             bool hasAlpha);
 
+void hpsSetPipelineMatrices(HPSpipeline *pipeline, int matrices);
+
 void hpsDeletePipeline(HPSpipeline *pipeline);
 
 /* Cameras */
@@ -82,6 +135,8 @@ HPScamera *hpsCurrentCamera();
 
 float *hpsCurrentInverseTransposeModel();
 
+float *hpsCurrentModel();
+
 float *hpsCurrentCameraPosition();
 
 float *hpsCurrentCameraView();
@@ -96,10 +151,24 @@ void hpsUpdateCamera(HPScamera *camera);
 
 void hpsRenderCamera(HPScamera *camera);
 
+HPSrenderContext *hpsMakeRenderContext();
+
+void hpsDeleteRenderContext(HPSrenderContext *context);
+
+void hpsRenderCameraInContext(HPScamera *camera, HPSrenderContext *context);
+
+void hpsRenderCameraSet(HPScamera **cameras, unsigned int n);
+
 HPScamera *hpsMakeCamera(HPScameraType type, HPScameraStyle style, HPSscene *scene, float width, float height);
 
 void hpsSetCameraClipPlanes(HPScamera *camera, float near, float far);
 
+void hpsSetCameraAlphaSorting(HPScamera *camera, int sorting);
+
+void hpsSetCameraFaceFunction(HPScamera *camera, void (*func)(HPScamera *camera, int face));
+
+void hpsSetCameraOcclusionCulling(HPScamera *camera, bool cull);
+
 void hpsSetCameraViewAngle(HPScamera *camera, float angle);
 
 void hpsSetCameraViewportRatio(HPScamera *camera, float width, float height);
@@ -167,6 +236,40 @@ extern void *hpsAABBpartitionInterface;
 
 extern unsigned int hpsAABBpartitionPoolSize;
 
+extern float hpsAABBmaintenanceBudget;
+
+extern void *hpsBVHpartitionInterface;
+
+extern unsigned int hpsBVHpartitionPoolSize;
+
+extern void *hpsOctreePartitionInterface;
+
+extern unsigned int hpsOctreePartitionPoolSize;
+
+extern float hpsOctreeSize;
+
+extern unsigned int hpsOctreeDepth;
+
+extern void *hpsGridPartitionInterface;
+
+extern unsigned int hpsGridPartitionPoolSize;
+
+extern float hpsGridCellSize;
+
+extern void *hpsPortalPartitionInterface;
+
+extern unsigned int hpsPortalPartitionPoolSize;
+
+HPSportalCell *hpsAddPortalCell(HPSscene *scene, float *planes, unsigned int nPlanes);
+
+void hpsAddPortal(HPSscene *scene, HPSportalCell *a, HPSportalCell *b,
+                  float *vertices, unsigned int nVertices);
+
+/* Occlusion culling */
+extern unsigned int hpsOcclusionBufferWidth;
+
+extern unsigned int hpsOcclusionBufferHeight;
+
 /* Extensions */
 void hpsActivateExtension(HPSscene *scene, HPSextension *extension);
 
@@ -188,3 +291,5 @@ int hpsBSCloserToCamera(const HPScamera *camera, const float *a, const float *b)
 int hpsBSFurtherFromCamera(const HPScamera *camera, const float *a, const float *b);
 
 int hpsBSFurtherFromCameraRough(const HPScamera *camera, const float *a, const float *b);
+
+#endif
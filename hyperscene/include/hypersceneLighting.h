@@ -1,14 +1,22 @@
+#ifndef HPS_HYPERSCENE_LIGHTING
+#define HPS_HYPERSCENE_LIGHTING 1
+
 extern HPSextension *hpsLighting;
 
 extern unsigned int hpsLightPoolSize;
 extern unsigned int hpsMaxLights;
 
-extern unsigned int *hpsNCurrentLights;
-extern float *hpsCurrentLightPositions;
-extern float *hpsCurrentLightColors;
-extern float *hpsCurrentLightIntensities;
-extern float *hpsCurrentLightDirections;
-extern float *hpsCurrentAmbientLight;
+unsigned int *hpsNCurrentLights();
+
+float *hpsCurrentLightPositions();
+
+float *hpsCurrentLightColors();
+
+float *hpsCurrentLightIntensities();
+
+float *hpsCurrentLightDirections();
+
+float *hpsCurrentAmbientLight();
 
 HPSnode *hpsAddLight(HPSnode *node, float* color, float i, float *direction, float spotAngle);
 
@@ -29,3 +37,5 @@ void hpsSetLightSpotAngle(HPSnode *node, float a);
 float hpsLightSpotAngle(HPSnode *node);
 
 void hpsSetAmbientLight(HPSscene *scene, float* color);
+
+#endif
@@ -5,8 +5,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #include "partition.h"
 #include "memory.h"
+#include "jobs.h"
+#include "cull.h"
+#include "occlusion.h"
 
 #define SPLIT_X 1
 #define SPLIT_Y 2
@@ -18,6 +22,10 @@
 
 #define ALL_PLANES 63 // bx111111
 
+#define CHILD_CLASSES 6 // Arrays of children are allocated with room for 1, 2, 4, 8, 16 or 32 children
+
+#define TASKS_PER_WORKER 8 // How many subtrees per worker a parallel visibility test tries to create
+
 typedef enum {
     INSIDE, OUTSIDE, INTERSECT
 } Intersection;
@@ -28,28 +36,53 @@ typedef struct {
 
 typedef struct aabbTree {
     struct aabbTree *parent;
-    struct aabbTree *children[27];
-    HPSpool pool;
-    unsigned short split, lastChecked;
+    struct aabbTree **children; // The children that exist, in the order of their bits in childMask
+    struct aabbRoot *root;
+    unsigned int childMask; // Bit i is set when the child with index i (x + y*3 + z*9) exists
+    unsigned short split;
+    unsigned int id; // Index of the tree's entry in a camera's plane hints
     Point splitPoint;
     Point min;
     Point max;
-    bool extentsCorrect;
+    bool extentsCorrect, splitPending;
     HPSvector nodes;
     Node *nodesData[TREE_NODES];
 } AABBtree;
 
-AABBtree *hpsAABBnewTree();
-void hpsAABBdeleteTree(AABBtree *tree);
+/* The partition struct handed to the scene: the top of the tree, and the trees that are waiting for the maintenance step */
+typedef struct aabbRoot {
+    AABBtree *tree;
+    HPSpool pool;
+    HPSpool childPools[CHILD_CLASSES];
+    HPSvector staleTrees; // Trees whose extents are not correct
+    HPSvector fullTrees; // Trees that have enough nodes to be split
+    HPSvector freeIds; // Ids of deleted trees, to be reused
+    unsigned char *generations; // How many times each id has been reused (mod 32)
+    unsigned int nIds;
+} AABBroot;
+
+AABBroot *hpsAABBnewTree();
+void hpsAABBdeleteTree(AABBroot *root);
 AABBtree *hpsAABBfindNode(Node *node, AABBtree *tree);
-void hpsAABBaddNode(Node *node, AABBtree *tree);
+void hpsAABBaddNode(Node *node, AABBroot *root);
 void hpsAABBremoveNode(Node *node);
 void hpsAABBupdateNode(Node *node);
-void hpsAABBdoVisible(AABBtree *tree, Plane *planes, void (*func)(Node *));
-static void getAABBtreeExtents(AABBtree *tree, Point *min, Point *max);
-static AABBtree *newTree(HPSpool pool, AABBtree *parent);
+void hpsAABBupdateNodes(Node **nodes, unsigned int n);
+void hpsAABBdoVisible(AABBroot *root, Plane *planes, CullCache *cache,
+                      void (*func)(Node *));
+void hpsAABBmaintain(AABBroot *root);
+void hpsAABBdoVisibleMulti(AABBroot *root, Plane *planes, int nFrusta,
+                           void (*func)(Node *, unsigned int));
+void hpsAABBdoVisibleOccluded(AABBroot *root, Plane *planes, CullCache *cache,
+                              OcclusionBuffer *occlusion, void (*func)(Node *));
+void hpsAABBdoVisibleVolume(AABBroot *root, Plane *planes, int nPlanes,
+                            void (*func)(Node *));
+void hpsAABBraycast(AABBroot *root, Ray *ray, void (*func)(Node *, float, void *), void *data);
+void hpsAABBoverlap(AABBroot *root, Region *region, void (*func)(Node *, void *), void *data);
+static AABBtree *newTree(AABBroot *root, AABBtree *parent);
 static void splitTree(AABBtree *tree);
 static void updateExtents(AABBtree *tree);
+static bool keepsNode(AABBtree *tree, BoundingSphere *bs);
 static AABBtree *whichBranch(AABBtree *tree, BoundingSphere *bs);
 static void growExtents(AABBtree *tree, BoundingSphere *bs);
 static void shrinkExtents(AABBtree *tree, BoundingSphere *bs);
@@ -58,6 +91,7 @@ static void deleteTree(AABBtree *tree);
 static bool contains(AABBtree *t, BoundingSphere *bs);
 
 unsigned int hpsAABBpartitionPoolSize = 4096;
+float hpsAABBmaintenanceBudget = 0;
 
 #ifdef DEBUG
 void printTree(AABBtree *tree){
@@ -73,34 +107,151 @@ PartitionInterface partitionInterface = {(void *(*)()) hpsAABBnewTree,
                                          (void (*)(Node *, void *)) hpsAABBaddNode,
                                          (void (*)(Node *)) hpsAABBremoveNode,
                                          (void (*)(Node *)) hpsAABBupdateNode,
-                                         (void (*)(void *, Plane *, void (*)(Node *))) 
-                                           hpsAABBdoVisible};
+                                         (void (*)(void *, Plane *, CullCache *,
+                                                   void (*)(Node *)))
+                                           hpsAABBdoVisible,
+                                         (void (*)(void *)) hpsAABBmaintain,
+                                         (void (*)(void *, Plane *, int,
+                                                   void (*)(Node *, unsigned int)))
+                                           hpsAABBdoVisibleMulti,
+                                         (void (*)(void *, Plane *, CullCache *,
+                                                   OcclusionBuffer *, void (*)(Node *)))
+                                           hpsAABBdoVisibleOccluded,
+                                         (void (*)(void *, Plane *, int, void (*)(Node *)))
+                                           hpsAABBdoVisibleVolume,
+                                         (void (*)(void *, Ray *, void (*)(Node *, float, void *),
+                                                   void *))
+                                           hpsAABBraycast,
+                                         (void (*)(void *, Region *, void (*)(Node *, void *),
+                                                   void *))
+                                           hpsAABBoverlap,
+                                         (void (*)(Node **, unsigned int))
+                                           hpsAABBupdateNodes};
 
 PartitionInterface *hpsAABBpartitionInterface = &partitionInterface;
 
 
-AABBtree *hpsAABBnewTree(){
-    HPSpool pool =  hpsMakePool(sizeof(AABBtree), hpsAABBpartitionPoolSize, 
-                                "AABB tree pool");
-    return newTree(pool, NULL);
+AABBroot *hpsAABBnewTree(){
+    AABBroot *root = malloc(sizeof(AABBroot));
+    int i;
+    root->pool = hpsMakePool(sizeof(AABBtree), hpsAABBpartitionPoolSize, 
+                             "AABB tree pool");
+    for (i = 0; i < CHILD_CLASSES; i++){
+        unsigned int nBlocks = hpsAABBpartitionPoolSize >> (i + 1);
+        root->childPools[i] = hpsMakePool(sizeof(AABBtree *) << i,
+                                          (nBlocks < 16) ? 16 : nBlocks,
+                                          "AABB children pool");
+    }
+    hpsInitVector(&root->staleTrees, 64);
+    hpsInitVector(&root->fullTrees, 16);
+    hpsInitVector(&root->freeIds, 16);
+    root->generations = NULL;
+    root->nIds = 0;
+    root->tree = newTree(root, NULL);
+    return root;
+}
+
+void hpsAABBdeleteTree(AABBroot *root){
+    int i;
+    hpsDeletePool(root->pool);
+    for (i = 0; i < CHILD_CLASSES; i++)
+        hpsDeletePool(root->childPools[i]);
+    hpsDeleteVector(&root->staleTrees);
+    hpsDeleteVector(&root->fullTrees);
+    hpsDeleteVector(&root->freeIds);
+    free(root->generations);
+    free(root);
 }
 
-void hpsAABBdeleteTree(AABBtree *tree){
-    hpsDeletePool(tree->pool);
+/* Tree ids
+   Each tree has a small id, so that cameras can keep a hint of which plane last rejected it in an array (see inPlanes). Ids of deleted trees are reused, and the generation of an id is bumped when it is, so hints left for the deleted tree are not mistaken for hints about the new one. */
+static unsigned int newId(AABBroot *root){
+    if (root->freeIds.size){
+        unsigned int id = (size_t) hpsPop(&root->freeIds);
+        root->generations[id] = (root->generations[id] + 1) & 31;
+        return id;
+    }
+    if ((root->nIds & (root->nIds - 1)) == 0) // Grown at powers of two
+        root->generations = realloc(root->generations, root->nIds ? root->nIds * 2 : 1);
+    root->generations[root->nIds] = 0;
+    return root->nIds++;
 }
 
-static AABBtree *newTree(HPSpool pool, AABBtree *parent){
-    AABBtree *tree = hpsAllocateFrom(pool);
+/* New trees start out empty, and are left for the maintenance step to find their extents */
+static AABBtree *newTree(AABBroot *root, AABBtree *parent){
+    AABBtree *tree = hpsAllocateFrom(root->pool);
+    Point max = {-INFINITY, -INFINITY, -INFINITY};
+    Point min = {INFINITY, INFINITY, INFINITY};
     hpsInitStaticVector(&tree->nodes, tree->nodesData, TREE_NODES);
     tree->parent = parent;
-    tree->pool = pool;
+    tree->root = root;
     tree->split = 0;
-    tree->lastChecked = 0;
+    tree->id = newId(root);
+    tree->min = min;
+    tree->max = max;
     tree->extentsCorrect = false;
-    memset(tree->children, 0, 27 * sizeof(void *));
+    tree->splitPending = false;
+    hpsPush(&root->staleTrees, tree);
+    tree->children = NULL;
+    tree->childMask = 0;
     return tree;
 }
 
+/* Children
+   Only the children that exist are stored. The position of child i in the children array is the number of children with a lower index, and the array is moved to the pool of the next (or previous) size class whenever it fills (or drops to half full). */
+static int nChildren(AABBtree *tree){
+    return __builtin_popcount(tree->childMask);
+}
+
+static int childClass(int n){
+    int c = 0;
+    while ((1 << c) < n) c++;
+    return c;
+}
+
+static AABBtree *getChild(AABBtree *tree, int i){
+    unsigned int bit = 1 << i;
+    if (!(tree->childMask & bit)) return NULL;
+    return tree->children[__builtin_popcount(tree->childMask & (bit - 1))];
+}
+
+static void moveChildren(AABBtree *tree, int oldN, int newN){
+    HPSpool *pools = tree->root->childPools;
+    AABBtree **children = newN ? hpsAllocateFrom(pools[childClass(newN)]) : NULL;
+    int n = (oldN < newN) ? oldN : newN;
+    if (n) memcpy(children, tree->children, n * sizeof(AABBtree *));
+    if (oldN) hpsDeleteFrom(tree->children, pools[childClass(oldN)]);
+    tree->children = children;
+}
+
+static void addChild(AABBtree *tree, int i, AABBtree *child){
+    unsigned int bit = 1 << i;
+    int n = nChildren(tree);
+    int index = __builtin_popcount(tree->childMask & (bit - 1));
+    int j;
+    if ((n & (n - 1)) == 0) // Full, since arrays hold a power of two children
+        moveChildren(tree, n, n + 1);
+    for (j = n; j > index; j--)
+        tree->children[j] = tree->children[j - 1];
+    tree->children[index] = child;
+    tree->childMask |= bit;
+}
+
+static void markFull(AABBtree *tree){
+    if (!tree->split && !tree->splitPending &&
+        (tree->nodes.size >= SPLIT_THRESHOLD)){
+        tree->splitPending = true;
+        hpsPush(&tree->root->fullTrees, tree);
+    }
+}
+
+static void markStale(AABBtree *tree){
+    if (tree->extentsCorrect){
+        tree->extentsCorrect = false;
+        hpsPush(&tree->root->staleTrees, tree);
+    }
+}
+
 AABBtree *hpsAABBfindNode(Node *node, AABBtree *tree){
     AABBtree *t = tree;
     AABBtree *u = NULL;
@@ -114,15 +265,16 @@ AABBtree *hpsAABBfindNode(Node *node, AABBtree *tree){
 void addNode(Node *node, AABBtree *tree){
     hpsPush(&tree->nodes, node);
     node->area = (void *) tree;
+    markFull(tree);
 #ifdef DEBUG
     printf("Added node %p to tree %p\n", node->data, tree);
 #endif
 }
 
-void hpsAABBaddNode(Node *node, AABBtree *tree){
-    AABBtree *t = hpsAABBfindNode(node, tree);
+void hpsAABBaddNode(Node *node, AABBroot *root){
+    AABBtree *t = hpsAABBfindNode(node, root->tree);
     addNode(node, t);
-    growExtents(tree, node->boundingSphere);
+    growExtents(t, node->boundingSphere);
 }
 
 void hpsAABBremoveNode(Node *node){
@@ -172,13 +324,24 @@ void hpsAABBupdateNode(Node *node){
     }
 }
 
-static void getAABBtreeExtents(AABBtree *tree, Point *min, Point *max){
-    if (!tree->extentsCorrect)
-	updateExtents(tree);
-    if (!tree->split && (tree->nodes.size >= SPLIT_THRESHOLD))
-	splitTree(tree);
-    *min = tree->min;
-    *max = tree->max;
+/* A node needs no update when it is still in the tree that it would be added to, and does not touch the extents of that tree or of any of its ancestors (so that neither growExtents nor shrinkExtents would change them). Nothing may be changed here, so whichBranch, which creates missing branches, is not used. */
+static bool nodeFits(Node *node){
+    AABBtree *tree = (AABBtree *) node->area;
+    BoundingSphere *bs = node->boundingSphere;
+    AABBtree *t;
+    for (t = tree; t; t = t->parent)
+        if (bs->x - bs->r <= t->min.x ||
+            bs->y - bs->r <= t->min.y ||
+            bs->z - bs->r <= t->min.z ||
+            bs->x + bs->r >= t->max.x ||
+            bs->y + bs->r >= t->max.y ||
+            bs->z + bs->r >= t->max.z)
+            return false;
+    return keepsNode(tree, bs);
+}
+
+void hpsAABBupdateNodes(Node **nodes, unsigned int n){
+    hpsUpdateMovedNodes(nodes, n, &nodeFits, NULL, &hpsAABBupdateNode);
 }
 
 static bool contains(AABBtree *t, BoundingSphere *bs){
@@ -212,31 +375,30 @@ static void shrinkExtents(AABBtree *tree, BoundingSphere *bs){
 	    bs->x + bs->r >= t->max.x ||
 	    bs->y + bs->r >= t->max.y ||
 	    bs->z + bs->r >= t->max.z)
-	    t->extentsCorrect = false;
+	    markStale(t);
     } while ((t = t->parent));
 }
 
 static void removeChild(AABBtree *tree, AABBtree *c){
-    bool unsplit = true;
+    unsigned int mask;
+    int n = nChildren(tree);
     int i;
-    for (i = 0; i < 27; i++){
-	AABBtree *child = tree->children[i];
-	if (child){
-	    if (child == c)
-		tree->children[i] = NULL;
-	    else
-		unsplit = false;
-	}
+    for (i = 0, mask = tree->childMask; tree->children[i] != c; i++)
+        mask &= mask - 1;
+    tree->childMask &= ~(1 << __builtin_ctz(mask));
+    for (; i < n - 1; i++)
+        tree->children[i] = tree->children[i + 1];
+    if (((n - 1) & (n - 2)) == 0) // Fits in the next smaller size class
+        moveChildren(tree, n, n - 1);
+    if (!tree->childMask){
+        tree->split = 0;
+        markFull(tree);
     }
-    if (unsplit) tree->split = 0;
     maybeKillTree(tree);
 }
 
 static void maybeKillTree(AABBtree *tree){
-    int i;
-    if (tree->parent && tree->nodes.size == 0){
-	for (i = 0; i < 27; i++)
-	    if (tree->children[i]) return;
+    if (tree->parent && tree->nodes.size == 0 && !tree->childMask){
 #ifdef DEBUG
         printf("Killing tree ");
         printTree(tree);
@@ -247,14 +409,20 @@ static void maybeKillTree(AABBtree *tree){
     }
 }
 
-static AABBtree *whichBranch(AABBtree *tree, BoundingSphere *bs){
+// Whether the sphere belongs in the tree itself rather than in one of its branches
+static bool keepsNode(AABBtree *tree, BoundingSphere *bs){
     float radius = bs->r;
     float ov = radius * radius * radius;
     float bv = (tree->max.x - tree->min.x) *
 	(tree->max.y - tree->min.y) * (tree->max.z - tree->min.z);
-    if (!tree->split ||
+    return !tree->split ||
 	(tree->extentsCorrect && (ov > bv/8) &&
-	 (tree->nodes.size != tree->nodes.capacity)))
+	 (tree->nodes.size != tree->nodes.capacity));
+}
+
+static AABBtree *whichBranch(AABBtree *tree, BoundingSphere *bs){
+    float radius = bs->r;
+    if (keepsNode(tree, bs))
 	return tree;
     int x = 0, y =0, z = 0;
     if (tree->split & SPLIT_X){
@@ -279,10 +447,12 @@ static AABBtree *whichBranch(AABBtree *tree, BoundingSphere *bs){
 	else z = 1;
     }
     int i = x + y*3 + z*9;
-    if (tree->children[i])
-	return tree->children[i];
-    else
-	return tree->children[i] = newTree(tree->pool, tree);
+    AABBtree *child = getChild(tree, i);
+    if (!child){
+        child = newTree(tree->root, tree);
+        addChild(tree, i, child);
+    }
+    return child;
 }
 
 static void setSplitLocation(AABBtree *tree){
@@ -315,8 +485,13 @@ static void setSplitDirection(AABBtree *tree){
 }
 
 static void deleteTree(AABBtree *tree){
+    if (!tree->extentsCorrect)
+        hpsRemove(&tree->root->staleTrees, tree);
+    if (tree->splitPending)
+        hpsRemove(&tree->root->fullTrees, tree);
     hpsDeleteVector(&tree->nodes);
-    hpsDeleteFrom(tree, tree->pool);
+    hpsPush(&tree->root->freeIds, (void *) (size_t) tree->id);
+    hpsDeleteFrom(tree, tree->root->pool);
 }
 
 static void updateExtents(AABBtree *tree){
@@ -335,18 +510,16 @@ static void updateExtents(AABBtree *tree){
 	min.y = fmin(min.y, bs->y - bs->r);
 	min.z = fmin(min.z, bs->z - bs->r);
     }
-    for (i = 0; i < 27; i++){
+    for (i = 0; i < nChildren(tree); i++){
 	AABBtree *child = tree->children[i];
-	if (child){
-	    if (!child->extentsCorrect)
-		updateExtents(child);
-	    max.x = fmax(max.x, child->max.x);
-	    max.y = fmax(max.y, child->max.y);
-	    max.z = fmax(max.z, child->max.z);
-	    min.x = fmin(min.x, child->min.x);
-	    min.y = fmin(min.y, child->min.y);
-	    min.z = fmin(min.z, child->min.z);
-	}
+	if (!child->extentsCorrect)
+	    updateExtents(child);
+	max.x = fmax(max.x, child->max.x);
+	max.y = fmax(max.y, child->max.y);
+	max.z = fmax(max.z, child->max.z);
+	min.x = fmin(min.x, child->min.x);
+	min.y = fmin(min.y, child->min.y);
+	min.z = fmin(min.z, child->min.z);
     }
     tree->max = max;
     tree->min = min;
@@ -383,35 +556,72 @@ static void splitTree(AABBtree *tree){
 	    i++;
 	}
     }
-    for (i = 0; i < 27; i++){
+    for (i = 0; i < nChildren(tree); i++){
 	AABBtree *child = tree->children[i];
-	if (child){
-	    if (child->nodes.size == nCurrentNodes)
-		goto abort;
-	}
+	if (child->nodes.size == nCurrentNodes)
+	    goto abort;
     }
-    for (i = 0; i < 27; i++){
+    for (i = 0; i < nChildren(tree); i++){
 	AABBtree *child = tree->children[i];
-	if (child){
-	    updateExtents(child);
-	}
+	updateExtents(child);
     }
     return;
 abort:
 #ifdef DEBUG
     printf("Aborting split of tree %p\n", tree);
 #endif
-    for (i = 0; i < 27; i++){
+    for (i = 0; i < nChildren(tree); i++){
 	AABBtree *child = tree->children[i];
-	if (child){
-	    Node *n;
-	    while ((n = hpsPop(&child->nodes))){
-                addNode(n, tree);
-	    }
+	Node *n;
+	while ((n = hpsPop(&child->nodes))){
+            addNode(n, tree);
 	}
     }
 }
 
+/* Maintenance
+   Called once the scene has been updated. All stale extents are refreshed, and then trees that have filled up are split until hpsAABBmaintenanceBudget milliseconds have passed. Visibility tests never modify the tree, so a tree that is not split in time is simply tested as one larger tree until a later frame splits it. */
+static void refreshExtents(AABBroot *root){
+    HPSvector *stale = &root->staleTrees;
+    int i;
+    for (i = 0; i < stale->size; i++){
+        AABBtree *tree = stale->data[i];
+        if (!tree->extentsCorrect)
+            updateExtents(tree);
+    }
+    stale->size = 0;
+}
+
+static float elapsedMilliseconds(struct timespec *start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+        (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+void hpsAABBmaintain(AABBroot *root){
+    HPSvector *full = &root->fullTrees;
+    bool budgeted = hpsAABBmaintenanceBudget > 0;
+    struct timespec start;
+    int i, nSplit;
+    if (budgeted)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    refreshExtents(root);
+    for (nSplit = 0; nSplit < full->size;){
+        AABBtree *tree = full->data[nSplit++];
+        tree->splitPending = false;
+        if (!tree->split && (tree->nodes.size >= SPLIT_THRESHOLD)){
+            splitTree(tree);
+            if (budgeted && (elapsedMilliseconds(&start) > hpsAABBmaintenanceBudget))
+                break;
+        }
+    }
+    for (i = nSplit; i < full->size; i++)
+        full->data[i - nSplit] = full->data[i];
+    full->size -= nSplit;
+    refreshExtents(root);
+}
+
 /* Visibility testing */
 /*
   Based on algorithm described in this paper:
@@ -436,13 +646,31 @@ static void setPNvectors(Plane *plane, Point *p, Point *n, Point *min, Point *ma
     else                { p->z = max->z; n->z = min->z; }
 }
 
-static Intersection inPlanes(AABBtree *t, Plane *planes, int inMask, int *outMask){
-    float a, b; int i, k = 1 << t->lastChecked;
+/* Plane coherency
+   The plane that last put a tree outside of a camera's frustum is likely to do so again, so it is tested first. These hints belong to the camera – a byte per tree id in its cull cache – since cameras looking at the same tree from different places would otherwise keep overwriting each other's. Each hint is tagged with the generation of the tree's id, and is ignored when the id has since been given to another tree. Visibility tests never write to the tree itself. */
+#define HINT(generation, plane) (((generation) << 3) | (plane))
+
+static unsigned char *planeHints(AABBroot *root, CullCache *cache){
+    if (!cache)
+        return NULL;
+    if (cache->size < root->nIds){
+        size_t size = root->nIds * 2;
+        cache->data = realloc(cache->data, size);
+        memset((unsigned char *) cache->data + cache->size, 0, size - cache->size);
+        cache->size = size;
+    }
+    return cache->data;
+}
+
+static Intersection inPlanes(AABBtree *t, Plane *planes, unsigned char *hints,
+                             unsigned int inMask, unsigned int *outMask){
+    unsigned char generation = t->root->generations[t->id];
+    unsigned int first = (hints && ((hints[t->id] >> 3) == generation)) ? hints[t->id] & 7 : 0;
+    float a, b; unsigned int i, m, k = 1u << first;
     Point p, n;
     Intersection result = INSIDE;
-    Plane plane = planes[t->lastChecked];
-    Point min, max;
-    getAABBtreeExtents(t, &min, &max);
+    Plane plane = planes[first];
+    Point min = t->min, max = t->max;
     if (k & inMask) {
         setPNvectors(&plane, &p, &n, &min, &max);
         a = (plane.a * p.x) + (plane.b * p.y) + (plane.c * p.z) + plane.d;
@@ -450,14 +678,17 @@ static Intersection inPlanes(AABBtree *t, Plane *planes, int inMask, int *outMas
         b = (plane.a * n.x) + (plane.b * n.y) + (plane.c * n.z) + plane.d;
         if (b < 0) { *outMask |= k; result = INTERSECT; }
     }
-    for (i = 0, k = 1; k <= inMask; i++, k += k){
-        if ((i != t->lastChecked) && (k & inMask)){
+    for (i = 0, m = inMask; m; i++, m >>= 1){
+        if ((i != first) && (m & 1)){
             plane = planes[i];
             setPNvectors(&plane, &p, &n, &min, &max);
             a = (plane.a * p.x) + (plane.b * p.y) + (plane.c * p.z) + plane.d;
-            if (a < 0) { t->lastChecked = i; return OUTSIDE; }
+            if (a < 0) {
+                if (hints) hints[t->id] = HINT(generation, i);
+                return OUTSIDE;
+            }
             b = (plane.a * n.x) + (plane.b * n.y) + (plane.c * n.z) + plane.d;
-            if (b < 0) { *outMask |= k; result = INTERSECT; }
+            if (b < 0) { *outMask |= 1u << i; result = INTERSECT; }
         }
     }
     return result;
@@ -470,39 +701,193 @@ static void treeMap(AABBtree *tree, void (*func)(Node *)){
     int i;
     for (i = 0; i < tree->nodes.size; i++)
 	func(tree->nodes.data[i]);
-    for (i = 0; i < 27; i++){
-	AABBtree *child = tree->children[i];
-	if (child)
-	    treeMap(child, func);
-    }
+    for (i = 0; i < nChildren(tree); i++)
+	treeMap(tree->children[i], func);
+}
+
+/* Occlusion
+   When an occlusion buffer is given, every tree that is not outside of the frustum is tested against it before its nodes are visited or its children descended into. Trees inside of the frustum are then still descended, rather than mapped over, so that their hidden subtrees can be skipped. */
+static bool occluded(AABBtree *tree, OcclusionBuffer *occlusion){
+    return occlusion && hpsBoxOccluded(occlusion, (float *) &tree->min, (float *) &tree->max);
 }
 
-static void doVisible(AABBtree *tree, Plane *planes, void (*func)(Node *), int planeMask){
-    int nextMask = 0;
-    int inView = inPlanes(tree, planes, planeMask, &nextMask);
+static void doVisible(AABBtree *tree, Plane *planes, unsigned char *hints,
+                      OcclusionBuffer *occlusion, void (*func)(Node *),
+                      unsigned int planeMask){
+    unsigned int nextMask = 0;
+    int inView = inPlanes(tree, planes, hints, planeMask, &nextMask);
     int i;
-    if (inView == INSIDE)
+    if ((inView == OUTSIDE) || occluded(tree, occlusion))
+        return;
+    if ((inView == INSIDE) && !occlusion)
 	treeMap(tree, func);
-    else if (inView == INTERSECT){
+    else {
 #ifdef DEBUG
         nTrees++;
 #endif 
-	for (i = 0; i < tree->nodes.size; i++)
-	    func(tree->nodes.data[i]);
-	for (i = 0; i < 27; i++){
-	    AABBtree *child = tree->children[i];
-	    if (child)
-		doVisible(child, planes, func, nextMask);
-	}
+	hpsNodesInPlanes((Node **) tree->nodes.data, tree->nodes.size, planes, nextMask,
+                         func, NULL);
+	for (i = 0; i < nChildren(tree); i++)
+	    doVisible(tree->children[i], planes, hints, occlusion, func, nextMask);
     }
 }
 
-void hpsAABBdoVisible(AABBtree *tree, Plane *planes, void (*func)(Node *)){
+/* Parallel visibility testing
+   The top of the tree is tested on the calling thread until enough subtrees have been found to keep the workers busy. Each worker then collects the visible nodes of the subtrees it is handed into its own list, and these lists are passed to func on the calling thread once all the workers are done. */
+typedef struct {
+    AABBtree *tree;
+    unsigned int planeMask;
+    bool inside;
+} VisibleTask;
+
+typedef struct {
+    VisibleTask **tasks;
+    Plane *planes;
+    unsigned char *hints;
+    OcclusionBuffer *occlusion; // Only read, so shared by the workers
+    HPSvector *visible; // One vector per worker
+} VisibleJob;
+
+// Each rendering thread has its own lists, since a job falls back to the calling thread when the workers are busy. A test takes the lists from its thread until it has passed their nodes on, so that tests made from within func get lists of their own.
+static _Thread_local HPSvector *visibleNodes = NULL;
+static _Thread_local unsigned int nVisibleLists = 0;
+
+static HPSvector *takeVisibleLists(unsigned int nWorkers, unsigned int *nLists){
+    HPSvector *lists = visibleNodes;
+    unsigned int i;
+    *nLists = nVisibleLists;
+    visibleNodes = NULL;
+    nVisibleLists = 0;
+    if (*nLists < nWorkers){
+        lists = realloc(lists, sizeof(HPSvector) * nWorkers);
+        for (i = *nLists; i < nWorkers; i++)
+            hpsInitVector(&lists[i], 1024);
+        *nLists = nWorkers;
+    }
+    return lists;
+}
+
+static void deleteVisibleLists(HPSvector *lists, unsigned int nLists){
+    unsigned int i;
+    for (i = 0; i < nLists; i++)
+        hpsDeleteVector(&lists[i]);
+    free(lists);
+}
+
+// Keep the larger of the given lists and any that a nested test left behind
+static void returnVisibleLists(HPSvector *lists, unsigned int nLists){
+    if (nVisibleLists >= nLists){
+        deleteVisibleLists(lists, nLists);
+    } else {
+        deleteVisibleLists(visibleNodes, nVisibleLists);
+        visibleNodes = lists;
+        nVisibleLists = nLists;
+    }
+}
+
+static void collectTree(AABBtree *tree, HPSvector *visible){
+    int i;
+    for (i = 0; i < tree->nodes.size; i++)
+	hpsPush(visible, tree->nodes.data[i]);
+    for (i = 0; i < nChildren(tree); i++)
+	collectTree(tree->children[i], visible);
+}
+
+static void collectVisible(AABBtree *tree, Plane *planes, unsigned char *hints,
+                           OcclusionBuffer *occlusion, unsigned int planeMask,
+                           HPSvector *visible){
+    unsigned int nextMask = 0;
+    int inView = inPlanes(tree, planes, hints, planeMask, &nextMask);
+    int i;
+    if ((inView == OUTSIDE) || occluded(tree, occlusion))
+        return;
+    if ((inView == INSIDE) && !occlusion)
+	collectTree(tree, visible);
+    else {
+	hpsNodesInPlanes((Node **) tree->nodes.data, tree->nodes.size, planes, nextMask,
+                         NULL, visible);
+	for (i = 0; i < nChildren(tree); i++)
+	    collectVisible(tree->children[i], planes, hints, occlusion, nextMask, visible);
+    }
+}
+
+static void visibleJob(void *data, unsigned int item, unsigned int worker){
+    VisibleJob *job = (VisibleJob *) data;
+    VisibleTask *task = job->tasks[item];
+    if (task->inside)
+        collectTree(task->tree, &job->visible[worker]);
+    else
+        collectVisible(task->tree, job->planes, job->hints, job->occlusion,
+                       task->planeMask, &job->visible[worker]);
+}
+
+static void pushTask(HPSvector *tasks, AABBtree *tree, unsigned int planeMask, bool inside){
+    VisibleTask *task = malloc(sizeof(VisibleTask));
+    task->tree = tree;
+    task->planeMask = planeMask;
+    task->inside = inside;
+    hpsPush(tasks, task);
+}
+
+static void parallelDoVisible(AABBtree *tree, Plane *planes, unsigned char *hints,
+                              OcclusionBuffer *occlusion, void (*func)(Node *),
+                              unsigned int planeMask, unsigned int nWorkers){
+    int i, j;
+    unsigned int target = nWorkers * TASKS_PER_WORKER, nLists;
+    HPSvector queue, tasks;
+    HPSvector *lists = takeVisibleLists(nWorkers, &nLists);
+    hpsInitVector(&queue, target);
+    hpsInitVector(&tasks, target);
+    pushTask(&queue, tree, planeMask, false);
+    // Breadth-first expansion of intersecting trees until there are enough tasks
+    for (i = 0; (i < queue.size) && ((queue.size - i + tasks.size) < target); i++){
+        VisibleTask *task = queue.data[i];
+        AABBtree *t = task->tree;
+        unsigned int nextMask = 0;
+        int inView = inPlanes(t, planes, hints, task->planeMask, &nextMask);
+        if ((inView == INSIDE) && !occlusion){
+            task->inside = true;
+            hpsPush(&tasks, task);
+            continue;
+        }
+        free(task);
+        if ((inView == OUTSIDE) || occluded(t, occlusion)) continue;
+        hpsNodesInPlanes((Node **) t->nodes.data, t->nodes.size, planes, nextMask,
+                         func, NULL);
+        for (j = 0; j < nChildren(t); j++)
+            pushTask(&queue, t->children[j], nextMask, false);
+    }
+    for (; i < queue.size; i++)
+        hpsPush(&tasks, queue.data[i]);
+    VisibleJob job = {(VisibleTask **) tasks.data, planes, hints, occlusion, lists};
+    hpsParallelFor(tasks.size, &visibleJob, &job);
+    for (i = 0; i < nWorkers; i++){
+        HPSvector *visible = &lists[i];
+        for (j = 0; j < visible->size; j++)
+            func(visible->data[j]);
+        visible->size = 0;
+    }
+    returnVisibleLists(lists, nLists);
+    for (i = 0; i < tasks.size; i++)
+        free(tasks.data[i]);
+    hpsDeleteVector(&queue);
+    hpsDeleteVector(&tasks);
+}
+
+void hpsAABBdoVisibleOccluded(AABBroot *root, Plane *planes, CullCache *cache,
+                              OcclusionBuffer *occlusion, void (*func)(Node *)){
+    AABBtree *tree = root->tree;
+    unsigned char *hints = planeHints(root, cache);
+    unsigned int nWorkers = hpsWorkerCount();
+    if (nWorkers > 1){
+        parallelDoVisible(tree, planes, hints, occlusion, func, ALL_PLANES, nWorkers);
+        return;
+    }
 #ifdef DEBUG
     int oldNTrees = nTrees;
     nTrees = 0;
 #endif 
-    doVisible(tree, planes, func, ALL_PLANES);
+    doVisible(tree, planes, hints, occlusion, func, ALL_PLANES);
 #ifdef DEBUG
     if ((nTrees != oldNTrees)){
         printf("%d trees were visible\n", nTrees);
@@ -512,3 +897,135 @@ void hpsAABBdoVisible(AABBtree *tree, Plane *planes, void (*func)(Node *)){
     }
 #endif 
 }
+
+void hpsAABBdoVisible(AABBroot *root, Plane *planes, CullCache *cache,
+                      void (*func)(Node *)){
+    hpsAABBdoVisibleOccluded(root, planes, cache, NULL, func);
+}
+
+/* Plane hints are kept for camera frusta alone: a volume's planes change from one query to the next, and there may be more of them than a hint has room for */
+void hpsAABBdoVisibleVolume(AABBroot *root, Plane *planes, int nPlanes,
+                            void (*func)(Node *)){
+    unsigned int nWorkers = hpsWorkerCount();
+    if (nWorkers > 1)
+        parallelDoVisible(root->tree, planes, NULL, NULL, func, hpsPlaneMask(nPlanes),
+                          nWorkers);
+    else
+        doVisible(root->tree, planes, NULL, NULL, func, hpsPlaneMask(nPlanes));
+}
+
+/* Visibility testing against several frusta
+   The tree is traversed once for all of the frusta. Each tree is tested against the frusta that its parent straddles, and subtrees that are inside of every frustum that they are not outside of are passed on without further tests. */
+static void treeMapMulti(AABBtree *tree, unsigned int inside,
+                         void (*func)(Node *, unsigned int)){
+    int i;
+    for (i = 0; i < tree->nodes.size; i++)
+	func(tree->nodes.data[i], inside);
+    for (i = 0; i < nChildren(tree); i++)
+	treeMapMulti(tree->children[i], inside, func);
+}
+
+static void doVisibleMulti(AABBtree *tree, HPSfrustum *frusta, Plane *planes, int nFrusta,
+                           unsigned int active, unsigned int inside, int *planeMasks,
+                           void (*func)(Node *, unsigned int)){
+    int masks[HPS_MAX_FRUSTA];
+    unsigned int a;
+    int i;
+    memcpy(masks, planeMasks, sizeof(int) * nFrusta);
+    active = hpsBoxInFrusta((float *) &tree->min, (float *) &tree->max, frusta,
+                            active, masks);
+    for (i = 0, a = active; a; i++, a >>= 1)
+        if ((a & 1) && !masks[i])
+            inside |= 1u << i;
+    active &= ~inside;
+    if (!active){
+        if (inside)
+            treeMapMulti(tree, inside, func);
+        return;
+    }
+    hpsNodesInFrusta((Node **) tree->nodes.data, tree->nodes.size, planes, active, masks,
+                     inside, func);
+    for (i = 0; i < nChildren(tree); i++)
+        doVisibleMulti(tree->children[i], frusta, planes, nFrusta, active, inside, masks,
+                       func);
+}
+
+void hpsAABBdoVisibleMulti(AABBroot *root, Plane *planes, int nFrusta,
+                           void (*func)(Node *, unsigned int)){
+    HPSfrustum frusta[HPS_MAX_FRUSTA];
+    int masks[HPS_MAX_FRUSTA];
+    int i;
+    hpsMakeFrusta(planes, nFrusta, frusta);
+    for (i = 0; i < nFrusta; i++)
+        masks[i] = ALL_PLANES;
+    doVisibleMulti(root->tree, frusta, planes, nFrusta,
+                   (nFrusta == HPS_MAX_FRUSTA) ? ~0u : (1u << nFrusta) - 1, 0, masks, func);
+}
+
+/* Ray casting
+   Children that the ray passes through are visited in the order that it enters them, so that once the function has shortened the ray to its nearest hit, the children beyond that hit are skipped. */
+static void raycast(AABBtree *tree, Ray *ray, void (*func)(Node *, float, void *), void *data){
+    AABBtree *children[27];
+    float entries[27], distance;
+    int i, j, n = 0;
+    for (i = 0; i < tree->nodes.size; i++){
+        Node *node = tree->nodes.data[i];
+        if (hpsRayHitsSphere(ray, node->boundingSphere, &distance))
+            func(node, distance, data);
+    }
+    for (i = 0; i < nChildren(tree); i++){
+        AABBtree *child = tree->children[i];
+        if (!hpsRayHitsBox(ray, (float *) &child->min, (float *) &child->max, &distance))
+            continue;
+        for (j = n++; (j > 0) && (entries[j - 1] > distance); j--){
+            children[j] = children[j - 1];
+            entries[j] = entries[j - 1];
+        }
+        children[j] = child;
+        entries[j] = distance;
+    }
+    for (i = 0; i < n; i++)
+        if (entries[i] <= ray->length)
+            raycast(children[i], ray, func, data);
+}
+
+void hpsAABBraycast(AABBroot *root, Ray *ray, void (*func)(Node *, float, void *), void *data){
+    float distance;
+    if (hpsRayHitsBox(ray, (float *) &root->tree->min, (float *) &root->tree->max, &distance))
+        raycast(root->tree, ray, func, data);
+}
+
+/* Overlap queries
+   As with visibility testing, trees inside of the region are passed on without further tests, and the children of trees that straddle it are only tested against the faces that their parent straddles. */
+static void overlapMap(AABBtree *tree, void (*func)(Node *, void *), void *data){
+    int i;
+    for (i = 0; i < tree->nodes.size; i++)
+        func(tree->nodes.data[i], data);
+    for (i = 0; i < nChildren(tree); i++)
+        overlapMap(tree->children[i], func, data);
+}
+
+static void overlap(AABBtree *tree, Region *region, unsigned int planeMask,
+                    void (*func)(Node *, void *), void *data){
+    unsigned int nextMask = 0;
+    HPSintersection in = hpsBoxInRegion((float *) &tree->min, (float *) &tree->max, region,
+                                        planeMask, &nextMask);
+    int i;
+    if (in == HPS_OUTSIDE)
+        return;
+    if (in == HPS_INSIDE){
+        overlapMap(tree, func, data);
+        return;
+    }
+    for (i = 0; i < tree->nodes.size; i++){
+        Node *node = tree->nodes.data[i];
+        if (hpsSphereInRegion(node->boundingSphere, region))
+            func(node, data);
+    }
+    for (i = 0; i < nChildren(tree); i++)
+        overlap(tree->children[i], region, nextMask, func, data);
+}
+
+void hpsAABBoverlap(AABBroot *root, Region *region, void (*func)(Node *, void *), void *data){
+    overlap(root->tree, region, ALL_PLANES, func, data);
+}
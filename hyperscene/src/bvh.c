@@ -0,0 +1,521 @@
+/* Bounding volume hierarchy
+   A binary tree of bounding boxes, built top-down with a binned surface area heuristic:
+     http://www.sci.utah.edu/~wald/Publications/2007/ParallelBVHBuild/fastbuild.pdf
+   Nodes are inserted into the child whose surface area grows the least, and full leaves are rebuilt into small subtrees. Moving nodes grow their leaf, and are only reinserted once their leaf would grow too large. Boxes are tightened in the maintenance step, where any subtree whose surface area has grown to REBUILD_RATIO times its area when it was built is rebuilt from scratch.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "partition.h"
+#include "memory.h"
+#include "cull.h"
+
+#define LEAF_NODES 8 // Maximum number of nodes in a leaf
+#define BINS 16
+#define TRAVERSAL_COST 1.0 // Cost of visiting a cell, relative to testing a node
+#define REBUILD_RATIO 2.0
+
+typedef struct {
+    float x, y, z;
+} Point;
+
+typedef struct bvhCell {
+    struct bvhCell *parent;
+    struct bvhCell *children[2]; // NULL for leaves
+    struct bvh *bvh;
+    Point min;
+    Point max;
+    float buildArea; // Surface area of the cell when it was built
+    bool refitPending, rebuildPending;
+    unsigned int refitIndex; // Position in refitCells, while refitPending
+    HPSvector nodes; // Only used by leaves
+    Node *nodesData[LEAF_NODES];
+} BVHcell;
+
+typedef struct bvh {
+    BVHcell *root;
+    HPSpool pool;
+    HPSvector refitCells; // Cells whose boxes may be larger than they need to be
+    HPSvector rebuildCells;
+    HPSvector buildNodes; // Scratch space for rebuilding
+} BVH;
+
+BVH *hpsBVHnew();
+void hpsBVHdelete(BVH *bvh);
+void hpsBVHaddNode(Node *node, BVH *bvh);
+void hpsBVHremoveNode(Node *node);
+void hpsBVHupdateNode(Node *node);
+void hpsBVHupdateNodes(Node **nodes, unsigned int n);
+void hpsBVHdoVisible(BVH *bvh, Plane *planes, CullCache *cache,
+                     void (*func)(Node *));
+void hpsBVHmaintain(BVH *bvh);
+void hpsBVHdoVisibleVolume(BVH *bvh, Plane *planes, int nPlanes, void (*func)(Node *));
+
+unsigned int hpsBVHpartitionPoolSize = 4096;
+
+PartitionInterface bvhPartitionInterface = {(void *(*)()) hpsBVHnew,
+                                            (void (*)(void *)) hpsBVHdelete,
+                                            (void (*)(Node *, void *)) hpsBVHaddNode,
+                                            (void (*)(Node *)) hpsBVHremoveNode,
+                                            (void (*)(Node *)) hpsBVHupdateNode,
+                                            (void (*)(void *, Plane *, CullCache *, void (*)(Node *)))
+                                              hpsBVHdoVisible,
+                                            (void (*)(void *)) hpsBVHmaintain,
+                                            NULL, NULL,
+                                            (void (*)(void *, Plane *, int, void (*)(Node *)))
+                                              hpsBVHdoVisibleVolume,
+                                            NULL, NULL,
+                                            (void (*)(Node **, unsigned int))
+                                              hpsBVHupdateNodes};
+
+PartitionInterface *hpsBVHpartitionInterface = &bvhPartitionInterface;
+
+/* Cells */
+static BVHcell *newCell(BVH *bvh, BVHcell *parent){
+    BVHcell *cell = hpsAllocateFrom(bvh->pool);
+    Point max = {-INFINITY, -INFINITY, -INFINITY};
+    Point min = {INFINITY, INFINITY, INFINITY};
+    cell->parent = parent;
+    cell->children[0] = cell->children[1] = NULL;
+    cell->bvh = bvh;
+    cell->min = min;
+    cell->max = max;
+    cell->buildArea = 0;
+    cell->refitPending = false;
+    cell->rebuildPending = false;
+    hpsInitStaticVector(&cell->nodes, cell->nodesData, LEAF_NODES);
+    return cell;
+}
+
+static bool isLeaf(BVHcell *cell){
+    return !cell->children[0];
+}
+
+static float area(Point *min, Point *max){
+    float x = max->x - min->x, y = max->y - min->y, z = max->z - min->z;
+    if ((x < 0) || (y < 0) || (z < 0)) return 0;
+    return 2 * (x*y + y*z + z*x);
+}
+
+static void growPoints(Point *min, Point *max, BoundingSphere *bs){
+    min->x = fmin(min->x, bs->x - bs->r);
+    min->y = fmin(min->y, bs->y - bs->r);
+    min->z = fmin(min->z, bs->z - bs->r);
+    max->x = fmax(max->x, bs->x + bs->r);
+    max->y = fmax(max->y, bs->y + bs->r);
+    max->z = fmax(max->z, bs->z + bs->r);
+}
+
+static bool contains(BVHcell *cell, BoundingSphere *bs){
+    return (bs->x - bs->r >= cell->min.x &&
+	    bs->y - bs->r >= cell->min.y &&
+	    bs->z - bs->r >= cell->min.z &&
+	    bs->x + bs->r <= cell->max.x &&
+	    bs->y + bs->r <= cell->max.y &&
+	    bs->z + bs->r <= cell->max.z);
+}
+
+/* Grow the cell and its ancestors until one already contains bs */
+static void growCell(BVHcell *cell, BoundingSphere *bs){
+    for (; cell && !contains(cell, bs); cell = cell->parent)
+        growPoints(&cell->min, &cell->max, bs);
+}
+
+/* Grow the ancestors of the cell until one already contains its box */
+static void growAncestors(BVHcell *cell){
+    BVHcell *parent;
+    for (parent = cell->parent; parent; parent = parent->parent){
+        if (parent->min.x <= cell->min.x && parent->min.y <= cell->min.y &&
+            parent->min.z <= cell->min.z && parent->max.x >= cell->max.x &&
+            parent->max.y >= cell->max.y && parent->max.z >= cell->max.z)
+            return;
+        parent->min.x = fmin(parent->min.x, cell->min.x);
+        parent->min.y = fmin(parent->min.y, cell->min.y);
+        parent->min.z = fmin(parent->min.z, cell->min.z);
+        parent->max.x = fmax(parent->max.x, cell->max.x);
+        parent->max.y = fmax(parent->max.y, cell->max.y);
+        parent->max.z = fmax(parent->max.z, cell->max.z);
+    }
+}
+
+static void markRefit(BVHcell *cell){
+    if (!cell->refitPending){
+        cell->refitPending = true;
+        cell->refitIndex = cell->bvh->refitCells.size;
+        hpsPush(&cell->bvh->refitCells, cell);
+    }
+}
+
+/* Swap the last cell into the place of the removed one, so that deleting a cell is constant time */
+static void unmarkRefit(BVHcell *cell){
+    HPSvector *refit = &cell->bvh->refitCells;
+    BVHcell *last = refit->data[--refit->size];
+    refit->data[cell->refitIndex] = last;
+    last->refitIndex = cell->refitIndex;
+    cell->refitPending = false;
+}
+
+static void deleteCell(BVHcell *cell){
+    if (cell->refitPending)
+        unmarkRefit(cell);
+    hpsDeleteVector(&cell->nodes);
+    hpsDeleteFrom(cell, cell->bvh->pool);
+}
+
+static void addToLeaf(BVHcell *leaf, Node *node){
+    hpsPush(&leaf->nodes, node);
+    node->area = (void *) leaf;
+}
+
+/* Building
+   Nodes are sorted into BINS bins along the axis that their centres are most spread out on, and the cell is split at the bin boundary with the lowest surface area heuristic cost. */
+static float centre(Node *node, int axis){
+    return ((float *) node->boundingSphere)[axis];
+}
+
+/* Returns the number of nodes that were moved to the front of nodes to form the first child, or 0 if the nodes should form a leaf */
+static int partitionNodes(Node **nodes, int n, float cellArea){
+    Point cmin = {INFINITY, INFINITY, INFINITY}, cmax = {-INFINITY, -INFINITY, -INFINITY};
+    int counts[BINS];
+    Point binMin[BINS], binMax[BINS];
+    float rightArea[BINS];
+    int i, j, axis = 0;
+    for (i = 0; i < n; i++){
+        BoundingSphere *bs = nodes[i]->boundingSphere;
+        BoundingSphere c = {bs->x, bs->y, bs->z, 0};
+        growPoints(&cmin, &cmax, &c);
+    }
+    float extent[3] = {cmax.x - cmin.x, cmax.y - cmin.y, cmax.z - cmin.z};
+    if (extent[1] > extent[axis]) axis = 1;
+    if (extent[2] > extent[axis]) axis = 2;
+    if (extent[axis] <= 0)
+        return (n > LEAF_NODES) ? n / 2 : 0;
+    float start = ((float *) &cmin)[axis];
+    float scale = BINS / extent[axis];
+    for (i = 0; i < BINS; i++){
+        Point max = {-INFINITY, -INFINITY, -INFINITY};
+        Point min = {INFINITY, INFINITY, INFINITY};
+        counts[i] = 0;
+        binMin[i] = min;
+        binMax[i] = max;
+    }
+    for (i = 0; i < n; i++){
+        int b = (centre(nodes[i], axis) - start) * scale;
+        if (b >= BINS) b = BINS - 1;
+        counts[b]++;
+        growPoints(&binMin[b], &binMax[b], nodes[i]->boundingSphere);
+    }
+    Point min = binMin[BINS - 1], max = binMax[BINS - 1];
+    for (i = BINS - 1; i > 0; i--){
+        rightArea[i] = area(&min, &max);
+        min.x = fmin(min.x, binMin[i - 1].x); max.x = fmax(max.x, binMax[i - 1].x);
+        min.y = fmin(min.y, binMin[i - 1].y); max.y = fmax(max.y, binMax[i - 1].y);
+        min.z = fmin(min.z, binMin[i - 1].z); max.z = fmax(max.z, binMax[i - 1].z);
+    }
+    float bestCost = INFINITY;
+    int best = 0, nLeft = 0;
+    min = binMin[0]; max = binMax[0];
+    for (i = 1; i < BINS; i++){
+        nLeft += counts[i - 1];
+        float cost = area(&min, &max) * nLeft + rightArea[i] * (n - nLeft);
+        if ((nLeft > 0) && (nLeft < n) && (cost < bestCost)){
+            bestCost = cost;
+            best = i;
+        }
+        min.x = fmin(min.x, binMin[i].x); max.x = fmax(max.x, binMax[i].x);
+        min.y = fmin(min.y, binMin[i].y); max.y = fmax(max.y, binMax[i].y);
+        min.z = fmin(min.z, binMin[i].z); max.z = fmax(max.z, binMax[i].z);
+    }
+    if ((n <= LEAF_NODES) &&
+        ((cellArea <= 0) || (TRAVERSAL_COST + bestCost / cellArea >= n)))
+        return 0;
+    if (!best)
+        return n / 2;
+    for (i = 0, j = n - 1; i <= j;){
+        if ((int) ((centre(nodes[i], axis) - start) * scale) < best){
+            i++;
+        } else {
+            Node *t = nodes[i];
+            nodes[i] = nodes[j];
+            nodes[j--] = t;
+        }
+    }
+    return i;
+}
+
+static void build(BVHcell *cell, Node **nodes, int n){
+    Point max = {-INFINITY, -INFINITY, -INFINITY};
+    Point min = {INFINITY, INFINITY, INFINITY};
+    int i;
+    for (i = 0; i < n; i++)
+        growPoints(&min, &max, nodes[i]->boundingSphere);
+    cell->min = min;
+    cell->max = max;
+    cell->buildArea = area(&min, &max);
+    int nLeft = partitionNodes(nodes, n, cell->buildArea);
+    if (!nLeft){
+        for (i = 0; i < n; i++)
+            addToLeaf(cell, nodes[i]);
+        return;
+    }
+    cell->children[0] = newCell(cell->bvh, cell);
+    cell->children[1] = newCell(cell->bvh, cell);
+    build(cell->children[0], nodes, nLeft);
+    build(cell->children[1], nodes + nLeft, n - nLeft);
+}
+
+static void collectNodes(BVHcell *cell, HPSvector *nodes){
+    int i;
+    for (i = 0; i < cell->nodes.size; i++)
+        hpsPush(nodes, cell->nodes.data[i]);
+    if (!isLeaf(cell)){
+        collectNodes(cell->children[0], nodes);
+        collectNodes(cell->children[1], nodes);
+    }
+}
+
+static void deleteChildren(BVHcell *cell){
+    int i;
+    if (isLeaf(cell)) return;
+    for (i = 0; i < 2; i++){
+        deleteChildren(cell->children[i]);
+        deleteCell(cell->children[i]);
+        cell->children[i] = NULL;
+    }
+}
+
+static void rebuild(BVHcell *cell){
+    HPSvector *nodes = &cell->bvh->buildNodes;
+    nodes->size = 0;
+    collectNodes(cell, nodes);
+    deleteChildren(cell);
+    cell->nodes.size = 0;
+    build(cell, (Node **) nodes->data, nodes->size);
+}
+
+/* Partition interface */
+BVH *hpsBVHnew(){
+    BVH *bvh = malloc(sizeof(BVH));
+    bvh->pool = hpsMakePool(sizeof(BVHcell), hpsBVHpartitionPoolSize, "BVH pool");
+    hpsInitVector(&bvh->refitCells, 64);
+    hpsInitVector(&bvh->rebuildCells, 16);
+    hpsInitVector(&bvh->buildNodes, 64);
+    bvh->root = newCell(bvh, NULL);
+    return bvh;
+}
+
+void hpsBVHdelete(BVH *bvh){
+    hpsDeletePool(bvh->pool);
+    hpsDeleteVector(&bvh->refitCells);
+    hpsDeleteVector(&bvh->rebuildCells);
+    hpsDeleteVector(&bvh->buildNodes);
+    free(bvh);
+}
+
+static void insert(BVHcell *cell, Node *node){
+    BoundingSphere *bs = node->boundingSphere;
+    while (!isLeaf(cell)){
+        growPoints(&cell->min, &cell->max, bs);
+        BVHcell *a = cell->children[0], *b = cell->children[1];
+        Point aMin = a->min, aMax = a->max, bMin = b->min, bMax = b->max;
+        growPoints(&aMin, &aMax, bs);
+        growPoints(&bMin, &bMax, bs);
+        float aCost = area(&aMin, &aMax) - area(&a->min, &a->max);
+        float bCost = area(&bMin, &bMax) - area(&b->min, &b->max);
+        cell = (aCost <= bCost) ? a : b;
+    }
+    if (cell->nodes.size < LEAF_NODES){
+        growPoints(&cell->min, &cell->max, bs);
+        addToLeaf(cell, node);
+    } else {
+        Node *nodes[LEAF_NODES + 1];
+        memcpy(nodes, cell->nodes.data, LEAF_NODES * sizeof(Node *));
+        nodes[LEAF_NODES] = node;
+        cell->nodes.size = 0;
+        build(cell, nodes, LEAF_NODES + 1);
+        /* The nodes may have moved since they were grown into the ancestors */
+        growAncestors(cell);
+    }
+    markRefit(cell);
+}
+
+void hpsBVHaddNode(Node *node, BVH *bvh){
+    insert(bvh->root, node);
+}
+
+/* Remove an empty leaf, putting its sibling in the place of its parent */
+static void removeLeaf(BVHcell *leaf){
+    BVHcell *parent = leaf->parent;
+    BVHcell *sibling = parent->children[(parent->children[0] == leaf) ? 1 : 0];
+    BVHcell *grandparent = parent->parent;
+    BVH *bvh = leaf->bvh;
+    sibling->parent = grandparent;
+    if (grandparent){
+        grandparent->children[(grandparent->children[0] == parent) ? 0 : 1] = sibling;
+        markRefit(grandparent);
+    } else {
+        bvh->root = sibling;
+    }
+    deleteCell(leaf);
+    deleteCell(parent);
+}
+
+void hpsBVHremoveNode(Node *node){
+    BVHcell *leaf = (BVHcell *) node->area;
+    if (!hpsRemove(&leaf->nodes, (void *) node)){
+	fprintf(stderr, "Warning, tried to remove node %p from a BVH leaf that it did not belong to\n", node->data);
+        return;
+    }
+    if (!leaf->nodes.size && leaf->parent)
+        removeLeaf(leaf);
+    else
+        markRefit(leaf);
+}
+
+static bool nodeFits(Node *node){
+    return contains((BVHcell *) node->area, node->boundingSphere);
+}
+
+static void keepNode(Node *node){
+    markRefit((BVHcell *) node->area);
+}
+
+static void moveNode(Node *node){
+    BVHcell *leaf = (BVHcell *) node->area;
+    BoundingSphere *bs = node->boundingSphere;
+    Point min = leaf->min, max = leaf->max;
+    growPoints(&min, &max, bs);
+    if ((leaf->buildArea > 0) &&
+        (area(&min, &max) > REBUILD_RATIO * leaf->buildArea) &&
+        leaf->parent){
+        BVH *bvh = leaf->bvh;
+        hpsBVHremoveNode(node);
+        insert(bvh->root, node);
+        return;
+    }
+    growCell(leaf, bs);
+    markRefit(leaf);
+}
+
+void hpsBVHupdateNode(Node *node){
+    if (nodeFits(node))
+        keepNode(node);
+    else
+        moveNode(node);
+}
+
+void hpsBVHupdateNodes(Node **nodes, unsigned int n){
+    hpsUpdateMovedNodes(nodes, n, &nodeFits, &keepNode, &moveNode);
+}
+
+/* Maintenance */
+static bool refitCell(BVHcell *cell){
+    Point max = {-INFINITY, -INFINITY, -INFINITY};
+    Point min = {INFINITY, INFINITY, INFINITY};
+    int i;
+    if (isLeaf(cell)){
+        for (i = 0; i < cell->nodes.size; i++)
+            growPoints(&min, &max, ((Node *) cell->nodes.data[i])->boundingSphere);
+    } else {
+        for (i = 0; i < 2; i++){
+            BVHcell *child = cell->children[i];
+            min.x = fmin(min.x, child->min.x); max.x = fmax(max.x, child->max.x);
+            min.y = fmin(min.y, child->min.y); max.y = fmax(max.y, child->max.y);
+            min.z = fmin(min.z, child->min.z); max.z = fmax(max.z, child->max.z);
+        }
+    }
+    bool changed = memcmp(&min, &cell->min, sizeof(Point)) ||
+        memcmp(&max, &cell->max, sizeof(Point));
+    cell->min = min;
+    cell->max = max;
+    return changed;
+}
+
+static bool degraded(BVHcell *cell){
+    return (cell->buildArea > 0) &&
+        (area(&cell->min, &cell->max) > REBUILD_RATIO * cell->buildArea);
+}
+
+static bool ancestorPendingRebuild(BVHcell *cell){
+    for (cell = cell->parent; cell; cell = cell->parent)
+        if (cell->rebuildPending) return true;
+    return false;
+}
+
+void hpsBVHmaintain(BVH *bvh){
+    HPSvector *refit = &bvh->refitCells, *rebuilds = &bvh->rebuildCells;
+    int i;
+    for (i = 0; i < refit->size; i++){
+        BVHcell *cell = refit->data[i];
+        BVHcell *worst = NULL;
+        cell->refitPending = false;
+        bool changed = true;
+        for (; cell; cell = cell->parent){
+            if (changed)
+                changed = refitCell(cell);
+            if (degraded(cell))
+                worst = cell;
+        }
+        if (worst && !worst->rebuildPending){
+            worst->rebuildPending = true;
+            hpsPush(rebuilds, worst);
+        }
+    }
+    refit->size = 0;
+    for (i = 0; i < rebuilds->size; i++){
+        BVHcell *cell = rebuilds->data[i];
+        if (ancestorPendingRebuild(cell))
+            rebuilds->data[i] = NULL;
+    }
+    for (i = 0; i < rebuilds->size; i++){
+        BVHcell *cell = rebuilds->data[i];
+        if (cell){
+#ifdef DEBUG
+            printf("Rebuilding BVH cell %p\n", cell);
+#endif
+            rebuild(cell);
+            cell->rebuildPending = false;
+        }
+    }
+    rebuilds->size = 0;
+}
+
+/* Visibility testing */
+static void cellMap(BVHcell *cell, void (*func)(Node *)){
+    int i;
+    for (i = 0; i < cell->nodes.size; i++)
+        func(cell->nodes.data[i]);
+    if (!isLeaf(cell)){
+        cellMap(cell->children[0], func);
+        cellMap(cell->children[1], func);
+    }
+}
+
+static void doVisible(BVHcell *cell, Plane *planes, void (*func)(Node *),
+                      unsigned int planeMask){
+    unsigned int nextMask = 0;
+    HPSintersection inView = hpsBoxInPlanes(&cell->min.x, &cell->max.x, planes,
+                                            planeMask, &nextMask);
+    if (inView == HPS_INSIDE)
+        cellMap(cell, func);
+    else if (inView == HPS_INTERSECT){
+        if (isLeaf(cell)){
+            hpsNodesInPlanes((Node **) cell->nodes.data, cell->nodes.size, planes, nextMask,
+                             func, NULL);
+        } else {
+            doVisible(cell->children[0], planes, func, nextMask);
+            doVisible(cell->children[1], planes, func, nextMask);
+        }
+    }
+}
+
+void hpsBVHdoVisible(BVH *bvh, Plane *planes, CullCache *cache,
+                     void (*func)(Node *)){
+    doVisible(bvh->root, planes, func, hpsPlaneMask(6));
+}
+
+void hpsBVHdoVisibleVolume(BVH *bvh, Plane *planes, int nPlanes, void (*func)(Node *)){
+    doVisible(bvh->root, planes, func, hpsPlaneMask(nPlanes));
+}
@@ -1,72 +1,181 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <math.h>
 #include <float.h>
+#include <pthread.h>
 #include "scene.h"
+#include "sort.h"
+#include "cull.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 #define HALF_PI 1.57079631
+#define MOVED_RATIO 4 // Moved nodes are merged into a frame cache while there are at most 1/4 as many of them as cached nodes
+#define MIN_MOVED 64 // or while there are no more than this many
 
 typedef enum {
     RIGHT, LEFT, TOP, BOTTOM, NEAR, FAR
 } Faces;
 
-static HPSvector cameraList, activeCameras, renderQueue, alphaQueue;
+static HPSvector cameraList, activeCameras;
+
+/* The nodes that one camera of a set can see, already split into render queues */
+typedef struct {
+    HPSvector renderQueue, alphaQueue, extensionNodes;
+} VisibleSet;
+
+/* Render contexts
+   Everything that is written to while a camera is rendered belongs to a render context, so that cameras can be rendered on several threads at once, each with its own context. The hpsCurrent* functions return the matrices of the context that is rendering on the calling thread, or of the thread's default context (which hpsRenderCamera uses) outside of rendering. */
+struct renderContext {
+    HPScamera camera; // Copy of the camera being rendered
+    HPSvector renderQueue, alphaQueue;
+    HPSvector extensionNodes; // Visible nodes that have extensions
+    float inverseTransposeModel[16], model[16];
+    HPSsortItem *sortItems, *sortScratch;
+    float *sortDepths;
+    size_t sortCapacity;
+    float *mvpMatrices, *inverseTransposeMatrices;
+    size_t matrixCapacity;
+    VisibleSet *visibleSets; // One for each camera of the set being rendered
+    bool *setFlags; // Two for each visible set: whether its camera was culled, and culled into it
+    unsigned int nVisibleSets;
+    VisibleSet *faceSets; // One for each face of a cube camera, made when one is first rendered
+    OcclusionBuffer *occlusion; // Made when a camera with occlusion culling is first rendered
+    ContextLights *lights; // Made when a scene with lights is first rendered
+};
+
+static _Thread_local HPSrenderContext *currentContext = NULL, *defaultContext = NULL;
+static pthread_key_t defaultContextKey; // Deletes the default context of exiting threads
+static pthread_once_t defaultContextOnce = PTHREAD_ONCE_INIT;
+
+HPSrenderContext *hpsMakeRenderContext(){
+    HPSrenderContext *context = calloc(1, sizeof(HPSrenderContext));
+    hpsInitVector(&context->renderQueue, 4096);
+    hpsInitVector(&context->alphaQueue, 1024);
+    hpsInitVector(&context->extensionNodes, 64);
+    return context;
+}
+
+static void initVisibleSets(VisibleSet *sets, unsigned int n){
+    unsigned int i;
+    for (i = 0; i < n; i++){
+        hpsInitVector(&sets[i].renderQueue, 4096);
+        hpsInitVector(&sets[i].alphaQueue, 1024);
+        hpsInitVector(&sets[i].extensionNodes, 64);
+    }
+}
+
+static void deleteVisibleSets(VisibleSet *sets, unsigned int n){
+    unsigned int i;
+    for (i = 0; i < n; i++){
+        hpsDeleteVector(&sets[i].renderQueue);
+        hpsDeleteVector(&sets[i].alphaQueue);
+        hpsDeleteVector(&sets[i].extensionNodes);
+    }
+    free(sets);
+}
+
+void hpsDeleteRenderContext(HPSrenderContext *context){
+    deleteVisibleSets(context->visibleSets, context->nVisibleSets);
+    free(context->setFlags);
+    if (context->faceSets)
+        deleteVisibleSets(context->faceSets, 6);
+    if (context->occlusion)
+        hpsDeleteOcclusionBuffer(context->occlusion);
+    if (context->lights)
+        hpsDeleteContextLights(context->lights);
+    hpsDeleteVector(&context->renderQueue);
+    hpsDeleteVector(&context->alphaQueue);
+    hpsDeleteVector(&context->extensionNodes);
+    free(context->sortItems);
+    free(context->sortScratch);
+    free(context->sortDepths);
+    free(context->mvpMatrices);
+    free(context->inverseTransposeMatrices);
+    free(context);
+}
+
+static void makeDefaultContextKey(){
+    pthread_key_create(&defaultContextKey, (void (*)(void *)) hpsDeleteRenderContext);
+}
+
+static HPSrenderContext *threadContext(){
+    if (!defaultContext){
+        pthread_once(&defaultContextOnce, makeDefaultContextKey);
+        defaultContext = hpsMakeRenderContext();
+        pthread_setspecific(defaultContextKey, defaultContext);
+    }
+    return defaultContext;
+}
+
+static HPSrenderContext *renderContext(){
+    return currentContext ? currentContext : threadContext();
+}
 
-static HPScamera currentCamera;
-static float currentInverseTransposeModel[16];
+ContextLights **hpsContextLights(){
+    return &renderContext()->lights;
+}
 
-HPScamera *hpsCurrentCamera(){ return &currentCamera; }
+HPScamera *hpsCurrentCamera(){ return &renderContext()->camera; }
 
 float *hpsCurrentCameraPosition(){
-    return (float *) &currentCamera.position;
+    return (float *) &renderContext()->camera.position;
 }
 
 float *hpsCurrentCameraProjection(){
-    return currentCamera.projection;
+    return renderContext()->camera.projection;
 }
 
 float *hpsCurrentCameraView(){
-    return currentCamera.view;
+    return renderContext()->camera.view;
 }
 
 float *hpsCurrentCameraViewProjection(){
-    return currentCamera.viewProjection;
+    return renderContext()->camera.viewProjection;
 }
 
 float *hpsCurrentCameraModelViewProjection(){
-    return currentCamera.modelViewProjection;
+    return renderContext()->camera.modelViewProjection;
 }
 
 float *hpsCurrentInverseTransposeModel(){
-    return currentInverseTransposeModel;
+    return renderContext()->inverseTransposeModel;
+}
+
+float *hpsCurrentModel(){
+    return renderContext()->model;
 }
 
+/* Called by the partition on the rendering thread */
 static void addToQueue(Node *node){
     HPSnode *n = (HPSnode *) node->data;
     if (n->pipeline){
         if (n->pipeline->isAlpha){
-            hpsPush(&alphaQueue, n);
+            hpsPush(&currentContext->alphaQueue, n);
         } else {
-            hpsPush(&renderQueue, n);
+            hpsPush(&currentContext->renderQueue, n);
         }
     }
     if (n->extension){
         hpsVisibleExtensionNode(n);
+        hpsPush(&currentContext->extensionNodes, n);
     }
 }
 
-static void renderNode(HPSnode *node, HPScamera *camera){
-    hpmMultMat4(camera->viewProjection, node->transform, 
-                camera->modelViewProjection);
-#ifndef NO_INVERSE_TRANSPOSE
-    hpmFastInverseTranspose(node->transform, currentInverseTransposeModel);
-#endif
-    node->pipeline->render(node->data);
+static void addUnoccludedToQueue(Node *node){
+    BoundingSphere *bs = node->boundingSphere;
+    float min[3] = {bs->x - bs->r, bs->y - bs->r, bs->z - bs->r};
+    float max[3] = {bs->x + bs->r, bs->y + bs->r, bs->z + bs->r};
+    if (!hpsBoxOccluded(currentContext->occlusion, min, max))
+        addToQueue(node);
 }
 
-static void clearQueues(){
-    renderQueue.size = 0;
-    alphaQueue.size = 0;
+static void clearQueues(HPSrenderContext *context){
+    context->renderQueue.size = 0;
+    context->alphaQueue.size = 0;
+    context->extensionNodes.size = 0;
 }
 
 static void xPositive(const HPMpoint *a, const HPMpoint *b, float *m, float *n){
@@ -93,14 +202,6 @@ static void zNegative(const HPMpoint *a, const HPMpoint *b, float *m, float *n){
     *m = -a->z; *n = -b->z;
 }
 
-static int programSort(const void *a, const void *b){
-    HPSpipeline *pa = (*((HPSnode **) a))->pipeline;
-    HPSpipeline *pb = (*((HPSnode **) b))->pipeline;
-    if (pa < pb) return -1;
-    else if (pa > pb) return 1;
-    return 0;
-}
-
 int hpsCloserToCamera(const HPScamera *camera, const float *a, const float *b){
     float m, n;
     camera->sort((HPMpoint *) a, (HPMpoint *) b, &m, &n);
@@ -171,52 +272,275 @@ int hpsBSFurtherFromCamera(const HPScamera *camera, const float *a, const float
     return 0;
 }
 
-static void setCameraSort(HPScamera *camera){
-    Plane *plane = &camera->planes[NEAR];
+/* The axis (0, 1, or 2 for x, y, or z) that the near plane's normal is most aligned with, and whether the normal points along or against it */
+static int dominantAxis(Plane *plane, float *sign){
     float aa, ab, ac;
-    aa = abs(plane->a); 
-    ab = abs(plane->b); 
-    ac = abs(plane->c); 
+    aa = fabs(plane->a);
+    ab = fabs(plane->b);
+    ac = fabs(plane->c);
 
     if ((aa > ab) && (aa > ac)){
-        if (plane->a > 0.0) { camera->sort = &xPositive; }
-        else                { camera->sort = &xNegative; }
+        *sign = (plane->a > 0.0) ? 1.0 : -1.0;
+        return 0;
     } else if ((ab > ac)){
-        if (plane->b > 0.0) { camera->sort = &yPositive; }
-        else                { camera->sort = &yNegative; }
-    } else {
-        if (plane->c > 0.0) { camera->sort = &zPositive; }
-        else                { camera->sort = &zNegative; }
+        *sign = (plane->b > 0.0) ? 1.0 : -1.0;
+        return 1;
     }
+    *sign = (plane->c > 0.0) ? 1.0 : -1.0;
+    return 2;
 }
 
-static int alphaSort(const void *a, const void *b){
-    BoundingSphere *ba = (*((HPSnode **) a))->partitionData.boundingSphere;
-    BoundingSphere *bb = (*((HPSnode **) b))->partitionData.boundingSphere;
-
-#ifdef ROUGH_ALPHA
+static void setCameraSort(HPScamera *camera){
+    static void (*sorts[3][2])(const HPMpoint*, const HPMpoint*, float *, float*) =
+        {{&xNegative, &xPositive}, {&yNegative, &yPositive}, {&zNegative, &zPositive}};
+    float sign;
+    int axis = dominantAxis(&camera->planes[NEAR], &sign);
+    camera->sort = sorts[axis][sign > 0.0];
+}
+
+/* Render sorting
+   Every queued node is given a 64-bit key, which the queue is then radix sorted by. Non-alpha keys are made up of the node's pipeline id, its sort bits, and its depth along the dominant axis (so that each pipeline is drawn front to back), which is the same order given by hpsBSCloserToCamera. Alpha keys are made up of the node's depth, inverted so that the furthest nodes come first, followed by its pipeline id and sort bits. */
+static void reserveSortBuffers(HPSrenderContext *context, size_t n){
+    size_t capacity = context->sortCapacity;
+    if (n <= capacity) return;
+    capacity = (n > capacity * 2) ? n : capacity * 2;
+    context->sortCapacity = capacity;
+    context->sortItems = realloc(context->sortItems, sizeof(HPSsortItem) * capacity);
+    context->sortScratch = realloc(context->sortScratch, sizeof(HPSsortItem) * capacity);
+    context->sortDepths = realloc(context->sortDepths, sizeof(float) * capacity);
+    if (!context->sortItems || !context->sortScratch || !context->sortDepths){
+        fprintf(stderr, "Unable to allocate render sort buffers\n");
+        exit(EXIT_FAILURE);
+    }
+}
 
-#ifdef VOLUMETRIC_ALPHA
-    return hpsBSFurtherFromCameraRough(&currentCamera, ba, bb);
+/* Maps floats to unsigned ints with the same ordering */
+static uint32_t floatKey(float f){
+    union { float f; uint32_t u; } v;
+    v.f = f;
+    return (v.u & 0x80000000) ? ~v.u : (v.u | 0x80000000);
+}
+
+/* Depths
+   The depths of a queue's nodes are computed in a single pass before it is sorted, four at a time when SSE is available. Rough depths are positions along the dominant axis, while exact depths are squared distances from the camera. Volumetric depths take the radius of the bounding sphere into account, in the same way as hpsBSFurtherFromCamera and hpsBSFurtherFromCameraRough. */
+static float *queuedSphere(HPSvector *queue, size_t i){
+    return (float *) ((HPSnode *) queue->data[i])->partitionData.boundingSphere;
+}
+
+static float depth(const float *bs, const HPMpoint *c, int sorting, int axis, float sign){
+    float r = (sorting & HPS_VOLUMETRIC_ALPHA) ? bs[3] : 0.0;
+    if (sorting & HPS_ROUGH_ALPHA)
+        return sign * bs[axis] - r;
+    float x = bs[0] - c->x - r;
+    float y = bs[1] - c->y - r;
+    float z = bs[2] - c->z - r;
+    return x*x + y*y + z*z;
+}
+
+static void computeDepths(HPSvector *queue, HPScamera *camera, int sorting, float *depths){
+    size_t i = 0, n = queue->size;
+    HPMpoint *c = &camera->position;
+    float sign;
+    int axis = dominantAxis(&camera->planes[NEAR], &sign);
+#ifdef __SSE__
+    for (; i + 4 <= n; i += 4){
+        __m128 x = _mm_loadu_ps(queuedSphere(queue, i));
+        __m128 y = _mm_loadu_ps(queuedSphere(queue, i + 1));
+        __m128 z = _mm_loadu_ps(queuedSphere(queue, i + 2));
+        __m128 r = _mm_loadu_ps(queuedSphere(queue, i + 3));
+        __m128 d;
+        _MM_TRANSPOSE4_PS(x, y, z, r);
+        if (!(sorting & HPS_VOLUMETRIC_ALPHA))
+            r = _mm_setzero_ps();
+        if (sorting & HPS_ROUGH_ALPHA){
+            d = (axis == 0) ? x : ((axis == 1) ? y : z);
+            d = _mm_sub_ps(_mm_mul_ps(d, _mm_set1_ps(sign)), r);
+        } else {
+            x = _mm_sub_ps(_mm_sub_ps(x, _mm_set1_ps(c->x)), r);
+            y = _mm_sub_ps(_mm_sub_ps(y, _mm_set1_ps(c->y)), r);
+            z = _mm_sub_ps(_mm_sub_ps(z, _mm_set1_ps(c->z)), r);
+            d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+                           _mm_mul_ps(z, z));
+        }
+        _mm_storeu_ps(depths + i, d);
+    }
+#endif
+    for (; i < n; i++)
+        depths[i] = depth(queuedSphere(queue, i), c, sorting, axis, sign);
+}
+
+// Fill items with the keys of the queue's nodes. The sort buffers must have room for the queue.
+static void queueKeys(HPSrenderContext *context, HPSvector *queue, bool alpha,
+                      HPSsortItem *items){
+    HPScamera *camera = &context->camera;
+    size_t i, n = queue->size;
+    float *sortDepths = context->sortDepths;
+    if (alpha)
+        computeDepths(queue, camera, camera->alphaSorting, sortDepths);
+#ifndef NO_REVERSE_PAINTER
+    else
+        computeDepths(queue, camera, HPS_ROUGH_ALPHA | HPS_VOLUMETRIC_ALPHA, sortDepths);
+#endif
+    for (i = 0; i < n; i++){
+        HPSnode *node = queue->data[i];
+        uint64_t group = ((uint64_t) node->pipeline->id << 16) | node->sortBits;
+        uint64_t key;
+        if (alpha){
+            uint32_t depth = ~floatKey(sortDepths[i]);
+            key = ((uint64_t) depth << 32) | group;
+        } else {
+#ifdef NO_REVERSE_PAINTER
+            key = group << 32;
 #else
-    return hpsFurtherFromCameraRough(&currentCamera, (float *) ba, (float *) bb);
+            key = (group << 32) | floatKey(sortDepths[i]);
 #endif
+        }
+        items[i].key = key;
+        items[i].value = node;
+    }
+}
 
-#else // not ROUGH_ALPHA
+static void storeItems(struct frameCache *cache, bool alpha, HPSsortItem *items, size_t n);
+
+// The sorted items are kept in cache, when one is given
+static void sortQueue(HPSrenderContext *context, HPSvector *queue, bool alpha,
+                      struct frameCache *cache){
+    size_t i, n = queue->size;
+    if ((n < 2) && !cache) return;
+    reserveSortBuffers(context, n);
+    queueKeys(context, queue, alpha, context->sortItems);
+    HPSsortItem *sorted = hpsRadixSort(context->sortItems, context->sortScratch, n);
+    for (i = 0; i < n; i++)
+        queue->data[i] = sorted[i].value;
+    if (cache)
+        storeItems(cache, alpha, sorted, n);
+}
+
+/* Matrices
+   Once the queues are sorted, the model-view-projection and inverse transpose model matrices of every queued node are computed in a single pass into 16-byte aligned arrays (with the non-alpha queue first), using SSE when it is available. Each node's matrices are then copied into the context's current matrices as the node is rendered, so that the pointers returned by hpsCurrentCameraModelViewProjection and hpsCurrentInverseTransposeModel remain valid across nodes. Only the matrices that the node's pipeline asks for are computed and copied, and nodes that cache their inverse transpose have it copied from the cache. */
+static float *allocateMatrices(size_t n){
+    void *matrices;
+    if (posix_memalign(&matrices, 16, sizeof(float) * 16 * n)){
+        fprintf(stderr, "Unable to allocate render matrices\n");
+        exit(EXIT_FAILURE);
+    }
+    return matrices;
+}
 
-#ifdef VOLUMETRIC_ALPHA
-    return hpsBSFurtherFromCamera(&currentCamera, ba, bb);
+static void reserveMatrices(HPSrenderContext *context, size_t n){
+    size_t capacity = context->matrixCapacity;
+    if (n <= capacity) return;
+    capacity = (n > capacity * 2) ? n : capacity * 2;
+    context->matrixCapacity = capacity;
+    free(context->mvpMatrices);
+    context->mvpMatrices = allocateMatrices(capacity);
+#ifndef NO_INVERSE_TRANSPOSE
+    free(context->inverseTransposeMatrices);
+    context->inverseTransposeMatrices = allocateMatrices(capacity);
+#endif
+}
+
+#ifdef __SSE__
+/* Each column of the result is the columns of a, weighted by the elements of the matching column of b: the same sums as hpmMultMat4 */
+static void multMat4(__m128 a0, __m128 a1, __m128 a2, __m128 a3, const float *b, float *result){
+    int j;
+    for (j = 0; j < 4; j++){
+        const float *col = b + j*4;
+        __m128 r = _mm_mul_ps(a0, _mm_set1_ps(col[0]));
+        r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(col[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(col[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(col[3])));
+        _mm_store_ps(result + j*4, r);
+    }
+}
+
+#ifndef NO_INVERSE_TRANSPOSE
+/* As hpmFastInverseTranspose: the rotation is kept, and the translation becomes the negated translation rotated by the transposed rotation */
+static void fastInverseTranspose(const float *m, float *result){
+    __m128 c0 = _mm_loadu_ps(m);
+    __m128 c1 = _mm_loadu_ps(m + 4);
+    __m128 c2 = _mm_loadu_ps(m + 8);
+    __m128 r0 = c0, r1 = c1, r2 = c2, r3 = _mm_loadu_ps(m + 12);
+    float t[4];
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3); // Rows of the matrix
+    _mm_storeu_ps(t, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r0, _mm_set1_ps(m[12])),
+                                           _mm_mul_ps(r1, _mm_set1_ps(m[13]))),
+                                _mm_mul_ps(r2, _mm_set1_ps(m[14]))));
+    _mm_store_ps(result, c0);
+    _mm_store_ps(result + 4, c1);
+    _mm_store_ps(result + 8, c2);
+    _mm_store_ps(result + 12, _mm_set_ps(1, 0, 0, 0));
+    result[3] = -t[0];
+    result[7] = -t[1];
+    result[11] = -t[2];
+}
+#endif
+#endif
+
+static void computeMatrices(HPSrenderContext *context, HPSvector *queue, size_t offset){
+    HPScamera *camera = &context->camera;
+    size_t i;
+    float *mvp = context->mvpMatrices + offset*16;
+#ifndef NO_INVERSE_TRANSPOSE
+    float *inverseTranspose = context->inverseTransposeMatrices + offset*16;
+#endif
+#ifdef __SSE__
+    const float *vp = camera->viewProjection;
+    __m128 a0 = _mm_loadu_ps(vp), a1 = _mm_loadu_ps(vp + 4),
+        a2 = _mm_loadu_ps(vp + 8), a3 = _mm_loadu_ps(vp + 12);
+    for (i = 0; i < queue->size; i++){
+        HPSnode *node = queue->data[i];
+        int matrices = node->pipeline->matrices;
+        if (matrices & HPS_MVP_MATRIX)
+            multMat4(a0, a1, a2, a3, node->transform, mvp + i*16);
+#ifndef NO_INVERSE_TRANSPOSE
+        if ((matrices & HPS_INVERSE_TRANSPOSE_MATRIX) && !node->inverseTranspose)
+            fastInverseTranspose(node->transform, inverseTranspose + i*16);
+#endif
+    }
 #else
-    return hpsFurtherFromCamera(&currentCamera, (float *) ba, (float *) bb);
+    for (i = 0; i < queue->size; i++){
+        HPSnode *node = queue->data[i];
+        int matrices = node->pipeline->matrices;
+        if (matrices & HPS_MVP_MATRIX)
+            hpmMultMat4(camera->viewProjection, node->transform, mvp + i*16);
+#ifndef NO_INVERSE_TRANSPOSE
+        if ((matrices & HPS_INVERSE_TRANSPOSE_MATRIX) && !node->inverseTranspose)
+            hpmFastInverseTranspose(node->transform, inverseTranspose + i*16);
+#endif
+    }
 #endif
+}
 
-#endif // ROUGH_ALPHA
+static void renderNode(HPSrenderContext *context, HPSnode *node, size_t i){
+    int matrices = node->pipeline->matrices;
+    if (matrices & HPS_MVP_MATRIX)
+        memcpy(context->camera.modelViewProjection, context->mvpMatrices + i*16,
+               sizeof(float) * 16);
+    if (matrices & HPS_MODEL_MATRIX)
+        memcpy(context->model, node->transform, sizeof(float) * 16);
+#ifndef NO_INVERSE_TRANSPOSE
+    if (matrices & HPS_INVERSE_TRANSPOSE_MATRIX)
+        memcpy(context->inverseTransposeModel, node->inverseTranspose ?
+               node->inverseTranspose : context->inverseTransposeMatrices + i*16,
+               sizeof(float) * 16);
+#endif
+    node->pipeline->render(node->data);
 }
 
-static int renderSort(const void *a, const void *b){
-    BoundingSphere *ba = (*((HPSnode **) a))->partitionData.boundingSphere;
-    BoundingSphere *bb = (*((HPSnode **) b))->partitionData.boundingSphere;
-    return hpsBSCloserToCamera(&currentCamera, (float *) ba, (float *) bb);
+/* Render the queue's nodes, one group of nodes that share a pipeline at a time. offset is the index of the queue's first matrices. */
+static void drawQueue(HPSrenderContext *context, HPSvector *queue, size_t offset){
+    HPSnode **nodes = (HPSnode **) queue->data;
+    size_t i = 0;
+    while (i < queue->size){
+        struct pipeline *p = nodes[i]->pipeline;
+        p->preRender(nodes[i]->data);
+        do {
+            renderNode(context, nodes[i], offset + i);
+            i++;
+        } while ((i < queue->size) && (nodes[i]->pipeline == p));
+        p->postRender();
+    }
 }
 
 #ifdef DEBUG
@@ -224,77 +548,37 @@ int nonAlphaObjects = 0;
 int alphaObjects = 0;
 #endif 
 
-static void renderQueues(HPScamera *camera){
+static void drawQueues(HPSrenderContext *context){
+    HPSvector *renderQueue = &context->renderQueue, *alphaQueue = &context->alphaQueue;
+    reserveMatrices(context, renderQueue->size + alphaQueue->size);
+    computeMatrices(context, renderQueue, 0);
+    computeMatrices(context, alphaQueue, renderQueue->size);
+    drawQueue(context, renderQueue, 0);
+    drawQueue(context, alphaQueue, renderQueue->size);
+}
+
+static void renderQueues(HPSrenderContext *context, struct frameCache *cache){
+    HPSvector *renderQueue = &context->renderQueue, *alphaQueue = &context->alphaQueue;
 #ifdef DEBUG
-    int nonAlpha = renderQueue.size;
-    int alpha = alphaQueue.size;
+    int nonAlpha = renderQueue->size;
+    int alpha = alphaQueue->size;
     if ((alpha != alphaObjects) || (nonAlpha != nonAlphaObjects)){
         printf("Rendering %d non-alpha objects, %d alpha objects\n", nonAlpha, alpha);
         nonAlphaObjects = nonAlpha;
         alphaObjects = alpha;
     }
 #endif 
-    int i, j, count;
-    struct pipeline *p = NULL;
-    qsort(renderQueue.data, renderQueue.size, sizeof(void *), &programSort);
-    HPSnode **nodes = (HPSnode **) renderQueue.data;
-    for (i = 0; i < renderQueue.size;){
-        HPSnode *n = *nodes;
-        p = n->pipeline;
-        p->preRender(n->data);
-#ifdef NO_REVERSE_PAINTER
-        renderNode(n, camera);
-        for (count = 1; count < (renderQueue.size - i);){
-            HPSnode *m = *(++nodes);
-            if (m->pipeline == p){
-                renderNode(m, camera);
-                count++;
-            } else break;
-        }
-#else
-        HPSnode **m = nodes + 1;
-        for (count = 1; count < (renderQueue.size - i);){
-            if ((*m)->pipeline == p){
-                m++;
-                count++;
-            } else {
-                break;
-            }
-        }
-        qsort(nodes, count, sizeof(void *), renderSort);
-
-        for (j = 0; j < count; j++){
-            renderNode(*nodes, camera);
-            nodes++;
-        }
-#endif
-        p->postRender();
-        i += count;
-    }
-    qsort(alphaQueue.data, alphaQueue.size, sizeof(void *), alphaSort);
-    nodes = (HPSnode **) &alphaQueue.data[0];
-    for (i = 0; i < alphaQueue.size;){
-        HPSnode *n = *nodes;
-        p = n->pipeline;
-        p->preRender(n->data);
-        renderNode(n, camera);
-        for (count = 1; count < (alphaQueue.size - i);){
-            HPSnode *m = *(++nodes);
-            if (m->pipeline == p){
-                renderNode(m, camera);
-                count++;
-            } else break;
-        }
-        p->postRender();
-        i += count;
-    }
+    sortQueue(context, renderQueue, false, cache);
+    sortQueue(context, alphaQueue, true, cache);
+    drawQueues(context);
 }
 
 /*
 http://web.archive.org/web/20120531231005/http://crazyjoke.free.fr/doc/3D/plane%20extraction.pdf
 */
-/* Normals (pointing in) are (a, b, c) */
+/* Normals (pointing in) are (a, b, c), normalized so that the partition can test bounding spheres against the planes */
 static void computePlanes(HPScamera *camera){
+    int i;
     Plane *ps = camera->planes;
     HPMmat4 *m = (HPMmat4 *) camera->viewProjection;
     ps[LEFT].a   = m->_41 + m->_11; ps[LEFT].b   = m->_42 + m->_12;
@@ -309,11 +593,15 @@ static void computePlanes(HPScamera *camera){
     ps[NEAR].c   = m->_43 + m->_33; ps[NEAR].d   = m->_44 + m->_34;
     ps[FAR].a    = m->_41 - m->_31; ps[FAR].b    = m->_42 - m->_32;
     ps[FAR].c    = m->_43 - m->_33; ps[FAR].d    = m->_44 - m->_34;
+    for (i = 0; i < 6; i++){
+        float l = sqrt(ps[i].a*ps[i].a + ps[i].b*ps[i].b + ps[i].c*ps[i].c);
+        ps[i].a /= l; ps[i].b /= l; ps[i].c /= l; ps[i].d /= l;
+    }
 }
 
 void hpsUpdateCamera(HPScamera *camera){
     HPScamera *c = camera;
-    float cameraMat[16];
+    float cameraMat[16], viewProjection[16];
     switch (camera->style){
     case HPS_ORBIT:
     {
@@ -347,21 +635,426 @@ void hpsUpdateCamera(HPScamera *camera){
         fprintf(stderr, "Camera does not have a valid style\n");
         exit(EXIT_FAILURE);
     }
+    memcpy(viewProjection, c->viewProjection, sizeof(viewProjection));
     hpmMultMat4(c->projection, c->view, c->viewProjection);
+    if (memcmp(viewProjection, c->viewProjection, sizeof(viewProjection)))
+        c->version++;
 }
 
-void hpsRenderCamera(HPScamera *camera){
-    currentCamera = *camera; // Set current camera to this one
-    HPScamera *c = &currentCamera;
-    clearQueues();
-    computePlanes(c);
-    c->scene->partitionInterface->doVisible(c->scene->partitionStruct,
-                                            c->planes, &addToQueue);
-    setCameraSort(c);
+static void swapVectors(HPSvector *a, HPSvector *b){
+    HPSvector tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/* Cube cameras
+   A cube camera renders six 90° faces around its position, one along each axis. The scene is culled once, against the cube that bounds the six frusta, and each visible node is then routed to the faces that it overlaps. Extensions see the cube camera as a whole: they are given its visible nodes and pre/post-render calls once, rather than once per face. */
+static float faceDirections[6][3] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0},
+                                     {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+static float faceUps[6][3] = {{0, -1, 0}, {0, -1, 0}, {0, 0, 1},
+                              {0, 0, -1}, {0, -1, 0}, {0, -1, 0}};
+
+// Planes of the cube that holds all six faces, in opposing pairs
+static void computeCubePlanes(HPScamera *camera){
+    Plane *ps = camera->planes;
+    HPMpoint *p = &camera->position;
+    float f = camera->f;
+    ps[0] = (Plane) {-1, 0, 0, p->x + f}; ps[1] = (Plane) {1, 0, 0, f - p->x};
+    ps[2] = (Plane) {0, -1, 0, p->y + f}; ps[3] = (Plane) {0, 1, 0, f - p->y};
+    ps[4] = (Plane) {0, 0, -1, p->z + f}; ps[5] = (Plane) {0, 0, 1, f - p->z};
+}
+
+/* Each face sees the points whose distance along its axis is at least as large as their distance along the other two, so the sphere is tested against the planes x = ±y, x = ±z and y = ±z (a distance of r along their normals is r√2 along these sums), along with the near plane of each face. */
+static int cubeFaces(BoundingSphere *bs, HPMpoint *p, float near){
+    float x = bs->x - p->x, y = bs->y - p->y, z = bs->z - p->z;
+    float r = bs->r * M_SQRT2, n = near - bs->r;
+    float xPlusY = x + y, xMinusY = x - y, xPlusZ = x + z, xMinusZ = x - z;
+    float yPlusZ = y + z, yMinusZ = y - z;
+    int faces = 0;
+    if ((x >= n) && (xMinusY >= -r) && (xPlusY >= -r) && (xMinusZ >= -r) && (xPlusZ >= -r))
+        faces |= 1 << HPS_POSITIVE_X;
+    if ((-x >= n) && (xPlusY <= r) && (xMinusY <= r) && (xPlusZ <= r) && (xMinusZ <= r))
+        faces |= 1 << HPS_NEGATIVE_X;
+    if ((y >= n) && (xMinusY <= r) && (xPlusY >= -r) && (yMinusZ >= -r) && (yPlusZ >= -r))
+        faces |= 1 << HPS_POSITIVE_Y;
+    if ((-y >= n) && (xPlusY <= r) && (xMinusY >= -r) && (yPlusZ <= r) && (yMinusZ <= r))
+        faces |= 1 << HPS_NEGATIVE_Y;
+    if ((z >= n) && (xMinusZ <= r) && (xPlusZ >= -r) && (yMinusZ <= r) && (yPlusZ >= -r))
+        faces |= 1 << HPS_POSITIVE_Z;
+    if ((-z >= n) && (xPlusZ <= r) && (xMinusZ >= -r) && (yPlusZ <= r) && (yMinusZ >= -r))
+        faces |= 1 << HPS_NEGATIVE_Z;
+    return faces;
+}
+
+/* Called by the partition on the rendering thread */
+static void addToFaces(Node *node){
+    HPSnode *n = (HPSnode *) node->data;
+    HPScamera *c = &currentContext->camera;
+    int faces, i;
+    if (n->extension)
+        hpsVisibleExtensionNode(n);
+    if (!n->pipeline)
+        return;
+    faces = cubeFaces(node->boundingSphere, &c->position, c->n);
+    for (i = 0; faces; i++, faces >>= 1){
+        if (faces & 1){
+            VisibleSet *face = &currentContext->faceSets[i];
+            hpsPush(n->pipeline->isAlpha ? &face->alphaQueue : &face->renderQueue, n);
+        }
+    }
+}
+
+static void renderCube(HPScamera *camera, HPSrenderContext *context){
+    HPScamera *c = &context->camera;
+    PartitionInterface *partition = c->scene->partitionInterface;
+    VisibleSet *faces;
+    int i;
+    if (!context->faceSets){
+        context->faceSets = malloc(sizeof(VisibleSet) * 6);
+        initVisibleSets(context->faceSets, 6);
+    }
+    faces = context->faceSets;
+    for (i = 0; i < 6; i++){
+        faces[i].renderQueue.size = 0;
+        faces[i].alphaQueue.size = 0;
+    }
+    computeCubePlanes(c);
+    memcpy(camera->planes, c->planes, sizeof(c->planes));
+    // The planes bound a box around the camera rather than a frustum, so partitions that can take any volume are given them as one
+    if (partition->doVisibleVolume)
+        partition->doVisibleVolume(c->scene->partitionStruct, c->planes, 6, &addToFaces);
+    else
+        partition->doVisible(c->scene->partitionStruct, c->planes, c->cullCache, &addToFaces);
     hpsPreRenderExtensions(c->scene);
-    renderQueues(c);
+    for (i = 0; i < 6; i++){
+        float target[3] = {c->position.x + faceDirections[i][0],
+                           c->position.y + faceDirections[i][1],
+                           c->position.z + faceDirections[i][2]};
+        hpmLookAt((float *) &c->position, target, faceUps[i], c->view);
+        hpmMultMat4(c->projection, c->view, c->viewProjection);
+        computePlanes(c);
+        setCameraSort(c);
+        swapVectors(&context->renderQueue, &faces[i].renderQueue);
+        swapVectors(&context->alphaQueue, &faces[i].alphaQueue);
+        if (c->faceFunction)
+            c->faceFunction(camera, i);
+        renderQueues(context, NULL);
+    }
+    hpsPostRenderExtensions(c->scene);
+}
+
+/* Occlusion culling
+   Cameras with occlusion culling rasterize the occluders of every node inside of their frustum into their context's occlusion buffer before the scene is culled (see occlusion.c). Partitions that support doVisibleOccluded skip the areas that are hidden, and every visible node is then tested on its own. */
+static void rasterizeOccluders(HPSrenderContext *context){
+    HPScamera *c = &context->camera;
+    HPSvector *occluders = &c->scene->occluders;
+    OcclusionBuffer *occlusion = context->occlusion;
+    unsigned int width = 0, height = 0;
+    // The size hpsMakeOcclusionBuffer gives a buffer of the requested size
+    unsigned int wantedWidth = (hpsOcclusionBufferWidth < 4) ? 4 : (hpsOcclusionBufferWidth + 3) & ~3u;
+    unsigned int wantedHeight = hpsOcclusionBufferHeight ? hpsOcclusionBufferHeight : 1;
+    int i;
+    if (occlusion)
+        hpsOcclusionBufferSize(occlusion, &width, &height);
+    if (!occlusion || (width != wantedWidth) || (height != wantedHeight)){
+        if (occlusion)
+            hpsDeleteOcclusionBuffer(occlusion);
+        occlusion = context->occlusion = hpsMakeOcclusionBuffer(hpsOcclusionBufferWidth,
+                                                                hpsOcclusionBufferHeight);
+    }
+    hpsClearOcclusionBuffer(occlusion, c->viewProjection);
+    for (i = 0; i < occluders->size; i++){
+        HPSnode *node = occluders->data[i];
+        Node *n = &node->partitionData;
+        if (hpsSpheresInPlanes(&n, 1, c->planes, hpsPlaneMask(6)))
+            hpsRasterizeOccluder(occlusion, node->occluder, node->transform);
+    }
+    hpsBuildOcclusionPyramid(occlusion);
+}
+
+static void cullScene(HPSrenderContext *context){
+    HPScamera *c = &context->camera;
+    HPSscene *scene = c->scene;
+    PartitionInterface *partition = scene->partitionInterface;
+    if (!c->occlusionCulling || !scene->occluders.size){
+        partition->doVisible(scene->partitionStruct, c->planes, c->cullCache, &addToQueue);
+        return;
+    }
+    rasterizeOccluders(context);
+    if (partition->doVisibleOccluded)
+        partition->doVisibleOccluded(scene->partitionStruct, c->planes, c->cullCache,
+                                     context->occlusion, &addUnoccludedToQueue);
+    else
+        partition->doVisible(scene->partitionStruct, c->planes, c->cullCache,
+                             &addUnoccludedToQueue);
+}
+
+/* Frame caching
+   Each camera keeps the sorted queues of the last frame that it rendered, along with the versions of the camera and of its scene that they were made from. When neither has changed since, the queues are drawn again without the camera being culled or sorted. When the only change is that the scene's last update moved a few nodes, the moved nodes are taken out of the queues, tested against the camera's planes again, and merged back into the queues by their keys (which have not changed for any of the other nodes). Moved nodes are not merged for cameras with occlusion culling, since a moved occluder can hide or reveal nodes that have not moved, nor for partitions that cull nodes that are inside of the frustum, such as portals. Cube cameras are not cached. */
+struct frameCache {
+    bool valid;
+    unsigned int cameraVersion, sceneVersion;
+    HPSsortItem *items[2]; // Sorted render and alpha queues, with their keys
+    size_t size[2], capacity[2];
+    HPSvector extensionNodes;
+};
+
+typedef enum {
+    FRAME_CHANGED, FRAME_MOVED, FRAME_UNCHANGED
+} FrameState;
+
+static struct frameCache *makeFrameCache(){
+    struct frameCache *cache = calloc(1, sizeof(struct frameCache));
+    hpsInitVector(&cache->extensionNodes, 64);
+    return cache;
+}
+
+static void deleteFrameCache(struct frameCache *cache){
+    free(cache->items[0]);
+    free(cache->items[1]);
+    hpsDeleteVector(&cache->extensionNodes);
+    free(cache);
+}
+
+static void storeItems(struct frameCache *cache, bool alpha, HPSsortItem *items, size_t n){
+    if (n > cache->capacity[alpha]){
+        cache->capacity[alpha] = n * 2;
+        cache->items[alpha] = realloc(cache->items[alpha], sizeof(HPSsortItem) * n * 2);
+        if (!cache->items[alpha]){
+            fprintf(stderr, "Unable to allocate frame cache\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (n)
+        memcpy(cache->items[alpha], items, sizeof(HPSsortItem) * n);
+    cache->size[alpha] = n;
+}
+
+static FrameState frameState(HPScamera *camera){
+    struct frameCache *cache = camera->frameCache;
+    HPSscene *scene = camera->scene;
+    size_t moved = scene->movedNodes.size;
+    if ((camera->type == HPS_CUBE) || !cache->valid ||
+        (cache->cameraVersion != camera->version))
+        return FRAME_CHANGED;
+    if (cache->sceneVersion == scene->version)
+        return FRAME_UNCHANGED;
+    if (!camera->occlusionCulling && !scene->partitionInterface->cullsBeyondFrustum &&
+        (cache->sceneVersion == scene->movedFrom) && (scene->version == scene->movedVersion) &&
+        ((moved <= MIN_MOVED) || (moved * MOVED_RATIO <= cache->size[0] + cache->size[1])))
+        return FRAME_MOVED;
+    return FRAME_CHANGED;
+}
+
+static void restoreQueue(HPSvector *queue, struct frameCache *cache, bool alpha){
+    HPSsortItem *items = cache->items[alpha];
+    size_t i;
+    queue->size = 0;
+    for (i = 0; i < cache->size[alpha]; i++)
+        hpsPush(queue, items[i].value);
+}
+
+static void replayFrame(HPSrenderContext *context, struct frameCache *cache){
+    HPSvector *extensionNodes = &cache->extensionNodes;
+    size_t i;
+    restoreQueue(&context->renderQueue, cache, false);
+    restoreQueue(&context->alphaQueue, cache, true);
+    for (i = 0; i < extensionNodes->size; i++)
+        hpsVisibleExtensionNode(extensionNodes->data[i]);
+}
+
+// queue holds the moved nodes that are visible. Cached items are kept ahead of moved items with equal keys.
+static void mergeQueue(HPSrenderContext *context, HPSvector *queue, bool alpha,
+                       struct frameCache *cache, unsigned int version){
+    HPSsortItem *cached = cache->items[alpha], *moved, *merged;
+    size_t i = 0, j = 0, k, n = 0, m = queue->size;
+    for (k = 0; k < cache->size[alpha]; k++)
+        if (((HPSnode *) cached[k].value)->movedVersion != version)
+            cached[n++] = cached[k];
+    reserveSortBuffers(context, n + m);
+    queueKeys(context, queue, alpha, context->sortItems);
+    moved = hpsRadixSort(context->sortItems, context->sortScratch, m);
+    merged = (moved == context->sortItems) ? context->sortScratch : context->sortItems;
+    for (k = 0; k < n + m; k++)
+        merged[k] = ((j == m) || ((i < n) && (cached[i].key <= moved[j].key))) ?
+            cached[i++] : moved[j++];
+    storeItems(cache, alpha, merged, n + m);
+    restoreQueue(queue, cache, alpha);
+}
+
+static void updateFrame(HPSrenderContext *context, struct frameCache *cache){
+    HPScamera *c = &context->camera;
+    HPSscene *scene = c->scene;
+    HPSvector *extensionNodes = &cache->extensionNodes;
+    size_t i;
+    clearQueues(context);
+    for (i = 0; i < extensionNodes->size; i++){
+        HPSnode *node = extensionNodes->data[i];
+        if (node->movedVersion != scene->version){
+            hpsVisibleExtensionNode(node);
+            hpsPush(&context->extensionNodes, node);
+        }
+    }
+    hpsNodesInPlanes((Node **) scene->movedNodes.data, scene->movedNodes.size, c->planes,
+                     hpsPlaneMask(6), &addToQueue, NULL);
+    mergeQueue(context, &context->renderQueue, false, cache, scene->version);
+    mergeQueue(context, &context->alphaQueue, true, cache, scene->version);
+    swapVectors(&context->extensionNodes, extensionNodes);
+    cache->sceneVersion = scene->version;
+}
+
+/* The camera is copied into the context while it is rendered. Only the results of rendering (its planes and sorting axis) are copied back, so a camera should not be rendered on two threads at once. When visible is given, it holds the nodes that the camera can see, and the camera's planes have already been computed. */
+static void renderInContext(HPScamera *camera, HPSrenderContext *context,
+                            VisibleSet *visible){
+    HPSrenderContext *previous = currentContext;
+    struct frameCache *cache = camera->frameCache;
+    FrameState state = visible ? FRAME_CHANGED : frameState(camera);
+    int i;
+    currentContext = context;
+    // Copied with memcpy, since type-based alias analysis lets computePlanes' HPMmat4 reads move ahead of a struct assignment
+    memcpy(&context->camera, camera, sizeof(HPScamera));
+    HPScamera *c = &context->camera;
+    if (c->type == HPS_CUBE){
+        renderCube(camera, context);
+        currentContext = previous;
+        return;
+    }
+    if (visible){
+        swapVectors(&context->renderQueue, &visible->renderQueue);
+        swapVectors(&context->alphaQueue, &visible->alphaQueue);
+        swapVectors(&context->extensionNodes, &visible->extensionNodes);
+        for (i = 0; i < context->extensionNodes.size; i++)
+            hpsVisibleExtensionNode(context->extensionNodes.data[i]);
+    } else if (state == FRAME_UNCHANGED){
+        replayFrame(context, cache);
+    } else if (state == FRAME_MOVED){
+        updateFrame(context, cache);
+    } else {
+        clearQueues(context);
+        computePlanes(c);
+        cullScene(context);
+    }
+    if (state == FRAME_CHANGED){
+        setCameraSort(c);
+        hpsPreRenderExtensions(c->scene);
+        renderQueues(context, cache);
+        swapVectors(&context->extensionNodes, &cache->extensionNodes);
+        cache->valid = true;
+        cache->cameraVersion = c->version;
+        cache->sceneVersion = c->scene->version;
+    } else {
+        hpsPreRenderExtensions(c->scene);
+        drawQueues(context);
+    }
     hpsPostRenderExtensions(c->scene);
-    *camera = currentCamera; // Copy currentCamera back into camera
+    memcpy(camera->planes, c->planes, sizeof(c->planes));
+    camera->sort = c->sort;
+    currentContext = previous;
+}
+
+void hpsRenderCameraInContext(HPScamera *camera, HPSrenderContext *context){
+    renderInContext(camera, context, NULL);
+}
+
+void hpsRenderCamera(HPScamera *camera){
+    renderInContext(camera, threadContext(), NULL);
+}
+
+/* Camera sets
+   The cameras of a set that look at the same scene are culled together – in a single traversal of the scene's partition, when it supports doVisibleMulti – straight into visible sets that belong to the thread's render context. The cameras are then rendered in order, each taking its visible set's queues as its own. Cameras that can be rendered from their frame caches are left out of the culling. */
+static _Thread_local VisibleSet *cullSets[HPS_MAX_FRUSTA]; // Where nodes are put, per frustum
+
+static void addToSet(VisibleSet *set, HPSnode *n){
+    if (n->pipeline){
+        if (n->pipeline->isAlpha)
+            hpsPush(&set->alphaQueue, n);
+        else
+            hpsPush(&set->renderQueue, n);
+    }
+    if (n->extension)
+        hpsPush(&set->extensionNodes, n);
+}
+
+static void addToFirstSet(Node *node){
+    addToSet(cullSets[0], (HPSnode *) node->data);
+}
+
+static void addToSets(Node *node, unsigned int frusta){
+    int i;
+    for (i = 0; frusta; i++, frusta >>= 1)
+        if (frusta & 1)
+            addToSet(cullSets[i], (HPSnode *) node->data);
+}
+
+static void reserveVisibleSets(HPSrenderContext *context, unsigned int n){
+    if (context->nVisibleSets >= n)
+        return;
+    context->visibleSets = realloc(context->visibleSets, sizeof(VisibleSet) * n);
+    context->setFlags = realloc(context->setFlags, sizeof(bool) * n * 2);
+    if (!context->visibleSets || !context->setFlags){
+        fprintf(stderr, "Unable to allocate visible sets\n");
+        exit(EXIT_FAILURE);
+    }
+    initVisibleSets(context->visibleSets + context->nVisibleSets,
+                    n - context->nVisibleSets);
+    context->nVisibleSets = n;
+}
+
+// Cull the n cameras of group (indices into cameras), which share a scene
+static void cullGroup(HPScamera **cameras, int *group, int n, VisibleSet *sets){
+    HPSscene *scene = cameras[group[0]]->scene;
+    PartitionInterface *partition = scene->partitionInterface;
+    int i;
+    if ((n > 1) && partition->doVisibleMulti){
+        Plane planes[HPS_MAX_FRUSTA * 6];
+        for (i = 0; i < n; i++){
+            memcpy(&planes[i * 6], cameras[group[i]]->planes, sizeof(Plane) * 6);
+            cullSets[i] = &sets[group[i]];
+        }
+        partition->doVisibleMulti(scene->partitionStruct, planes, n, &addToSets);
+    } else {
+        for (i = 0; i < n; i++){
+            cullSets[0] = &sets[group[i]];
+            partition->doVisible(scene->partitionStruct, cameras[group[i]]->planes,
+                                 cameras[group[i]]->cullCache, &addToFirstSet);
+        }
+    }
+}
+
+void hpsRenderCameraSet(HPScamera **cameras, unsigned int n){
+    HPSrenderContext *context = threadContext();
+    VisibleSet *sets;
+    bool *culled, *inSet;
+    int group[HPS_MAX_FRUSTA];
+    int i, j, nGroup;
+    reserveVisibleSets(context, n);
+    sets = context->visibleSets;
+    culled = context->setFlags;
+    inSet = culled + n;
+    memset(culled, 0, sizeof(bool) * n * 2);
+    for (i = 0; i < n; i++){
+        // Cube cameras and cameras with occlusion culling are culled as they are rendered, and cached cameras not at all
+        if ((cameras[i]->type == HPS_CUBE) || cameras[i]->occlusionCulling ||
+            (frameState(cameras[i]) != FRAME_CHANGED))
+            culled[i] = true;
+        else
+            computePlanes(cameras[i]);
+        sets[i].renderQueue.size = 0;
+        sets[i].alphaQueue.size = 0;
+        sets[i].extensionNodes.size = 0;
+    }
+    for (i = 0; i < n; i++){
+        if (culled[i]) continue;
+        for (j = i, nGroup = 0; (j < n) && (nGroup < HPS_MAX_FRUSTA); j++){
+            if (!culled[j] && (cameras[j]->scene == cameras[i]->scene)){
+                culled[j] = inSet[j] = true;
+                group[nGroup++] = j;
+            }
+        }
+        cullGroup(cameras, group, nGroup, sets);
+    }
+    for (i = 0; i < n; i++)
+        renderInContext(cameras[i], context, inSet[i] ? &sets[i] : NULL);
 }
 
 static void hpsOrthoCamera(HPScamera *camera){
@@ -392,6 +1085,13 @@ static void hpsPerspectiveCamera(HPScamera *camera){
                        camera->projection);
 }
 
+static void hpsCubeCamera(HPScamera *camera){
+    float n = camera->n;
+    hpmFrustumViewport(-n, n, -n, n, n, camera->f,
+                       camera->vl, camera->vr, camera->vb, camera->vt,
+                       camera->projection);
+}
+
 HPScamera *hpsMakeCamera(HPScameraType type, HPScameraStyle style, HPSscene *scene, float width, float height){
     HPScamera *camera = malloc(sizeof(struct camera));
     camera->n = HPS_DEFAULT_NEAR_PLANE;
@@ -416,10 +1116,25 @@ HPScamera *hpsMakeCamera(HPScameraType type, HPScameraStyle style, HPSscene *sce
     camera->vb = -1.0; camera->vt = 1.0;
     camera->vx = 0.0; camera->vy = 0.0;
     camera->viewportIsStatic = false;
+    camera->alphaSorting = 0;
+    camera->occlusionCulling = false;
+#ifdef ROUGH_ALPHA
+    camera->alphaSorting |= HPS_ROUGH_ALPHA;
+#endif
+#ifdef VOLUMETRIC_ALPHA
+    camera->alphaSorting |= HPS_VOLUMETRIC_ALPHA;
+#endif
     if (type == HPS_ORTHO)
         camera->update = &hpsOrthoCamera;
+    else if (type == HPS_CUBE)
+        camera->update = &hpsCubeCamera;
     else
         camera->update = &hpsPerspectiveCamera;
+    camera->type = type;
+    camera->faceFunction = NULL;
+    camera->cullCache = calloc(1, sizeof(CullCache));
+    camera->frameCache = makeFrameCache();
+    camera->version = 0;
     camera->style = style;
     camera->scene = scene;
     hpsPush(&cameraList, (void *) camera);
@@ -434,6 +1149,24 @@ void hpsSetCameraClipPlanes(HPScamera *camera, float near, float far){
     camera->update(camera);
 }
 
+void hpsSetCameraAlphaSorting(HPScamera *camera, int sorting){
+    camera->alphaSorting = sorting;
+    camera->version++;
+}
+
+void hpsSetCameraOcclusionCulling(HPScamera *camera, bool cull){
+    camera->occlusionCulling = cull;
+    camera->version++;
+}
+
+void hpsSetCameraFaceFunction(HPScamera *camera, void (*func)(HPScamera *, int)){
+    if (camera->type != HPS_CUBE){
+        fprintf(stderr, "Can't set the face function of a non HPS_CUBE camera\n");
+        return;
+    }
+    camera->faceFunction = func;
+}
+
 void hpsSetCameraViewAngle(HPScamera *camera, float angle){
     camera->viewAngle = angle;
     camera->update(camera);
@@ -473,6 +1206,9 @@ void hpsSetCameraViewportOffset(HPScamera *camera, float x, float y){
 void hpsDeleteCamera(HPScamera *camera){
     hpsDeactivateCamera(camera);
     hpsRemove(&cameraList, (void *) camera);
+    free(camera->cullCache->data);
+    free(camera->cullCache);
+    deleteFrameCache(camera->frameCache);
     free(camera);
 }
 
@@ -656,9 +1392,7 @@ void hpsUpdateCameras(){
 }
 
 void hpsRenderCameras(){
-    int i;
-    for (i = 0; i < activeCameras.size; i++)
-	hpsRenderCamera((HPScamera *) activeCameras.data[i]);
+    hpsRenderCameraSet((HPScamera **) activeCameras.data, activeCameras.size);
 }
 
 void hpsActivateCamera(HPScamera *c){
@@ -673,6 +1407,4 @@ void hpsDeactivateCamera(HPScamera *c){
 void hpsInitCameras(){
     hpsInitVector(&cameraList, 16);
     hpsInitVector(&activeCameras, 16);
-    hpsInitVector(&renderQueue, 4096);
-    hpsInitVector(&alphaQueue, 1024);
 }
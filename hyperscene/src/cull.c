@@ -0,0 +1,380 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include "cull.h"
+#include "jobs.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+/* Box testing
+   Only the corner of the box furthest along the plane's normal (p) and the corner furthest against it (n) need to be tested. See aabb-tree.c for references.
+   Masks may have any of their 32 bits set, so planes are found by shifting the mask down rather than by shifting a bit up to it. */
+HPSintersection hpsBoxInPlanes(const float *min, const float *max, Plane *planes,
+                               unsigned int inMask, unsigned int *outMask){
+    HPSintersection result = HPS_INSIDE;
+    unsigned int i, m;
+    for (i = 0, m = inMask; m; i++, m >>= 1){
+        if (m & 1){
+            Plane *plane = &planes[i];
+            float px, py, pz, nx, ny, nz;
+            if (plane->a < 0.0) { px = min[0]; nx = max[0]; }
+            else                { px = max[0]; nx = min[0]; }
+            if (plane->b < 0.0) { py = min[1]; ny = max[1]; }
+            else                { py = max[1]; ny = min[1]; }
+            if (plane->c < 0.0) { pz = min[2]; nz = max[2]; }
+            else                { pz = max[2]; nz = min[2]; }
+            if ((plane->a * px) + (plane->b * py) + (plane->c * pz) + plane->d < 0)
+                return HPS_OUTSIDE;
+            if ((plane->a * nx) + (plane->b * ny) + (plane->c * nz) + plane->d < 0){
+                *outMask |= 1u << i;
+                result = HPS_INTERSECT;
+            }
+        }
+    }
+    return result;
+}
+
+/* Sphere testing
+   Four bounding spheres are tested at a time when SSE is available. */
+#ifdef __SSE__
+typedef struct {
+    __m128 x, y, z, r;
+} Spheres;
+
+static Spheres loadSpheres(Node **nodes, int n){
+    BoundingSphere *a = nodes[0]->boundingSphere;
+    BoundingSphere *b = (n > 1) ? nodes[1]->boundingSphere : a;
+    BoundingSphere *c = (n > 2) ? nodes[2]->boundingSphere : a;
+    BoundingSphere *d = (n > 3) ? nodes[3]->boundingSphere : a;
+    Spheres s = {_mm_set_ps(d->x, c->x, b->x, a->x), _mm_set_ps(d->y, c->y, b->y, a->y),
+                 _mm_set_ps(d->z, c->z, b->z, a->z), _mm_set_ps(d->r, c->r, b->r, a->r)};
+    return s;
+}
+
+static int spheresInPlanes(Spheres *s, Plane *planes, unsigned int mask){
+    __m128 outside = _mm_setzero_ps();
+    unsigned int i;
+    for (i = 0; mask; i++, mask >>= 1){
+        if (mask & 1){
+            Plane *plane = &planes[i];
+            __m128 dist = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane->a), s->x),
+                                     _mm_mul_ps(_mm_set1_ps(plane->b), s->y));
+            dist = _mm_add_ps(dist, _mm_mul_ps(_mm_set1_ps(plane->c), s->z));
+            dist = _mm_add_ps(dist, _mm_add_ps(_mm_set1_ps(plane->d), s->r));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, _mm_setzero_ps()));
+        }
+    }
+    return ~_mm_movemask_ps(outside);
+}
+
+int hpsSpheresInPlanes(Node **nodes, int n, Plane *planes, unsigned int mask){
+    Spheres s = loadSpheres(nodes, n);
+    return spheresInPlanes(&s, planes, mask) & ((1 << n) - 1);
+}
+#else
+int hpsSpheresInPlanes(Node **nodes, int n, Plane *planes, unsigned int mask){
+    int j, result = 0;
+    unsigned int i, m;
+    for (j = 0; j < n; j++){
+        BoundingSphere *bs = nodes[j]->boundingSphere;
+        bool in = true;
+        for (i = 0, m = mask; in && m; i++, m >>= 1){
+            Plane *plane = &planes[i];
+            if ((m & 1) &&
+                ((plane->a * bs->x) + (plane->b * bs->y) + (plane->c * bs->z) +
+                 plane->d + bs->r < 0))
+                in = false;
+        }
+        if (in) result |= 1 << j;
+    }
+    return result;
+}
+#endif
+
+void hpsNodesInPlanes(Node **nodes, int n, Plane *planes, unsigned int mask,
+                      void (*func)(Node *), HPSvector *visible){
+    int i, j, m, in;
+    for (i = 0; i < n; i += 4){
+        m = n - i;
+        if (m > 4) m = 4;
+        in = hpsSpheresInPlanes(nodes + i, m, planes, mask);
+        for (j = 0; j < m; j++){
+            if (in & (1 << j)){
+                if (visible)
+                    hpsPush(visible, nodes[i + j]);
+                else
+                    func(nodes[i + j]);
+            }
+        }
+    }
+}
+
+/* Ray testing
+   Boxes are tested with slabs: the ray is clipped to the interval between each pair of opposing faces, and hits the box when something remains. Components of the direction that are zero have infinite reciprocals, which fminf and fmaxf handle, so rays that are parallel to a pair of faces are only kept when they lie between them. See "An Efficient and Robust Ray–Box Intersection Algorithm" (Williams et al.). */
+bool hpsMakeRay(Ray *ray, const float *origin, const float *direction, float length){
+    float l = sqrtf(direction[0] * direction[0] + direction[1] * direction[1] +
+                    direction[2] * direction[2]);
+    int i;
+    if (!(l > 0))
+        return false;
+    for (i = 0; i < 3; i++){
+        ray->origin[i] = origin[i];
+        ray->direction[i] = direction[i] / l;
+        ray->inverse[i] = 1.0f / ray->direction[i];
+    }
+    ray->length = length;
+    return true;
+}
+
+bool hpsRayHitsBox(const Ray *ray, const float *min, const float *max, float *distance){
+    float near = 0, far = ray->length;
+    int i;
+    for (i = 0; i < 3; i++){
+        float t0 = (min[i] - ray->origin[i]) * ray->inverse[i];
+        float t1 = (max[i] - ray->origin[i]) * ray->inverse[i];
+        near = fmaxf(near, fminf(t0, t1));
+        far = fminf(far, fmaxf(t0, t1));
+    }
+    *distance = near;
+    return near <= far;
+}
+
+bool hpsRayHitsSphere(const Ray *ray, const BoundingSphere *bs, float *distance){
+    float m[3] = {ray->origin[0] - bs->x, ray->origin[1] - bs->y, ray->origin[2] - bs->z};
+    float b = m[0] * ray->direction[0] + m[1] * ray->direction[1] + m[2] * ray->direction[2];
+    float c = m[0] * m[0] + m[1] * m[1] + m[2] * m[2] - bs->r * bs->r;
+    float discriminant, t;
+    if (c <= 0){
+        *distance = 0;
+        return true;
+    }
+    if (b > 0)
+        return false;
+    discriminant = b * b - c;
+    if (discriminant < 0)
+        return false;
+    t = -b - sqrtf(discriminant);
+    *distance = t;
+    return t <= ray->length;
+}
+
+/* Region testing
+   Bounding spheres are tested exactly, by finding the point of the region nearest to their centre. Boxes are tested against the faces of box regions, which is conservative for boxes near the region's edges, and against the nearest and furthest of their points from the centre of sphere regions. */
+void hpsMakeSphereRegion(Region *region, const float *center, float radius){
+    region->sphere = true;
+    memcpy(region->center, center, sizeof(float) * 3);
+    region->radius = radius;
+}
+
+void hpsMakeBoxRegion(Region *region, const float *center, const float *axes,
+                      const float *extents){
+    int i;
+    region->sphere = false;
+    memcpy(region->center, center, sizeof(float) * 3);
+    memcpy(region->axes, axes, sizeof(float) * 9);
+    memcpy(region->extents, extents, sizeof(float) * 3);
+    for (i = 0; i < 3; i++){
+        const float *axis = &axes[i*3];
+        float d = axis[0] * center[0] + axis[1] * center[1] + axis[2] * center[2];
+        Plane front = {-axis[0], -axis[1], -axis[2], d + extents[i]};
+        Plane back = {axis[0], axis[1], axis[2], extents[i] - d};
+        region->planes[i*2] = front;
+        region->planes[i*2 + 1] = back;
+    }
+}
+
+HPSintersection hpsBoxInRegion(const float *min, const float *max, Region *region,
+                               unsigned int inMask, unsigned int *outMask){
+    float near = 0, far = 0, r2 = region->radius * region->radius;
+    int i;
+    if (!region->sphere)
+        return hpsBoxInPlanes(min, max, region->planes, inMask, outMask);
+    for (i = 0; i < 3; i++){
+        float c = region->center[i];
+        float below = c - min[i], above = max[i] - c;
+        if (below < 0) near += below * below;
+        else if (above < 0) near += above * above;
+        far += fmaxf(below * below, above * above);
+    }
+    if (near > r2)
+        return HPS_OUTSIDE;
+    return (far <= r2) ? HPS_INSIDE : HPS_INTERSECT;
+}
+
+bool hpsSphereInRegion(const BoundingSphere *bs, const Region *region){
+    float d[3] = {bs->x - region->center[0], bs->y - region->center[1],
+                  bs->z - region->center[2]};
+    float distance = 0;
+    int i;
+    if (region->sphere){
+        float r = region->radius + bs->r;
+        return d[0] * d[0] + d[1] * d[1] + d[2] * d[2] <= r * r;
+    }
+    for (i = 0; i < 3; i++){
+        const float *axis = region->axes[i];
+        float outside = fabsf(d[0] * axis[0] + d[1] * axis[1] + d[2] * axis[2]) -
+            region->extents[i];
+        if (outside > 0)
+            distance += outside * outside;
+    }
+    return distance <= bs->r * bs->r;
+}
+
+/* Frustum testing
+   Boxes are tested against four planes at a time, using the box's centre and half-extents: the box is outside of a plane when the distance of its centre is less than -(|a| ex + |b| ey + |c| ez), and straddles it when that distance is less than the same amount. */
+void hpsMakeFrusta(Plane *planes, int n, HPSfrustum *frusta){
+    int i, j;
+    for (i = 0; i < n; i++){
+        HPSfrustum *f = &frusta[i];
+        for (j = 0; j < 8; j++){
+            if (j < 6){
+                Plane *plane = &planes[i*6 + j];
+                f->a[j] = plane->a; f->b[j] = plane->b;
+                f->c[j] = plane->c; f->d[j] = plane->d;
+            } else {
+                f->a[j] = f->b[j] = f->c[j] = 0;
+                f->d[j] = 1;
+            }
+        }
+    }
+}
+
+#ifdef __SSE__
+unsigned int hpsBoxInFrusta(const float *min, const float *max, HPSfrustum *frusta,
+                            unsigned int active, int *masks){
+    __m128 cx = _mm_set1_ps((min[0] + max[0]) * 0.5f);
+    __m128 cy = _mm_set1_ps((min[1] + max[1]) * 0.5f);
+    __m128 cz = _mm_set1_ps((min[2] + max[2]) * 0.5f);
+    __m128 ex = _mm_set1_ps((max[0] - min[0]) * 0.5f);
+    __m128 ey = _mm_set1_ps((max[1] - min[1]) * 0.5f);
+    __m128 ez = _mm_set1_ps((max[2] - min[2]) * 0.5f);
+    __m128 sign = _mm_set1_ps(-0.0f);
+    unsigned int result = active;
+    int i, j;
+    for (i = 0; active; i++, active >>= 1){
+        if (!(active & 1)) continue;
+        HPSfrustum *f = &frusta[i];
+        int outside = 0, straddle = 0;
+        for (j = 0; j < 8; j += 4){
+            __m128 a = _mm_loadu_ps(f->a + j), b = _mm_loadu_ps(f->b + j);
+            __m128 c = _mm_loadu_ps(f->c + j);
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, cx), _mm_mul_ps(b, cy)),
+                                     _mm_add_ps(_mm_mul_ps(c, cz), _mm_loadu_ps(f->d + j)));
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign, a), ex),
+                                             _mm_mul_ps(_mm_andnot_ps(sign, b), ey)),
+                                  _mm_mul_ps(_mm_andnot_ps(sign, c), ez));
+            outside |= _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(dist, r),
+                                                    _mm_setzero_ps())) << j;
+            straddle |= _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(dist, r),
+                                                     _mm_setzero_ps())) << j;
+        }
+        if (outside & masks[i])
+            result &= ~(1u << i);
+        else
+            masks[i] &= straddle;
+    }
+    return result;
+}
+#else
+unsigned int hpsBoxInFrusta(const float *min, const float *max, HPSfrustum *frusta,
+                            unsigned int active, int *masks){
+    float cx = (min[0] + max[0]) * 0.5f, ex = (max[0] - min[0]) * 0.5f;
+    float cy = (min[1] + max[1]) * 0.5f, ey = (max[1] - min[1]) * 0.5f;
+    float cz = (min[2] + max[2]) * 0.5f, ez = (max[2] - min[2]) * 0.5f;
+    unsigned int result = active;
+    int i, j;
+    for (i = 0; active; i++, active >>= 1){
+        if (!(active & 1)) continue;
+        HPSfrustum *f = &frusta[i];
+        int straddle = 0;
+        for (j = 0; j < 6; j++){
+            if (!(masks[i] & (1 << j))) continue;
+            float dist = f->a[j]*cx + f->b[j]*cy + f->c[j]*cz + f->d[j];
+            float r = fabsf(f->a[j])*ex + fabsf(f->b[j])*ey + fabsf(f->c[j])*ez;
+            if (dist + r < 0) break;
+            if (dist - r < 0) straddle |= 1 << j;
+        }
+        if (j < 6)
+            result &= ~(1u << i);
+        else
+            masks[i] = straddle;
+    }
+    return result;
+}
+#endif
+
+/* Each group of four nodes is loaded once, and tested against every active frustum */
+void hpsNodesInFrusta(Node **nodes, int n, Plane *planes, unsigned int active, int *masks,
+                      unsigned int inside, void (*func)(Node *, unsigned int)){
+    int i, j, f, m;
+    for (i = 0; i < n; i += 4){
+        unsigned int in[4] = {inside, inside, inside, inside};
+        unsigned int remaining = active;
+        m = n - i;
+        if (m > 4) m = 4;
+#ifdef __SSE__
+        Spheres s = loadSpheres(nodes + i, m);
+#endif
+        for (f = 0; remaining; f++, remaining >>= 1){
+            if (!(remaining & 1)) continue;
+#ifdef __SSE__
+            int visible = spheresInPlanes(&s, &planes[f*6], masks[f]);
+#else
+            int visible = hpsSpheresInPlanes(nodes + i, m, &planes[f*6], masks[f]);
+#endif
+            for (j = 0; j < m; j++)
+                if (visible & (1 << j))
+                    in[j] |= 1u << f;
+        }
+        for (j = 0; j < m; j++)
+            if (in[j])
+                func(nodes[i + j], in[j]);
+    }
+}
+
+/* Moved nodes
+   Nodes are tested in blocks, so that the workers are not handed one node at a time */
+#define FIT_BLOCK 256
+
+typedef struct {
+    Node **nodes;
+    unsigned int n;
+    bool (*fits)(Node *);
+    bool *fit;
+} FitJob;
+
+// Kept per thread, since the worker pool runs a job on the calling thread alone when it is busy
+static _Thread_local bool *fitResults = NULL;
+static _Thread_local unsigned int fitCapacity = 0;
+
+static void fitJob(void *data, unsigned int item, unsigned int worker){
+    FitJob *job = (FitJob *) data;
+    unsigned int i, end = (item + 1) * FIT_BLOCK;
+    if (end > job->n) end = job->n;
+    for (i = item * FIT_BLOCK; i < end; i++)
+        job->fit[i] = job->fits(job->nodes[i]);
+}
+
+void hpsUpdateMovedNodes(Node **nodes, unsigned int n, bool (*fits)(Node *),
+                         void (*keep)(Node *), void (*move)(Node *)){
+    unsigned int i;
+    if (n > fitCapacity){
+        fitResults = realloc(fitResults, sizeof(bool) * n);
+        if (!fitResults){
+            fprintf(stderr, "Unable to allocate moved node list\n");
+            exit(EXIT_FAILURE);
+        }
+        fitCapacity = n;
+    }
+    FitJob job = {nodes, n, fits, fitResults};
+    hpsParallelFor((n + FIT_BLOCK - 1) / FIT_BLOCK, &fitJob, &job);
+    for (i = 0; i < n; i++){
+        if (!fitResults[i])
+            move(nodes[i]);
+        else if (keep)
+            keep(nodes[i]);
+    }
+}
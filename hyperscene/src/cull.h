@@ -0,0 +1,73 @@
+#ifndef HPS_CULL
+#define HPS_CULL 1
+
+#include <stdbool.h>
+#include "partition.h"
+#include "memory.h"
+
+/* Culling helpers shared by the partition interfaces */
+
+typedef enum {
+    HPS_INSIDE, HPS_OUTSIDE, HPS_INTERSECT
+} HPSintersection;
+
+/* The mask of every one of the first n (<= HPS_MAX_PLANES) planes */
+static inline unsigned int hpsPlaneMask(int n){
+    return (n >= HPS_MAX_PLANES) ? ~0u : (1u << n) - 1;
+}
+
+/* Test the box from min to max (three floats each) against the planes whose bits are set in inMask. The bits of the planes that the box straddles are set in outMask. */
+HPSintersection hpsBoxInPlanes(const float *min, const float *max, Plane *planes,
+                               unsigned int inMask, unsigned int *outMask);
+
+/* Returns a bitmask of which of the n (<= 4) nodes have bounding spheres that are not outside of the planes in mask. Planes are expected to be normalized. */
+int hpsSpheresInPlanes(Node **nodes, int n, Plane *planes, unsigned int mask);
+
+/* Pass each of the n nodes that is not outside of the planes in mask to func, or push it onto visible when given */
+void hpsNodesInPlanes(Node **nodes, int n, Plane *planes, unsigned int mask,
+                      void (*func)(Node *), HPSvector *visible);
+
+/* Fill ray with the ray from origin along direction, as far as length. Returns false when direction has no length. */
+bool hpsMakeRay(Ray *ray, const float *origin, const float *direction, float length);
+
+/* Whether the ray passes through the box from min to max before the end of its length. distance is set to where the ray enters the box. */
+bool hpsRayHitsBox(const Ray *ray, const float *min, const float *max, float *distance);
+
+/* Whether the ray passes through the bounding sphere before the end of its length. distance is set to where the ray enters the sphere. */
+bool hpsRayHitsSphere(const Ray *ray, const BoundingSphere *bs, float *distance);
+
+/* Fill region with the sphere of the given centre and radius */
+void hpsMakeSphereRegion(Region *region, const float *center, float radius);
+
+/* Fill region with the box of the given centre, unit axes (three vectors of three floats) and half-extents along each axis */
+void hpsMakeBoxRegion(Region *region, const float *center, const float *axes,
+                      const float *extents);
+
+/* Test the box from min to max against the region. Boxes are tested against the planes of a box region in inMask, as with hpsBoxInPlanes; masks are not used by sphere regions. */
+HPSintersection hpsBoxInRegion(const float *min, const float *max, Region *region,
+                               unsigned int inMask, unsigned int *outMask);
+
+/* Whether the bounding sphere overlaps the region */
+bool hpsSphereInRegion(const BoundingSphere *bs, const Region *region);
+
+/* The planes of a frustum, arranged so that four of them can be tested against a box at once. The last two planes are padding, which nothing is outside of. */
+typedef struct {
+    float a[8], b[8], c[8], d[8];
+} HPSfrustum;
+
+/* Fill frusta with the six planes of each of the n frusta in planes */
+void hpsMakeFrusta(Plane *planes, int n, HPSfrustum *frusta);
+
+/* Test the box from min to max against each frustum whose bit is set in active. masks[i] holds the planes of frustum i that need to be tested, and is replaced by the planes that the box straddles (0 when it is inside of the frustum). Returns the frusta that the box is not outside of. */
+unsigned int hpsBoxInFrusta(const float *min, const float *max, HPSfrustum *frusta,
+                            unsigned int active, int *masks);
+
+/* Pass each of the n nodes that is not outside of one of the active frusta (six planes each in planes, with the planes to test in masks) to func, along with the frusta that it is in. Every node is taken to be in the frusta of inside. */
+void hpsNodesInFrusta(Node **nodes, int n, Plane *planes, unsigned int active, int *masks,
+                      unsigned int inside, void (*func)(Node *, unsigned int));
+
+/* Update the n nodes that have moved, for a partition's updateNodes. Whether each node fits where it is in the partition is tested by fits, spread over the worker threads, so fits must not change anything. Then, in order and on the calling thread, the nodes that do not fit are passed to move, and the others to keep (when not NULL). */
+void hpsUpdateMovedNodes(Node **nodes, unsigned int n, bool (*fits)(Node *),
+                         void (*keep)(Node *), void (*move)(Node *));
+
+#endif
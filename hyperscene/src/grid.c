@@ -0,0 +1,436 @@
+/* Hashed uniform grid
+   Space is divided into square columns along the X and Z axes, which are only created once a node is placed in them, and are found through a hash table keyed on their coordinates. Nodes are placed in the column that holds their centre, so each column is culled with a box that is grown by the largest radius in it, and that spans the nodes' extent along the Y axis. Nodes that are larger than a column are kept apart, and are tested individually.
+
+   Visibility testing finds the footprint of the frustum on the X-Z plane, and only looks up the columns that it overlaps: for each row of columns, the frustum's edges are clipped to the row to find how far along the row the footprint reaches.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include "partition.h"
+#include "memory.h"
+#include "cull.h"
+
+#define INITIAL_TABLE_SIZE 256 // Must be a power of two
+
+typedef struct gridCell {
+    struct grid *grid;
+    int x, z;
+    unsigned int index; // Position of the cell in grid->cells
+    float minY, maxY, radius; // Extent of the nodes along the Y axis, and the largest radius
+    bool stale; // Bounds may be larger than they need to be
+    HPSvector nodes;
+} GridCell;
+
+typedef struct grid {
+    float cellSize;
+    GridCell **table;
+    unsigned int tableSize;
+    HPSvector cells;
+    GridCell oversized; // Nodes that are larger than a cell
+    HPSpool pool;
+    HPSvector staleCells;
+} Grid;
+
+Grid *hpsGridNew();
+void hpsGridDelete(Grid *grid);
+void hpsGridAddNode(Node *node, Grid *grid);
+void hpsGridRemoveNode(Node *node);
+void hpsGridUpdateNode(Node *node);
+void hpsGridUpdateNodes(Node **nodes, unsigned int n);
+void hpsGridDoVisible(Grid *grid, Plane *planes, CullCache *cache,
+                      void (*func)(Node *));
+void hpsGridMaintain(Grid *grid);
+void hpsGridDoVisibleVolume(Grid *grid, Plane *planes, int nPlanes, void (*func)(Node *));
+
+unsigned int hpsGridPartitionPoolSize = 4096;
+float hpsGridCellSize = 64;
+
+PartitionInterface gridPartitionInterface = {(void *(*)()) hpsGridNew,
+                                             (void (*)(void *)) hpsGridDelete,
+                                             (void (*)(Node *, void *)) hpsGridAddNode,
+                                             (void (*)(Node *)) hpsGridRemoveNode,
+                                             (void (*)(Node *)) hpsGridUpdateNode,
+                                             (void (*)(void *, Plane *, CullCache *, void (*)(Node *)))
+                                               hpsGridDoVisible,
+                                             (void (*)(void *)) hpsGridMaintain,
+                                             NULL, NULL,
+                                             (void (*)(void *, Plane *, int, void (*)(Node *)))
+                                               hpsGridDoVisibleVolume,
+                                             NULL, NULL,
+                                             (void (*)(Node **, unsigned int))
+                                               hpsGridUpdateNodes};
+
+PartitionInterface *hpsGridPartitionInterface = &gridPartitionInterface;
+
+/* Hash table
+   Open addressing with linear probing. Cells are removed by shifting later entries of their probe sequence back. */
+static unsigned int hash(int x, int z, unsigned int tableSize){
+    return (((uint32_t) x * 73856093u) ^ ((uint32_t) z * 19349663u)) & (tableSize - 1);
+}
+
+static GridCell *findCell(Grid *grid, int x, int z){
+    unsigned int i = hash(x, z, grid->tableSize);
+    GridCell *cell;
+    while ((cell = grid->table[i])){
+        if ((cell->x == x) && (cell->z == z)) return cell;
+        i = (i + 1) & (grid->tableSize - 1);
+    }
+    return NULL;
+}
+
+static void insertCell(Grid *grid, GridCell *cell){
+    unsigned int i = hash(cell->x, cell->z, grid->tableSize);
+    while (grid->table[i])
+        i = (i + 1) & (grid->tableSize - 1);
+    grid->table[i] = cell;
+}
+
+static void growTable(Grid *grid){
+    int i;
+    free(grid->table);
+    grid->tableSize *= 2;
+    grid->table = calloc(grid->tableSize, sizeof(GridCell *));
+    for (i = 0; i < grid->cells.size; i++)
+        insertCell(grid, grid->cells.data[i]);
+}
+
+static void removeCell(Grid *grid, GridCell *cell){
+    unsigned int mask = grid->tableSize - 1;
+    unsigned int i = hash(cell->x, cell->z, grid->tableSize), j, k;
+    while (grid->table[i] != cell)
+        i = (i + 1) & mask;
+    grid->table[i] = NULL;
+    for (j = (i + 1) & mask; grid->table[j]; j = (j + 1) & mask){
+        k = hash(grid->table[j]->x, grid->table[j]->z, grid->tableSize);
+        // Move the entry back if its home slot is not cyclically within (i, j]
+        if ((i <= j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j))){
+            grid->table[i] = grid->table[j];
+            grid->table[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/* Cells */
+static void resetBounds(GridCell *cell){
+    cell->minY = INFINITY;
+    cell->maxY = -INFINITY;
+    cell->radius = 0;
+}
+
+static void growBounds(GridCell *cell, BoundingSphere *bs){
+    cell->minY = fmin(cell->minY, bs->y - bs->r);
+    cell->maxY = fmax(cell->maxY, bs->y + bs->r);
+    cell->radius = fmax(cell->radius, bs->r);
+}
+
+static void markStale(GridCell *cell){
+    if (!cell->stale){
+        cell->stale = true;
+        hpsPush(&cell->grid->staleCells, cell);
+    }
+}
+
+static GridCell *getCell(Grid *grid, int x, int z){
+    GridCell *cell = findCell(grid, x, z);
+    if (cell) return cell;
+    cell = hpsAllocateFrom(grid->pool);
+    cell->grid = grid;
+    cell->x = x;
+    cell->z = z;
+    cell->stale = false;
+    resetBounds(cell);
+    hpsInitVector(&cell->nodes, 0);
+    cell->index = grid->cells.size;
+    hpsPush(&grid->cells, cell);
+    if (grid->cells.size * 2 > grid->tableSize)
+        growTable(grid);
+    else
+        insertCell(grid, cell);
+    return cell;
+}
+
+static void deleteCell(Grid *grid, GridCell *cell){
+    GridCell *last = hpsPop(&grid->cells);
+    if (last != cell){
+        grid->cells.data[cell->index] = last;
+        last->index = cell->index;
+    }
+    removeCell(grid, cell);
+    hpsDeleteVector(&cell->nodes);
+    hpsDeleteFrom(cell, grid->pool);
+}
+
+static GridCell *cellFor(Grid *grid, BoundingSphere *bs){
+    if (bs->r > grid->cellSize)
+        return &grid->oversized;
+    return getCell(grid, floor(bs->x / grid->cellSize), floor(bs->z / grid->cellSize));
+}
+
+static bool inCell(GridCell *cell, BoundingSphere *bs){
+    Grid *grid = cell->grid;
+    if (cell == &grid->oversized)
+        return bs->r > grid->cellSize;
+    return (bs->r <= grid->cellSize) &&
+        (floor(bs->x / grid->cellSize) == cell->x) &&
+        (floor(bs->z / grid->cellSize) == cell->z);
+}
+
+static void addToCell(GridCell *cell, Node *node){
+    node->slot = cell->nodes.size;
+    node->area = (void *) cell;
+    hpsPush(&cell->nodes, node);
+    growBounds(cell, node->boundingSphere);
+}
+
+static void removeFromCell(GridCell *cell, Node *node){
+    HPSvector *nodes = &cell->nodes;
+    Node *last = nodes->data[--nodes->size];
+    nodes->data[node->slot] = last;
+    last->slot = node->slot;
+    if (cell != &cell->grid->oversized)
+        markStale(cell);
+}
+
+/* Partition interface */
+Grid *hpsGridNew(){
+    Grid *grid = malloc(sizeof(Grid));
+    grid->cellSize = hpsGridCellSize;
+    grid->tableSize = INITIAL_TABLE_SIZE;
+    grid->table = calloc(grid->tableSize, sizeof(GridCell *));
+    grid->pool = hpsMakePool(sizeof(GridCell), hpsGridPartitionPoolSize, "Grid pool");
+    hpsInitVector(&grid->cells, INITIAL_TABLE_SIZE / 2);
+    hpsInitVector(&grid->staleCells, 64);
+    grid->oversized.grid = grid;
+    grid->oversized.stale = false;
+    resetBounds(&grid->oversized);
+    hpsInitVector(&grid->oversized.nodes, 0);
+    return grid;
+}
+
+void hpsGridDelete(Grid *grid){
+    int i;
+    for (i = 0; i < grid->cells.size; i++)
+        hpsDeleteVector(&((GridCell *) grid->cells.data[i])->nodes);
+    hpsDeleteVector(&grid->oversized.nodes);
+    hpsDeleteVector(&grid->cells);
+    hpsDeleteVector(&grid->staleCells);
+    hpsDeletePool(grid->pool);
+    free(grid->table);
+    free(grid);
+}
+
+void hpsGridAddNode(Node *node, Grid *grid){
+    addToCell(cellFor(grid, node->boundingSphere), node);
+}
+
+void hpsGridRemoveNode(Node *node){
+    GridCell *cell = (GridCell *) node->area;
+    if ((node->slot >= cell->nodes.size) || (cell->nodes.data[node->slot] != node)){
+	fprintf(stderr, "Warning, tried to remove node %p from a grid cell that it did not belong to\n", node->data);
+        return;
+    }
+    removeFromCell(cell, node);
+}
+
+static bool nodeFits(Node *node){
+    return inCell((GridCell *) node->area, node->boundingSphere);
+}
+
+static void keepNode(Node *node){
+    GridCell *cell = (GridCell *) node->area;
+    growBounds(cell, node->boundingSphere);
+    if (cell != &cell->grid->oversized)
+        markStale(cell);
+}
+
+static void moveNode(Node *node){
+    GridCell *cell = (GridCell *) node->area;
+    removeFromCell(cell, node);
+    addToCell(cellFor(cell->grid, node->boundingSphere), node);
+}
+
+void hpsGridUpdateNode(Node *node){
+    if (nodeFits(node))
+        keepNode(node);
+    else
+        moveNode(node);
+}
+
+void hpsGridUpdateNodes(Node **nodes, unsigned int n){
+    hpsUpdateMovedNodes(nodes, n, &nodeFits, &keepNode, &moveNode);
+}
+
+/* Maintenance
+   Bounds of cells that nodes have moved in or left are recomputed, and empty cells are deleted. */
+void hpsGridMaintain(Grid *grid){
+    HPSvector *stale = &grid->staleCells;
+    int i, j;
+    for (i = 0; i < stale->size; i++){
+        GridCell *cell = stale->data[i];
+        cell->stale = false;
+        if (!cell->nodes.size){
+            deleteCell(grid, cell);
+            continue;
+        }
+        resetBounds(cell);
+        for (j = 0; j < cell->nodes.size; j++)
+            growBounds(cell, ((Node *) cell->nodes.data[j])->boundingSphere);
+    }
+    stale->size = 0;
+}
+
+/* Visibility testing */
+static void cellVisible(GridCell *cell, float size, Plane *planes, unsigned int planeMask,
+                        void (*func)(Node *)){
+    float min[3] = {cell->x * size - cell->radius, cell->minY, cell->z * size - cell->radius};
+    float max[3] = {(cell->x + 1) * size + cell->radius, cell->maxY,
+                    (cell->z + 1) * size + cell->radius};
+    unsigned int mask = 0;
+    int i;
+    HPSintersection inView = hpsBoxInPlanes(min, max, planes, planeMask, &mask);
+    if (inView == HPS_INSIDE){
+        for (i = 0; i < cell->nodes.size; i++)
+            func(cell->nodes.data[i]);
+    } else if (inView == HPS_INTERSECT){
+        hpsNodesInPlanes((Node **) cell->nodes.data, cell->nodes.size, planes, mask,
+                         func, NULL);
+    }
+}
+
+/* Find the corners of the frustum, where corner i lies on planes (i & 1), 2 + ((i >> 1) & 1), and 4 + (i >> 2). Returns false if the planes do not meet at a point. */
+static bool frustumCorners(Plane *planes, float corners[8][3]){
+    int i;
+    for (i = 0; i < 8; i++){
+        Plane *a = &planes[i & 1], *b = &planes[2 + ((i >> 1) & 1)], *c = &planes[4 + (i >> 2)];
+        float bc[3] = {b->b*c->c - b->c*c->b, b->c*c->a - b->a*c->c, b->a*c->b - b->b*c->a};
+        float ca[3] = {c->b*a->c - c->c*a->b, c->c*a->a - c->a*a->c, c->a*a->b - c->b*a->a};
+        float ab[3] = {a->b*b->c - a->c*b->b, a->c*b->a - a->a*b->c, a->a*b->b - a->b*b->a};
+        float det = a->a*bc[0] + a->b*bc[1] + a->c*bc[2];
+        if (fabs(det) < 1e-6) return false;
+        corners[i][0] = -(a->d*bc[0] + b->d*ca[0] + c->d*ab[0]) / det;
+        corners[i][1] = -(a->d*bc[1] + b->d*ca[1] + c->d*ab[1]) / det;
+        corners[i][2] = -(a->d*bc[2] + b->d*ca[2] + c->d*ab[2]) / det;
+    }
+    return true;
+}
+
+/* Grow [*xMin, *xMax] by the part of the edge from p to q that lies between z0 and z1 */
+static void clipEdge(float *p, float *q, float z0, float z1, float *xMin, float *xMax){
+    float t0 = 0, t1 = 1, dz = q[2] - p[2];
+    if (dz == 0){
+        if ((p[2] < z0) || (p[2] > z1)) return;
+    } else {
+        float a = (z0 - p[2]) / dz, b = (z1 - p[2]) / dz;
+        if (a > b) { float t = a; a = b; b = t; }
+        if (a > t0) t0 = a;
+        if (b < t1) t1 = b;
+        if (t0 > t1) return;
+    }
+    float x0 = p[0] + t0 * (q[0] - p[0]), x1 = p[0] + t1 * (q[0] - p[0]);
+    *xMin = fmin(*xMin, fmin(x0, x1));
+    *xMax = fmax(*xMax, fmax(x0, x1));
+}
+
+/* The rows of the footprint are kept per thread, since a grid may be rendered by several threads at once, and grow to fit the largest footprint. A test takes the rows from its thread while it uses them, so that tests made from within func get rows of their own. */
+static _Thread_local int *footprintRows = NULL;
+static _Thread_local unsigned int footprintCapacity = 0; // In rows
+
+static int *takeRows(unsigned int nRows, unsigned int *capacity){
+    int *rows = footprintRows;
+    *capacity = footprintCapacity;
+    footprintRows = NULL;
+    footprintCapacity = 0;
+    if (*capacity < nRows){
+        rows = realloc(rows, sizeof(int) * 2 * nRows);
+        if (!rows){
+            fprintf(stderr, "Unable to allocate grid footprint\n");
+            exit(EXIT_FAILURE);
+        }
+        *capacity = nRows;
+    }
+    return rows;
+}
+
+// Keep the larger of the given rows and any that a nested test left behind
+static void returnRows(int *rows, unsigned int capacity){
+    if (footprintCapacity >= capacity){
+        free(rows);
+    } else {
+        free(footprintRows);
+        footprintRows = rows;
+        footprintCapacity = capacity;
+    }
+}
+
+void hpsGridDoVisible(Grid *grid, Plane *planes, CullCache *cache,
+                      void (*func)(Node *)){
+    float corners[8][3];
+    float size = grid->cellSize;
+    float zMin = INFINITY, zMax = -INFINITY;
+    int i, j, x, z;
+    hpsNodesInPlanes((Node **) grid->oversized.nodes.data, grid->oversized.nodes.size,
+                     planes, hpsPlaneMask(6), func, NULL);
+    bool bounded = frustumCorners(planes, corners);
+    for (i = 0; bounded && (i < 8); i++){
+        zMin = fmin(zMin, corners[i][2]);
+        zMax = fmax(zMax, corners[i][2]);
+    }
+    if (!bounded || ((zMax - zMin) / size + 3 > grid->cells.size)){
+        for (i = 0; i < grid->cells.size; i++)
+            cellVisible(grid->cells.data[i], size, planes, hpsPlaneMask(6), func);
+        return;
+    }
+    // Nodes reach at most one cell size out of their cell, so the footprint is grown by that much
+    int zFirst = floor((zMin - size) / size), zLast = floor((zMax + size) / size);
+    unsigned int nRows = zLast - zFirst + 1, capacity;
+    int *xFirst = takeRows(nRows, &capacity);
+    int *xLast = xFirst + capacity;
+    unsigned int nFootprint = 0;
+    for (z = zFirst; z <= zLast; z++){
+        float xMin = INFINITY, xMax = -INFINITY;
+        for (i = 0; i < 8; i++)
+            for (j = 0; j < 3; j++)
+                if (!(i & (1 << j)))
+                    clipEdge(corners[i], corners[i | (1 << j)], (z - 1) * size,
+                             (z + 2) * size, &xMin, &xMax);
+        if (xMin > xMax){
+            xFirst[z - zFirst] = 1;
+            xLast[z - zFirst] = 0;
+        } else {
+            xFirst[z - zFirst] = floor((xMin - size) / size);
+            xLast[z - zFirst] = floor((xMax + size) / size);
+            nFootprint += xLast[z - zFirst] - xFirst[z - zFirst] + 1;
+        }
+    }
+    if (nFootprint > grid->cells.size){
+        // The footprint covers more columns than exist, so test each column instead
+        for (i = 0; i < grid->cells.size; i++){
+            GridCell *cell = grid->cells.data[i];
+            if ((cell->z >= zFirst) && (cell->z <= zLast) &&
+                (cell->x >= xFirst[cell->z - zFirst]) && (cell->x <= xLast[cell->z - zFirst]))
+                cellVisible(cell, size, planes, hpsPlaneMask(6), func);
+        }
+    } else {
+        for (z = zFirst; z <= zLast; z++){
+            for (x = xFirst[z - zFirst]; x <= xLast[z - zFirst]; x++){
+                GridCell *cell = findCell(grid, x, z);
+                if (cell)
+                    cellVisible(cell, size, planes, hpsPlaneMask(6), func);
+            }
+        }
+    }
+    returnRows(xFirst, capacity);
+}
+
+/* A volume has no corners to find a footprint from, so every cell is tested against it */
+void hpsGridDoVisibleVolume(Grid *grid, Plane *planes, int nPlanes, void (*func)(Node *)){
+    unsigned int mask = hpsPlaneMask(nPlanes);
+    int i;
+    hpsNodesInPlanes((Node **) grid->oversized.nodes.data, grid->oversized.nodes.size,
+                     planes, mask, func, NULL);
+    for (i = 0; i < grid->cells.size; i++)
+        cellVisible(grid->cells.data[i], grid->cellSize, planes, mask, func);
+}
@@ -0,0 +1,177 @@
+/* Work-stealing job pool
+
+   Every worker starts a job with an even share of the items, which it processes from the front. A worker whose share runs out steals the back half of another worker's remaining items.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <hyperscene.h>
+#include "jobs.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned int begin, end;
+    char padding[64]; // Keep the ranges of different workers off of the same cache line
+} WorkRange;
+
+static unsigned int nWorkers = 1;
+static pthread_t *threads = NULL;
+static WorkRange *ranges = NULL;
+
+static pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER; // Held while a job is running
+static pthread_mutex_t stateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+static unsigned int generation = 0, running = 0;
+static unsigned int startGeneration = 0; // Generation when the workers were created, since a job may start before a new worker first runs
+static bool quit = false;
+
+static HPSjobFun jobFunc;
+static void *jobData;
+
+static bool takeItem(unsigned int worker, unsigned int *item){
+    WorkRange *r = &ranges[worker];
+    bool found = false;
+    pthread_mutex_lock(&r->lock);
+    if (r->begin < r->end){
+        *item = r->begin++;
+        found = true;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return found;
+}
+
+static bool steal(unsigned int worker){
+    unsigned int i, begin, end;
+    for (i = 1; i < nWorkers; i++){
+        WorkRange *victim = &ranges[(worker + i) % nWorkers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->begin < victim->end){
+            unsigned int half = (victim->end - victim->begin + 1) / 2;
+            end = victim->end;
+            begin = end - half;
+            victim->end = begin;
+            pthread_mutex_unlock(&victim->lock);
+            WorkRange *r = &ranges[worker];
+            pthread_mutex_lock(&r->lock);
+            r->begin = begin;
+            r->end = end;
+            pthread_mutex_unlock(&r->lock);
+            return true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return false;
+}
+
+static void runWorker(unsigned int worker){
+    unsigned int item;
+    for (;;){
+        if (!takeItem(worker, &item)){
+            if (!steal(worker)) return;
+            continue;
+        }
+        jobFunc(jobData, item, worker);
+    }
+}
+
+static void *workerMain(void *arg){
+    unsigned int worker = (size_t) arg;
+    pthread_mutex_lock(&stateLock);
+    unsigned int seen = startGeneration;
+    for (;;){
+        while ((generation == seen) && !quit)
+            pthread_cond_wait(&startCond, &stateLock);
+        if (quit) break;
+        seen = generation;
+        pthread_mutex_unlock(&stateLock);
+        runWorker(worker);
+        pthread_mutex_lock(&stateLock);
+        if (--running == 0)
+            pthread_cond_signal(&doneCond);
+    }
+    pthread_mutex_unlock(&stateLock);
+    return NULL;
+}
+
+static void stopWorkers(){
+    unsigned int i;
+    pthread_mutex_lock(&stateLock);
+    quit = true;
+    pthread_cond_broadcast(&startCond);
+    pthread_mutex_unlock(&stateLock);
+    for (i = 1; i < nWorkers; i++)
+        pthread_join(threads[i], NULL);
+    for (i = 0; i < nWorkers; i++)
+        pthread_mutex_destroy(&ranges[i].lock);
+    free(threads);
+    free(ranges);
+    threads = NULL;
+    ranges = NULL;
+    nWorkers = 1;
+    quit = false;
+}
+
+void hpsSetWorkerCount(unsigned int n){
+    unsigned int i;
+    if (n < 1) n = 1;
+    pthread_mutex_lock(&jobLock);
+    if (ranges) stopWorkers();
+    if (n > 1){
+        threads = malloc(sizeof(pthread_t) * n);
+        ranges = malloc(sizeof(WorkRange) * n);
+        for (i = 0; i < n; i++){
+            pthread_mutex_init(&ranges[i].lock, NULL);
+            ranges[i].begin = 0;
+            ranges[i].end = 0;
+        }
+        nWorkers = n;
+        startGeneration = generation;
+        for (i = 1; i < n; i++){
+            if (pthread_create(&threads[i], NULL, workerMain, (void *) (size_t) i)){
+                fprintf(stderr, "Unable to create worker thread, only using %d workers\n", i);
+                nWorkers = i;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&jobLock);
+}
+
+unsigned int hpsWorkerCount(){
+    return nWorkers;
+}
+
+void hpsParallelFor(unsigned int nItems, HPSjobFun func, void *data){
+    unsigned int i;
+    if ((nWorkers == 1) || (nItems < 2) || pthread_mutex_trylock(&jobLock)){
+        for (i = 0; i < nItems; i++)
+            func(data, i, 0);
+        return;
+    }
+    unsigned int share = nItems / nWorkers;
+    unsigned int extra = nItems % nWorkers;
+    unsigned int begin = 0;
+    for (i = 0; i < nWorkers; i++){
+        unsigned int end = begin + share + ((i < extra) ? 1 : 0);
+        pthread_mutex_lock(&ranges[i].lock);
+        ranges[i].begin = begin;
+        ranges[i].end = end;
+        pthread_mutex_unlock(&ranges[i].lock);
+        begin = end;
+    }
+    pthread_mutex_lock(&stateLock);
+    jobFunc = func;
+    jobData = data;
+    running = nWorkers - 1;
+    generation++;
+    pthread_cond_broadcast(&startCond);
+    pthread_mutex_unlock(&stateLock);
+    runWorker(0);
+    pthread_mutex_lock(&stateLock);
+    while (running)
+        pthread_cond_wait(&doneCond, &stateLock);
+    pthread_mutex_unlock(&stateLock);
+    pthread_mutex_unlock(&jobLock);
+}
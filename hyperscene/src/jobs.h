@@ -0,0 +1,15 @@
+#ifndef HPS_JOBS
+#define HPS_JOBS 1
+
+#include <stdbool.h>
+
+// Called with the job's data, the index of the item to process, and the index of the worker processing it
+typedef void (*HPSjobFun)(void *, unsigned int, unsigned int);
+
+/* The number of threads (including the calling thread) that parallel jobs are split between */
+unsigned int hpsWorkerCount();
+
+/* Call func on every item from 0 to nItems - 1, spread over the worker threads. Returns once every item has been processed. When the workers are already busy with another job, the items are all processed on the calling thread with a worker index of 0. */
+void hpsParallelFor(unsigned int nItems, HPSjobFun func, void *data);
+
+#endif
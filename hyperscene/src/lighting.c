@@ -1,12 +1,12 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <hyperscene.h>
 #include <hypersceneLighting.h>
 #include <hypermath.h>
 #include "memory.h"
+#include "scene.h"
 
 unsigned int hpsLightPoolSize = 1024;
-static HPSvector lightQueue;
-static bool initialized = false;
 
 typedef struct {
     float r, g, b;
@@ -30,25 +30,63 @@ typedef struct {
     HPSpool lightPool;
 } SceneLighting;
 
+/* The visible lights, and the current lights that are given to the renderer, belong to the render context that is rendering, so that cameras can be rendered on several threads at once, and from within each other */
+struct contextLights {
+    HPSvector queue; // Visible lights
+    unsigned int capacity; // Number of lights that the current light arrays hold
+    unsigned int n;
+    float *positions, *colors, *directions, *intensities;
+    float ambient[3];
+};
+
 unsigned int hpsMaxLights = 8;
-unsigned int currentLights;
-unsigned int *hpsNCurrentLights = &currentLights;
-float *hpsCurrentLightPositions;
-float *hpsCurrentLightColors;
-float *hpsCurrentLightDirections;
-float *hpsCurrentLightIntensities;
-float *hpsCurrentAmbientLight;
 
-void hpsInitLighting(void **data){
-    if (!initialized){
-        hpsInitVector(&lightQueue, 16);
-        hpsCurrentLightPositions = malloc(sizeof(float) * hpsMaxLights * 3);
-        hpsCurrentLightDirections = malloc(sizeof(float) * hpsMaxLights * 4);
-        hpsCurrentLightColors = malloc(sizeof(float) * hpsMaxLights * 3);
-        hpsCurrentLightIntensities = malloc(sizeof(float) * hpsMaxLights);
-        hpsCurrentAmbientLight = malloc(sizeof(float) * 3);
-        initialized = true;
+static void reserveLights(ContextLights *lights){
+    unsigned int n = hpsMaxLights;
+    if (lights->capacity >= n) return;
+    lights->positions = realloc(lights->positions, sizeof(float) * n * 3);
+    lights->directions = realloc(lights->directions, sizeof(float) * n * 4);
+    lights->colors = realloc(lights->colors, sizeof(float) * n * 3);
+    lights->intensities = realloc(lights->intensities, sizeof(float) * n);
+    if (!lights->positions || !lights->directions || !lights->colors || !lights->intensities){
+        fprintf(stderr, "Unable to allocate current lights\n");
+        exit(EXIT_FAILURE);
+    }
+    lights->capacity = n;
+}
+
+static ContextLights *contextLights(){
+    ContextLights **lights = hpsContextLights();
+    if (!*lights){
+        *lights = calloc(1, sizeof(ContextLights));
+        hpsInitVector(&(*lights)->queue, 16);
+        reserveLights(*lights);
     }
+    return *lights;
+}
+
+void hpsDeleteContextLights(ContextLights *lights){
+    hpsDeleteVector(&lights->queue);
+    free(lights->positions);
+    free(lights->directions);
+    free(lights->colors);
+    free(lights->intensities);
+    free(lights);
+}
+
+unsigned int *hpsNCurrentLights(){ return &contextLights()->n; }
+
+float *hpsCurrentLightPositions(){ return contextLights()->positions; }
+
+float *hpsCurrentLightColors(){ return contextLights()->colors; }
+
+float *hpsCurrentLightIntensities(){ return contextLights()->intensities; }
+
+float *hpsCurrentLightDirections(){ return contextLights()->directions; }
+
+float *hpsCurrentAmbientLight(){ return contextLights()->ambient; }
+
+void hpsInitLighting(void **data){
     SceneLighting *sLighting = malloc(sizeof(SceneLighting));
     sLighting->lightPool = hpsMakePool(sizeof(Light), hpsLightPoolSize, "Light pool");
     *data = sLighting;
@@ -63,37 +101,39 @@ void hpsDeleteLighting(void *data){
 // TODO: Cache lights?
 void hpsLightingPreRender(void *data){
     SceneLighting *sLighting = (SceneLighting *) data;
-    hpsCurrentAmbientLight[0] = sLighting->ambient.r;
-    hpsCurrentAmbientLight[1] = sLighting->ambient.g;
-    hpsCurrentAmbientLight[2] = sLighting->ambient.b;
-
-    currentLights = lightQueue.size;
-    currentLights = (currentLights > hpsMaxLights) ? hpsMaxLights : currentLights;
+    ContextLights *lights = contextLights();
+    HPSvector *queue = &lights->queue;
+    reserveLights(lights);
+    lights->ambient[0] = sLighting->ambient.r;
+    lights->ambient[1] = sLighting->ambient.g;
+    lights->ambient[2] = sLighting->ambient.b;
+
+    lights->n = (queue->size > hpsMaxLights) ? hpsMaxLights : queue->size;
     int i;
-    for (i = 0; i < currentLights; i++){
-        HPSnode *node = (HPSnode *) lightQueue.data[i];
+    for (i = 0; i < lights->n; i++){
+        HPSnode *node = (HPSnode *) queue->data[i];
         Light *l = (Light *) hpsNodeData(node);
         float *bs = hpsNodeBoundingSphere(node);
-        hpsCurrentLightIntensities[i] = l->intensity;
-        hpsCurrentLightPositions[i*3]   = bs[0];
-        hpsCurrentLightPositions[i*3+1] = bs[1];
-        hpsCurrentLightPositions[i*3+2] = bs[2];
-        hpsCurrentLightColors[i*3]   = l->color.r;
-        hpsCurrentLightColors[i*3+1] = l->color.g;
-        hpsCurrentLightColors[i*3+2] = l->color.b;
-        hpsCurrentLightDirections[i*3]   = l->worldDirection.x;
-        hpsCurrentLightDirections[i*3+1] = l->worldDirection.y;
-        hpsCurrentLightDirections[i*3+2] = l->worldDirection.z;
-        hpsCurrentLightDirections[i*3+3] = l->spotAngle;
+        lights->intensities[i] = l->intensity;
+        lights->positions[i*3]   = bs[0];
+        lights->positions[i*3+1] = bs[1];
+        lights->positions[i*3+2] = bs[2];
+        lights->colors[i*3]   = l->color.r;
+        lights->colors[i*3+1] = l->color.g;
+        lights->colors[i*3+2] = l->color.b;
+        lights->directions[i*4]   = l->worldDirection.x;
+        lights->directions[i*4+1] = l->worldDirection.y;
+        lights->directions[i*4+2] = l->worldDirection.z;
+        lights->directions[i*4+3] = l->spotAngle;
     }
 }
 
 void hpsLightingPostRender(void *data){
-    lightQueue.size = 0;
+    contextLights()->queue.size = 0;
 }
 
 void hpsLightingVisibleNode(void *data, HPSnode *node){
-    hpsPush(&lightQueue, node);
+    hpsPush(&contextLights()->queue, node);
 }
 
 void hpsLightingUpdateNode(void *data, HPSnode *node){
@@ -131,7 +171,8 @@ HPSextension lighting = {hpsInitLighting,
                          hpsLightingPostRender,
                          hpsLightingVisibleNode,
                          hpsLightingUpdateNode,
-                         hpsDeleteLighting};
+                         hpsDeleteLighting,
+                         true};
 
 HPSextension *hpsLighting = &lighting;
 
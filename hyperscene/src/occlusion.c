@@ -0,0 +1,369 @@
+/* Occlusion culling
+   Occluders are rasterized into a small depth buffer, four pixels at a time when SSE is available. Depths are normalized device depths (-1 at the near plane, 1 at the far plane), which vary linearly across the screen for both perspective and orthographic projections, so they are interpolated without perspective correction. Rasterization is conservative: a pixel is only written by occluders that cover all of it, and then with the furthest depth that the occluder has within the pixel, so the buffer never hides more than the occluders themselves do. Each pixel keeps the nearest of these depths.
+
+   The buffer is then reduced to a hierarchical-Z pyramid, in which each texel holds the furthest depth of the four texels beneath it. A box is hidden when the nearest depth of its corners is further than every texel that its screen rectangle touches, on the first level where that rectangle spans no more than two texels in either direction.
+
+   See "Hierarchical Z-Buffer Visibility" (Greene, Kass & Miller) and "Masked Software Occlusion Culling" (Hasselgren, Andersson & Akenine-Möller). */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <hypermath.h>
+#include "occlusion.h"
+#include "sort.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#define MAX_LEVELS 16
+
+struct occlusionBuffer {
+    unsigned int nLevels;
+    unsigned int widths[MAX_LEVELS], heights[MAX_LEVELS];
+    float *levels[MAX_LEVELS]; // Level 0 is the depth buffer itself
+    float viewProjection[16];
+    float *clip; // Clip space vertices of the occluder being rasterized
+    unsigned int clipCapacity;
+    HPSsortItem *edges; // Edges of the occluder being rasterized, and room to sort them
+    unsigned char *shared; // Whether each edge of the occluder belongs to two of its triangles
+    unsigned int edgeCapacity;
+};
+
+typedef struct {
+    float x, y, z, w;
+} Vertex;
+
+unsigned int hpsOcclusionBufferWidth = 256;
+unsigned int hpsOcclusionBufferHeight = 128;
+
+static float *allocateLevel(unsigned int width, unsigned int height){
+    float *level = malloc(sizeof(float) * width * height);
+    if (!level){
+        fprintf(stderr, "Unable to allocate occlusion buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    return level;
+}
+
+// The width is rounded up to a multiple of four, so that rows can be rasterized four pixels at a time
+OcclusionBuffer *hpsMakeOcclusionBuffer(unsigned int width, unsigned int height){
+    OcclusionBuffer *buffer = calloc(1, sizeof(OcclusionBuffer));
+    unsigned int i;
+    width = (width < 4) ? 4 : (width + 3) & ~3u;
+    height = height ? height : 1;
+    for (i = 0; i < MAX_LEVELS; i++){
+        buffer->widths[i] = width;
+        buffer->heights[i] = height;
+        buffer->levels[i] = allocateLevel(width, height);
+        buffer->nLevels++;
+        if ((width == 1) && (height == 1))
+            break;
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+    }
+    return buffer;
+}
+
+void hpsDeleteOcclusionBuffer(OcclusionBuffer *buffer){
+    unsigned int i;
+    for (i = 0; i < buffer->nLevels; i++)
+        free(buffer->levels[i]);
+    free(buffer->clip);
+    free(buffer->edges);
+    free(buffer->shared);
+    free(buffer);
+}
+
+void hpsOcclusionBufferSize(OcclusionBuffer *buffer, unsigned int *width,
+                            unsigned int *height){
+    *width = buffer->widths[0];
+    *height = buffer->heights[0];
+}
+
+void hpsClearOcclusionBuffer(OcclusionBuffer *buffer, const float *viewProjection){
+    float *depth = buffer->levels[0];
+    size_t i, n = (size_t) buffer->widths[0] * buffer->heights[0];
+    for (i = 0; i < n; i++)
+        depth[i] = 1.0;
+    memcpy(buffer->viewProjection, viewProjection, sizeof(float) * 16);
+}
+
+/* Rasterization
+   Triangles are drawn from both sides. Edge functions are evaluated at pixel centres, and are positive inside of counter-clockwise triangles. They are moved inwards by half of a pixel, and the depth outwards, so that the values at a pixel's centre hold for the whole pixel.
+
+   Edges that are shared by two triangles of an occluder are not moved inwards, since the pixels along them are covered by the occluder as a whole. Otherwise these pixels would be written by neither triangle, leaving a gap through every occluder made of more than one triangle. Such a pixel is written by both triangles, each with the depth of its own plane, which is only nearer than the occluder where it bends. edge[i] is whether the edge that leaves vertex i (a, b then c) is moved. */
+static void rasterize(OcclusionBuffer *buffer, const Vertex *a, const Vertex *b,
+                      const Vertex *c, const bool *edge){
+    unsigned int width = buffer->widths[0], height = buffer->heights[0];
+    float *depth = buffer->levels[0];
+    float x0, y0, z0, x1, y1, z1, x2, y2, z2, t;
+    float inset[3] = {edge[0] ? 0.5f : 0, edge[1] ? 0.5f : 0, edge[2] ? 0.5f : 0};
+    int xMin, xMax, yMin, yMax, x, y;
+    if ((a->w <= 0) || (b->w <= 0) || (c->w <= 0))
+        return;
+    x0 = (a->x / a->w * 0.5 + 0.5) * width; y0 = (a->y / a->w * 0.5 + 0.5) * height;
+    x1 = (b->x / b->w * 0.5 + 0.5) * width; y1 = (b->y / b->w * 0.5 + 0.5) * height;
+    x2 = (c->x / c->w * 0.5 + 0.5) * width; y2 = (c->y / c->w * 0.5 + 0.5) * height;
+    z0 = a->z / a->w; z1 = b->z / b->w; z2 = c->z / c->w;
+    float area = (x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0);
+    if (!(area != 0.0))
+        return;
+    if (area < 0){
+        t = x1; x1 = x2; x2 = t;
+        t = y1; y1 = y2; y2 = t;
+        t = z1; z1 = z2; z2 = t;
+        t = inset[0]; inset[0] = inset[2]; inset[2] = t;
+        area = -area;
+    }
+    xMin = floorf(fminf(x0, fminf(x1, x2)));
+    xMax = ceilf(fmaxf(x0, fmaxf(x1, x2)));
+    yMin = floorf(fminf(y0, fminf(y1, y2)));
+    yMax = ceilf(fmaxf(y0, fmaxf(y1, y2)));
+    if (xMin < 0) xMin = 0;
+    if (yMin < 0) yMin = 0;
+    if (xMax > (int) width - 1) xMax = width - 1;
+    if (yMax > (int) height - 1) yMax = height - 1;
+    if ((xMin > xMax) || (yMin > yMax))
+        return;
+    xMin &= ~3;
+    // Edge p -> q: (q.x - p.x)(y - p.y) - (q.y - p.y)(x - p.x)
+    float ea[3] = {y0 - y1, y1 - y2, y2 - y0};
+    float eb[3] = {x1 - x0, x2 - x1, x0 - x2};
+    float ec[3] = {-(ea[0] * x0 + eb[0] * y0) - inset[0] * (fabsf(ea[0]) + fabsf(eb[0])),
+                   -(ea[1] * x1 + eb[1] * y1) - inset[1] * (fabsf(ea[1]) + fabsf(eb[1])),
+                   -(ea[2] * x2 + eb[2] * y2) - inset[2] * (fabsf(ea[2]) + fabsf(eb[2]))};
+    float zx = ((z1 - z0) * (y2 - y0) - (z2 - z0) * (y1 - y0)) / area;
+    float zy = ((z2 - z0) * (x1 - x0) - (z1 - z0) * (x2 - x0)) / area;
+    float zc = z0 - zx * x0 - zy * y0 + 0.5f * (fabsf(zx) + fabsf(zy));
+#ifdef __SSE__
+    __m128 px = _mm_add_ps(_mm_set1_ps(xMin + 0.5f), _mm_set_ps(3, 2, 1, 0));
+    __m128 zero = _mm_setzero_ps();
+    __m128 e0x = _mm_mul_ps(_mm_set1_ps(ea[0]), px), e0step = _mm_set1_ps(ea[0] * 4);
+    __m128 e1x = _mm_mul_ps(_mm_set1_ps(ea[1]), px), e1step = _mm_set1_ps(ea[1] * 4);
+    __m128 e2x = _mm_mul_ps(_mm_set1_ps(ea[2]), px), e2step = _mm_set1_ps(ea[2] * 4);
+    __m128 zxs = _mm_mul_ps(_mm_set1_ps(zx), px), zstep = _mm_set1_ps(zx * 4);
+    for (y = yMin; y <= yMax; y++){
+        float py = y + 0.5f;
+        float *row = depth + (size_t) y * width;
+        __m128 e0 = _mm_add_ps(e0x, _mm_set1_ps(eb[0] * py + ec[0]));
+        __m128 e1 = _mm_add_ps(e1x, _mm_set1_ps(eb[1] * py + ec[1]));
+        __m128 e2 = _mm_add_ps(e2x, _mm_set1_ps(eb[2] * py + ec[2]));
+        __m128 z = _mm_add_ps(zxs, _mm_set1_ps(zy * py + zc));
+        for (x = xMin; x <= xMax; x += 4){
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero),
+                                                  _mm_cmpge_ps(e1, zero)),
+                                       _mm_cmpge_ps(e2, zero));
+            if (_mm_movemask_ps(inside)){
+                __m128 current = _mm_loadu_ps(row + x);
+                __m128 nearest = _mm_min_ps(current, z);
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest),
+                                                 _mm_andnot_ps(inside, current)));
+            }
+            e0 = _mm_add_ps(e0, e0step);
+            e1 = _mm_add_ps(e1, e1step);
+            e2 = _mm_add_ps(e2, e2step);
+            z = _mm_add_ps(z, zstep);
+        }
+    }
+#else
+    for (y = yMin; y <= yMax; y++){
+        float py = y + 0.5f;
+        float *row = depth + (size_t) y * width;
+        for (x = xMin; x <= xMax; x++){
+            float px = x + 0.5f;
+            if ((ea[0] * px + eb[0] * py + ec[0] >= 0) &&
+                (ea[1] * px + eb[1] * py + ec[1] >= 0) &&
+                (ea[2] * px + eb[2] * py + ec[2] >= 0)){
+                float z = zx * px + zy * py + zc;
+                if (z < row[x])
+                    row[x] = z;
+            }
+        }
+    }
+#endif
+}
+
+static int outcode(const Vertex *v){
+    return ((v->x < -v->w) ? 1 : 0) | ((v->x > v->w) ? 2 : 0) |
+        ((v->y < -v->w) ? 4 : 0) | ((v->y > v->w) ? 8 : 0) |
+        ((v->z < -v->w) ? 16 : 0) | ((v->z > v->w) ? 32 : 0);
+}
+
+/* Triangles that are outside of any one plane of the frustum are skipped, and those that cross the near plane are clipped to it. The edge along the near plane is an outer edge, while those between the triangles that the clipped polygon is split into are shared. */
+static void drawTriangle(OcclusionBuffer *buffer, const Vertex *v[3], const bool *edge){
+    int codes[3] = {outcode(v[0]), outcode(v[1]), outcode(v[2])};
+    Vertex polygon[4];
+    bool polygonEdge[4];
+    int i, n = 0;
+    if (codes[0] & codes[1] & codes[2])
+        return;
+    if (!((codes[0] | codes[1] | codes[2]) & 16)){
+        rasterize(buffer, v[0], v[1], v[2], edge);
+        return;
+    }
+    for (i = 0; i < 3; i++){
+        const Vertex *a = v[i], *b = v[(i + 1) % 3];
+        float da = a->z + a->w, db = b->z + b->w;
+        if (da >= 0){
+            polygonEdge[n] = edge[i];
+            polygon[n++] = *a;
+        }
+        if ((da >= 0) != (db >= 0)){
+            float t = da / (da - db);
+            Vertex *p = &polygon[n];
+            p->x = a->x + (b->x - a->x) * t;
+            p->y = a->y + (b->y - a->y) * t;
+            p->z = a->z + (b->z - a->z) * t;
+            p->w = a->w + (b->w - a->w) * t;
+            polygonEdge[n++] = (da >= 0) ? true : edge[i];
+        }
+    }
+    for (i = 1; i + 1 < n; i++){
+        bool triangleEdge[3] = {(i == 1) && polygonEdge[0], polygonEdge[i],
+                                (i + 2 == n) && polygonEdge[n - 1]};
+        rasterize(buffer, &polygon[0], &polygon[i], &polygon[i + 1], triangleEdge);
+    }
+}
+
+/* Edges are found to be shared by sorting them by the indices of their two vertices */
+static void findSharedEdges(OcclusionBuffer *buffer, Occluder *occluder){
+    unsigned int n = occluder->nIndices - occluder->nIndices % 3, i, j;
+    if (n > buffer->edgeCapacity){
+        buffer->edgeCapacity = n;
+        buffer->edges = realloc(buffer->edges, sizeof(HPSsortItem) * n * 2);
+        buffer->shared = realloc(buffer->shared, n);
+        if (!buffer->edges || !buffer->shared){
+            fprintf(stderr, "Unable to allocate occlusion buffer\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < n; i++){
+        uint64_t a = occluder->indices[i];
+        uint64_t b = occluder->indices[(i % 3 == 2) ? i - 2 : i + 1];
+        buffer->edges[i].key = (a < b) ? (a << 32) | b : (b << 32) | a;
+        buffer->edges[i].value = (void *) (uintptr_t) i;
+        buffer->shared[i] = false;
+    }
+    HPSsortItem *sorted = hpsRadixSort(buffer->edges, buffer->edges + n, n);
+    for (i = 0; i < n; i = j){
+        for (j = i + 1; (j < n) && (sorted[j].key == sorted[i].key); j++);
+        if (j - i > 1)
+            for (; i < j; i++)
+                buffer->shared[(uintptr_t) sorted[i].value] = true;
+    }
+}
+
+void hpsRasterizeOccluder(OcclusionBuffer *buffer, Occluder *occluder,
+                          const float *transform){
+    float m[16];
+    unsigned int i;
+    hpmMultMat4(buffer->viewProjection, transform, m);
+    if (occluder->nVertices > buffer->clipCapacity){
+        buffer->clipCapacity = occluder->nVertices;
+        buffer->clip = realloc(buffer->clip, sizeof(Vertex) * occluder->nVertices);
+        if (!buffer->clip){
+            fprintf(stderr, "Unable to allocate occlusion buffer\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    Vertex *clip = (Vertex *) buffer->clip;
+    for (i = 0; i < occluder->nVertices; i++){
+        float *p = &occluder->vertices[i*3];
+        clip[i].x = m[0] * p[0] + m[4] * p[1] + m[8]  * p[2] + m[12];
+        clip[i].y = m[1] * p[0] + m[5] * p[1] + m[9]  * p[2] + m[13];
+        clip[i].z = m[2] * p[0] + m[6] * p[1] + m[10] * p[2] + m[14];
+        clip[i].w = m[3] * p[0] + m[7] * p[1] + m[11] * p[2] + m[15];
+    }
+    findSharedEdges(buffer, occluder);
+    for (i = 0; i + 2 < occluder->nIndices; i += 3){
+        const Vertex *v[3] = {&clip[occluder->indices[i]], &clip[occluder->indices[i + 1]],
+                              &clip[occluder->indices[i + 2]]};
+        bool edge[3] = {!buffer->shared[i], !buffer->shared[i + 1], !buffer->shared[i + 2]};
+        drawTriangle(buffer, v, edge);
+    }
+}
+
+/* Pyramid */
+static void reduceLevel(const float *src, unsigned int srcWidth, unsigned int srcHeight,
+                        float *dst, unsigned int width, unsigned int height){
+    unsigned int x, y;
+    for (y = 0; y < height; y++){
+        const float *r0 = src + (size_t) 2 * y * srcWidth;
+        const float *r1 = (2 * y + 1 < srcHeight) ? r0 + srcWidth : r0;
+        float *row = dst + (size_t) y * width;
+        x = 0;
+#ifdef __SSE__
+        for (; 2 * x + 8 <= srcWidth; x += 4){
+            __m128 a = _mm_max_ps(_mm_loadu_ps(r0 + 2 * x), _mm_loadu_ps(r1 + 2 * x));
+            __m128 b = _mm_max_ps(_mm_loadu_ps(r0 + 2 * x + 4), _mm_loadu_ps(r1 + 2 * x + 4));
+            _mm_storeu_ps(row + x, _mm_max_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+                                              _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+        }
+#endif
+        for (; x < width; x++){
+            unsigned int x0 = 2 * x, x1 = (2 * x + 1 < srcWidth) ? 2 * x + 1 : 2 * x;
+            row[x] = fmaxf(fmaxf(r0[x0], r0[x1]), fmaxf(r1[x0], r1[x1]));
+        }
+    }
+}
+
+void hpsBuildOcclusionPyramid(OcclusionBuffer *buffer){
+    unsigned int i;
+    for (i = 1; i < buffer->nLevels; i++)
+        reduceLevel(buffer->levels[i - 1], buffer->widths[i - 1], buffer->heights[i - 1],
+                    buffer->levels[i], buffer->widths[i], buffer->heights[i]);
+}
+
+/* Testing
+   The corners of the box are projected from partial products of the view projection's columns */
+static int clampPixel(float f, unsigned int size){
+    if (f < 0) return 0;
+    if (f > size - 1) return size - 1;
+    return (int) f;
+}
+
+bool hpsBoxOccluded(OcclusionBuffer *buffer, const float *min, const float *max){
+    const float *m = buffer->viewProjection;
+    float cx[2][4], cy[2][4], cz[2][4];
+    float xMin = INFINITY, xMax = -INFINITY, yMin = INFINITY, yMax = -INFINITY;
+    float zMin = INFINITY;
+    unsigned int width = buffer->widths[0], height = buffer->heights[0];
+    int i, x0, x1, y0, y1, level = 0, tx, ty;
+    for (i = 0; i < 4; i++){
+        cx[0][i] = m[i] * min[0];     cx[1][i] = m[i] * max[0];
+        cy[0][i] = m[4 + i] * min[1]; cy[1][i] = m[4 + i] * max[1];
+        cz[0][i] = m[8 + i] * min[2] + m[12 + i];
+        cz[1][i] = m[8 + i] * max[2] + m[12 + i];
+    }
+    for (i = 0; i < 8; i++){
+        const float *a = cx[i & 1], *b = cy[(i >> 1) & 1], *c = cz[i >> 2];
+        float w = a[3] + b[3] + c[3];
+        float z = a[2] + b[2] + c[2];
+        if ((w <= 0) || (z < -w))
+            return false;
+        float x = (a[0] + b[0] + c[0]) / w, y = (a[1] + b[1] + c[1]) / w;
+        z /= w;
+        if (x < xMin) xMin = x;
+        if (x > xMax) xMax = x;
+        if (y < yMin) yMin = y;
+        if (y > yMax) yMax = y;
+        if (z < zMin) zMin = z;
+    }
+    if ((xMax < -1) || (xMin > 1) || (yMax < -1) || (yMin > 1))
+        return false;
+    x0 = clampPixel((xMin * 0.5 + 0.5) * width, width);
+    x1 = clampPixel((xMax * 0.5 + 0.5) * width, width);
+    y0 = clampPixel((yMin * 0.5 + 0.5) * height, height);
+    y1 = clampPixel((yMax * 0.5 + 0.5) * height, height);
+    while ((level + 1 < buffer->nLevels) &&
+           (((x1 >> level) - (x0 >> level) > 1) || ((y1 >> level) - (y0 >> level) > 1)))
+        level++;
+    const float *texels = buffer->levels[level];
+    unsigned int levelWidth = buffer->widths[level];
+    for (ty = y0 >> level; ty <= (y1 >> level); ty++)
+        for (tx = x0 >> level; tx <= (x1 >> level); tx++)
+            if (texels[(size_t) ty * levelWidth + tx] >= zMin)
+                return false;
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef HPS_OCCLUSION
+#define HPS_OCCLUSION 1
+
+#include <stdbool.h>
+#include "partition.h"
+
+// Proxy geometry of a node, in the node's own space: nIndices / 3 triangles, which share the indices of the edges they have in common
+typedef struct occluder {
+    float *vertices;
+    unsigned int nVertices;
+    unsigned int *indices;
+    unsigned int nIndices;
+} Occluder;
+
+OcclusionBuffer *hpsMakeOcclusionBuffer(unsigned int width, unsigned int height);
+
+void hpsDeleteOcclusionBuffer(OcclusionBuffer *buffer);
+
+void hpsOcclusionBufferSize(OcclusionBuffer *buffer, unsigned int *width,
+                            unsigned int *height);
+
+// Clear the buffer before occluders are rasterized as seen through viewProjection
+void hpsClearOcclusionBuffer(OcclusionBuffer *buffer, const float *viewProjection);
+
+// Rasterize the occluder, placed in the world by transform
+void hpsRasterizeOccluder(OcclusionBuffer *buffer, Occluder *occluder,
+                          const float *transform);
+
+// Build the buffer's depth pyramid, once every occluder has been rasterized
+void hpsBuildOcclusionPyramid(OcclusionBuffer *buffer);
+
+// Whether the box is certainly hidden behind the occluders. Boxes that reach the near plane never are.
+bool hpsBoxOccluded(OcclusionBuffer *buffer, const float *min, const float *max);
+
+#endif
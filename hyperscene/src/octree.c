@@ -0,0 +1,262 @@
+/* Loose octree
+   Cells have fixed bounds, but the box used to cull a cell is twice the size of the cell (see Game Programming Gems, "Loose Octrees"). A node is placed in the deepest cell that is at least as big as the node, based only on the position of its centre, so it is always inside of that cell's loose bounds. Moving nodes stay in their cell until they leave its loose bounds, and nodes are removed from a cell by swapping them with the cell's last node. Nodes whose centres are outside of the root cell are kept in the root, and are tested individually.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "partition.h"
+#include "memory.h"
+#include "cull.h"
+
+typedef struct octreeCell {
+    struct octreeCell *parent;
+    struct octreeCell *children[8];
+    struct octree *octree;
+    float x, y, z, halfSize; // Centre and half of the edge length of the cell
+    unsigned char index, nChildren; // index is the cell's position in its parent's children
+    bool prunePending;
+    HPSvector nodes;
+} OctreeCell;
+
+typedef struct octree {
+    OctreeCell *root;
+    HPSpool pool;
+    unsigned int maxDepth;
+    HPSvector emptyCells; // Cells that may be able to be removed
+} Octree;
+
+Octree *hpsOctreeNew();
+void hpsOctreeDelete(Octree *octree);
+void hpsOctreeAddNode(Node *node, Octree *octree);
+void hpsOctreeRemoveNode(Node *node);
+void hpsOctreeUpdateNode(Node *node);
+void hpsOctreeUpdateNodes(Node **nodes, unsigned int n);
+void hpsOctreeDoVisible(Octree *octree, Plane *planes, CullCache *cache,
+                        void (*func)(Node *));
+void hpsOctreeMaintain(Octree *octree);
+void hpsOctreeDoVisibleVolume(Octree *octree, Plane *planes, int nPlanes,
+                              void (*func)(Node *));
+
+unsigned int hpsOctreePartitionPoolSize = 4096;
+float hpsOctreeSize = 8192;
+unsigned int hpsOctreeDepth = 10;
+
+PartitionInterface octreePartitionInterface = {(void *(*)()) hpsOctreeNew,
+                                               (void (*)(void *)) hpsOctreeDelete,
+                                               (void (*)(Node *, void *)) hpsOctreeAddNode,
+                                               (void (*)(Node *)) hpsOctreeRemoveNode,
+                                               (void (*)(Node *)) hpsOctreeUpdateNode,
+                                               (void (*)(void *, Plane *, CullCache *, void (*)(Node *)))
+                                                 hpsOctreeDoVisible,
+                                               (void (*)(void *)) hpsOctreeMaintain,
+                                               NULL, NULL,
+                                               (void (*)(void *, Plane *, int, void (*)(Node *)))
+                                                 hpsOctreeDoVisibleVolume,
+                                               NULL, NULL,
+                                               (void (*)(Node **, unsigned int))
+                                                 hpsOctreeUpdateNodes};
+
+PartitionInterface *hpsOctreePartitionInterface = &octreePartitionInterface;
+
+/* Cells */
+static OctreeCell *newCell(Octree *octree, OctreeCell *parent, int index){
+    OctreeCell *cell = hpsAllocateFrom(octree->pool);
+    int i;
+    cell->parent = parent;
+    cell->octree = octree;
+    cell->index = index;
+    cell->nChildren = 0;
+    cell->prunePending = false;
+    for (i = 0; i < 8; i++)
+        cell->children[i] = NULL;
+    hpsInitVector(&cell->nodes, 0);
+    if (parent){
+        float h = parent->halfSize / 2;
+        cell->halfSize = h;
+        cell->x = parent->x + ((index & 1) ? h : -h);
+        cell->y = parent->y + ((index & 2) ? h : -h);
+        cell->z = parent->z + ((index & 4) ? h : -h);
+        parent->children[index] = cell;
+        parent->nChildren++;
+    }
+    return cell;
+}
+
+static void deleteCell(OctreeCell *cell){
+    hpsDeleteVector(&cell->nodes);
+    hpsDeleteFrom(cell, cell->octree->pool);
+}
+
+static bool looselyContains(OctreeCell *cell, BoundingSphere *bs){
+    float h = 2 * cell->halfSize - bs->r;
+    return (fabs(bs->x - cell->x) <= h &&
+            fabs(bs->y - cell->y) <= h &&
+            fabs(bs->z - cell->z) <= h);
+}
+
+/* The deepest cell that is at least as large as the node and holds its centre, creating it if need be */
+static OctreeCell *targetCell(Octree *octree, BoundingSphere *bs){
+    OctreeCell *cell = octree->root;
+    unsigned int depth = 0;
+    float h = cell->halfSize;
+    if ((fabs(bs->x - cell->x) > h) || (fabs(bs->y - cell->y) > h) ||
+        (fabs(bs->z - cell->z) > h))
+        return cell;
+    while ((depth < octree->maxDepth) && (bs->r <= cell->halfSize / 2)){
+        int i = ((bs->x >= cell->x) ? 1 : 0) |
+            ((bs->y >= cell->y) ? 2 : 0) |
+            ((bs->z >= cell->z) ? 4 : 0);
+        cell = cell->children[i] ? cell->children[i] : newCell(octree, cell, i);
+        depth++;
+    }
+    return cell;
+}
+
+static void addToCell(OctreeCell *cell, Node *node){
+    node->slot = cell->nodes.size;
+    node->area = (void *) cell;
+    hpsPush(&cell->nodes, node);
+}
+
+static void removeFromCell(OctreeCell *cell, Node *node){
+    HPSvector *nodes = &cell->nodes;
+    Node *last = nodes->data[--nodes->size];
+    nodes->data[node->slot] = last;
+    last->slot = node->slot;
+    if (!nodes->size && !cell->nChildren && cell->parent && !cell->prunePending){
+        cell->prunePending = true;
+        hpsPush(&cell->octree->emptyCells, cell);
+    }
+}
+
+/* Partition interface */
+Octree *hpsOctreeNew(){
+    Octree *octree = malloc(sizeof(Octree));
+    octree->pool = hpsMakePool(sizeof(OctreeCell), hpsOctreePartitionPoolSize,
+                               "Octree pool");
+    octree->maxDepth = hpsOctreeDepth;
+    hpsInitVector(&octree->emptyCells, 64);
+    octree->root = newCell(octree, NULL, 0);
+    octree->root->x = octree->root->y = octree->root->z = 0;
+    octree->root->halfSize = hpsOctreeSize / 2;
+    return octree;
+}
+
+static void deleteCells(OctreeCell *cell){
+    int i;
+    for (i = 0; i < 8; i++)
+        if (cell->children[i])
+            deleteCells(cell->children[i]);
+    hpsDeleteVector(&cell->nodes);
+}
+
+void hpsOctreeDelete(Octree *octree){
+    deleteCells(octree->root);
+    hpsDeletePool(octree->pool);
+    hpsDeleteVector(&octree->emptyCells);
+    free(octree);
+}
+
+void hpsOctreeAddNode(Node *node, Octree *octree){
+    addToCell(targetCell(octree, node->boundingSphere), node);
+}
+
+void hpsOctreeRemoveNode(Node *node){
+    OctreeCell *cell = (OctreeCell *) node->area;
+    if ((node->slot >= cell->nodes.size) || (cell->nodes.data[node->slot] != node)){
+	fprintf(stderr, "Warning, tried to remove node %p from an octree cell that it did not belong to\n", node->data);
+        return;
+    }
+    removeFromCell(cell, node);
+}
+
+static bool nodeFits(Node *node){
+    OctreeCell *cell = (OctreeCell *) node->area;
+    return cell->parent && looselyContains(cell, node->boundingSphere);
+}
+
+static void moveNode(Node *node){
+    OctreeCell *cell = (OctreeCell *) node->area;
+    OctreeCell *target = targetCell(cell->octree, node->boundingSphere);
+    if (target != cell){
+        removeFromCell(cell, node);
+        addToCell(target, node);
+    }
+}
+
+void hpsOctreeUpdateNode(Node *node){
+    if (!nodeFits(node))
+        moveNode(node);
+}
+
+/* Nodes that stay within their cell's loose bounds need nothing done, so only the others are handled on the calling thread */
+void hpsOctreeUpdateNodes(Node **nodes, unsigned int n){
+    hpsUpdateMovedNodes(nodes, n, &nodeFits, NULL, &moveNode);
+}
+
+/* Maintenance
+   Empty cells are only removed once the scene has been updated, so that nodes moving back and forth between cells do not keep creating and deleting them. */
+void hpsOctreeMaintain(Octree *octree){
+    HPSvector *empty = &octree->emptyCells;
+    int i;
+    for (i = 0; i < empty->size; i++){
+        OctreeCell *cell = empty->data[i];
+        cell->prunePending = false;
+        while (cell->parent && !cell->nodes.size && !cell->nChildren &&
+               !cell->prunePending){
+            OctreeCell *parent = cell->parent;
+            parent->children[cell->index] = NULL;
+            parent->nChildren--;
+            deleteCell(cell);
+            cell = parent;
+        }
+    }
+    empty->size = 0;
+}
+
+/* Visibility testing */
+static void cellMap(OctreeCell *cell, void (*func)(Node *)){
+    int i;
+    for (i = 0; i < cell->nodes.size; i++)
+        func(cell->nodes.data[i]);
+    for (i = 0; i < 8; i++)
+        if (cell->children[i])
+            cellMap(cell->children[i], func);
+}
+
+static void doVisible(OctreeCell *cell, Plane *planes, void (*func)(Node *),
+                      unsigned int planeMask){
+    float h = 2 * cell->halfSize;
+    float min[3] = {cell->x - h, cell->y - h, cell->z - h};
+    float max[3] = {cell->x + h, cell->y + h, cell->z + h};
+    unsigned int nextMask = 0;
+    int i;
+    HPSintersection inView = hpsBoxInPlanes(min, max, planes, planeMask, &nextMask);
+    if (inView == HPS_INSIDE)
+        cellMap(cell, func);
+    else if (inView == HPS_INTERSECT){
+        hpsNodesInPlanes((Node **) cell->nodes.data, cell->nodes.size, planes, nextMask,
+                         func, NULL);
+        for (i = 0; i < 8; i++)
+            if (cell->children[i])
+                doVisible(cell->children[i], planes, func, nextMask);
+    }
+}
+
+void hpsOctreeDoVisibleVolume(Octree *octree, Plane *planes, int nPlanes,
+                              void (*func)(Node *)){
+    OctreeCell *root = octree->root;
+    unsigned int mask = hpsPlaneMask(nPlanes);
+    int i;
+    hpsNodesInPlanes((Node **) root->nodes.data, root->nodes.size, planes, mask,
+                     func, NULL);
+    for (i = 0; i < 8; i++)
+        if (root->children[i])
+            doVisible(root->children[i], planes, func, mask);
+}
+
+void hpsOctreeDoVisible(Octree *octree, Plane *planes, CullCache *cache,
+                        void (*func)(Node *)){
+    hpsOctreeDoVisibleVolume(octree, planes, 6, func);
+}
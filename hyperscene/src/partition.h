@@ -1,3 +1,9 @@
+#ifndef HPS_PARTITION
+#define HPS_PARTITION 1
+
+#include <stddef.h>
+#include <stdbool.h>
+
 // The position and size of a node
 typedef struct {
     float x, y, z, r;
@@ -11,15 +17,61 @@ typedef struct {
 typedef struct {
     BoundingSphere *boundingSphere;
     void *area; // For use by the partition: what area is this node in?
+    unsigned int slot; // For use by the partition: where in its area is this node?
     void *data; // Data used by Hyperscene
 } Node;
 
+// A ray from origin along the unit vector direction, as far as length. inverse holds the reciprocals of direction's components
+typedef struct {
+    float origin[3], direction[3], inverse[3];
+    float length;
+} Ray;
+
+// A region of space that nodes can be found in: either a sphere, or a box with any orientation
+typedef struct {
+    bool sphere;
+    float center[3];
+    float radius; // Of a sphere
+    float axes[3][3], extents[3]; // The unit axes and half-extents of a box
+    Plane planes[6]; // The faces of a box, facing inwards
+} Region;
+
+// Per-camera state that a partition may keep from one visibility test to the next, such as which planes culled which areas. data is allocated by the partition and freed along with the camera.
+typedef struct {
+    void *data;
+    size_t size;
+} CullCache;
+
+// A camera's hierarchical depth buffer of occluders, see occlusion.h
+typedef struct occlusionBuffer OcclusionBuffer;
+
 typedef struct partitionInterface{
     void *(*new)(); // Create and return a new partition for a scene
     void (*delete)(void *); // Delete the given partition
     void (*addNode)(Node *, void *); // Add a node to a scene
     void (*removeNode)(Node *); // Remove a node
     void (*updateNode)(Node *); // Called when a node has moved
-    // For the given partition (arg 1) and a set of six planes (arg 2), call the given function (arg 3) with every node that is inside all six planes
-    void (*doVisible)(void *, Plane *, void (*)(Node *));
+    // For the given partition (arg 1) and a set of six normalized planes in opposing pairs (right, left, top, bottom, near, far) (arg 2), call the given function (arg 4) with every node that is inside all six planes. Arg 3 is the cull cache of the camera being rendered, or NULL
+    void (*doVisible)(void *, Plane *, CullCache *, void (*)(Node *));
+    // Optional (may be NULL): called on the partition once its scene has been updated, so that any restructuring can be done outside of doVisible
+    void (*maintain)(void *);
+    // Optional (may be NULL): as doVisible, for several frusta at once. Arg 2 holds six planes for each of the arg 3 (<= HPS_MAX_FRUSTA) frusta, and the function is called once with every node that is inside of any of them, along with a bitmask of the frusta that the node is inside of
+    void (*doVisibleMulti)(void *, Plane *, int, void (*)(Node *, unsigned int));
+    // Optional (may be NULL): as doVisible, but areas of the partition that hpsBoxOccluded finds hidden in the given occlusion buffer (arg 4) need not be descended into. Nodes passed to the function are still tested for occlusion by the camera
+    void (*doVisibleOccluded)(void *, Plane *, CullCache *, OcclusionBuffer *, void (*)(Node *));
+    // Optional (may be NULL): as doVisible, for any convex volume rather than a camera's frustum. Arg 2 holds the arg 3 (<= HPS_MAX_PLANES) normalized planes that bound the volume, in no particular order
+    void (*doVisibleVolume)(void *, Plane *, int, void (*)(Node *));
+    // Optional (may be NULL): call the given function (arg 3) with every node whose bounding sphere the ray (arg 2) passes through, along with the distance at which the ray enters the sphere (0 when it starts inside of it) and arg 4. The function may shorten the ray, after which nodes that are further along it need not be passed on
+    void (*raycast)(void *, Ray *, void (*)(Node *, float, void *), void *);
+    // Optional (may be NULL): call the given function (arg 3) with every node whose bounding sphere overlaps the region (arg 2), along with arg 4
+    void (*overlap)(void *, Region *, void (*)(Node *, void *), void *);
+    // Optional (may be NULL): as updateNode, for all of the arg 2 nodes (arg 1) that were moved by one update of the scene. Partitions may spread the work over the worker threads (see hpsUpdateMovedNodes in cull.h)
+    void (*updateNodes)(Node **, unsigned int);
+    // Whether doVisible may leave out nodes that are inside of the frustum, such as those hidden behind the walls between portals. Cameras then cull the whole scene again whenever it has changed, rather than only testing the nodes that moved against their planes
+    bool cullsBeyondFrustum;
 } PartitionInterface;
+
+#define HPS_MAX_FRUSTA 32
+#define HPS_MAX_PLANES 32
+
+#endif
@@ -0,0 +1,651 @@
+/* Cells and portals
+   Space is divided by the user into convex cells, each bounded by a set of planes, which are joined by convex polygonal portals such as doorways and windows. A node is placed in every cell that its bounding sphere may overlap. Nodes that overlap no cell, or more than MAX_NODE_CELLS, are kept apart and tested individually.
+
+   Visibility testing starts from the cells that hold the camera, and recursively looks through each portal that can be seen from them: the portal is clipped to the frustum that it is seen through, and the frustum is narrowed to the planes that pass through the camera and the edges of what remains of the portal (see "Visibility Preprocessing for Interactive Walkthroughs" (Teller & Séquin), and "Portals and Mirrors" (Luebke & Georges)). Each cell keeps the frusta that it was seen through, and its nodes are tested against them. A cell is looked into through at most MAX_CELL_FRUSTA narrowed frusta, after which it is looked into once more through the whole frustum of the camera, so the cost of a traversal is bounded however the cells are connected. When the camera is in no cell, every cell is tested against its whole frustum.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "scene.h"
+#include "cull.h"
+
+#define MAX_CELL_PLANES 32
+#define MAX_PORTAL_VERTICES 16
+#define MAX_FRUSTUM_PLANES HPS_MAX_PLANES
+#define MAX_NODE_CELLS 4
+#define MAX_CELL_FRUSTA 4
+// Clipping a portal to a frustum adds at most one vertex per plane
+#define MAX_CLIPPED_VERTICES (MAX_PORTAL_VERTICES + MAX_FRUSTUM_PLANES)
+
+typedef struct portalCell {
+    struct portalPartition *partition;
+    unsigned int index; // Position of the cell in partition->cells
+    unsigned int nPlanes;
+    Plane planes[MAX_CELL_PLANES];
+    HPSvector portals;
+    HPSvector nodes;
+} PortalCell;
+
+typedef struct {
+    PortalCell *cells[2];
+    Plane plane;
+    unsigned int nVertices;
+    float vertices[MAX_PORTAL_VERTICES][3];
+} Portal;
+
+// The cells that a node is in, and its slot in each. Nodes in no cell have their slot in the partition's outside nodes.
+typedef struct {
+    struct portalPartition *partition;
+    unsigned int nCells;
+    PortalCell *cells[MAX_NODE_CELLS];
+    unsigned int slots[MAX_NODE_CELLS];
+} Membership;
+
+typedef struct portalPartition {
+    HPSvector cells;
+    HPSvector portals;
+    HPSvector outside; // Nodes that are in no cell, or in too many
+    HPSpool pool; // Memberships
+} PortalPartition;
+
+PortalPartition *hpsPortalNew();
+void hpsPortalDelete(PortalPartition *partition);
+void hpsPortalAddNode(Node *node, PortalPartition *partition);
+void hpsPortalRemoveNode(Node *node);
+void hpsPortalUpdateNode(Node *node);
+void hpsPortalUpdateNodes(Node **nodes, unsigned int n);
+void hpsPortalDoVisible(PortalPartition *partition, Plane *planes, CullCache *cache,
+                        void (*func)(Node *));
+void hpsPortalDoVisibleVolume(PortalPartition *partition, Plane *planes, int nPlanes,
+                              void (*func)(Node *));
+
+unsigned int hpsPortalPartitionPoolSize = 4096;
+
+PartitionInterface portalPartitionInterface = {(void *(*)()) hpsPortalNew,
+                                               (void (*)(void *)) hpsPortalDelete,
+                                               (void (*)(Node *, void *)) hpsPortalAddNode,
+                                               (void (*)(Node *)) hpsPortalRemoveNode,
+                                               (void (*)(Node *)) hpsPortalUpdateNode,
+                                               (void (*)(void *, Plane *, CullCache *, void (*)(Node *)))
+                                                 hpsPortalDoVisible,
+                                               NULL, NULL, NULL,
+                                               (void (*)(void *, Plane *, int, void (*)(Node *)))
+                                                 hpsPortalDoVisibleVolume,
+                                               NULL, NULL,
+                                               (void (*)(Node **, unsigned int))
+                                                 hpsPortalUpdateNodes,
+                                               true};
+
+void *hpsPortalPartitionInterface = &portalPartitionInterface;
+
+static float distance(const Plane *plane, const float *p){
+    return plane->a * p[0] + plane->b * p[1] + plane->c * p[2] + plane->d;
+}
+
+static bool sphereInPlanes(BoundingSphere *bs, const Plane *planes, unsigned int n){
+    unsigned int i;
+    for (i = 0; i < n; i++)
+        if (planes[i].a * bs->x + planes[i].b * bs->y + planes[i].c * bs->z + planes[i].d < -bs->r)
+            return false;
+    return true;
+}
+
+/* Node placement */
+static bool overlapsCell(PortalCell *cell, BoundingSphere *bs){
+    return sphereInPlanes(bs, cell->planes, cell->nPlanes);
+}
+
+static bool insideCell(PortalCell *cell, BoundingSphere *bs){
+    BoundingSphere inner = {bs->x, bs->y, bs->z, -bs->r};
+    return sphereInPlanes(&inner, cell->planes, cell->nPlanes);
+}
+
+static void place(PortalPartition *partition, Node *node){
+    Membership *m = node->area;
+    PortalCell *cells[MAX_NODE_CELLS];
+    unsigned int i, n = 0;
+    for (i = 0; i < partition->cells.size; i++){
+        PortalCell *cell = partition->cells.data[i];
+        if (overlapsCell(cell, node->boundingSphere)){
+            if (n == MAX_NODE_CELLS){
+                n = 0;
+                break;
+            }
+            cells[n++] = cell;
+        }
+    }
+    m->nCells = n;
+    if (!n){
+        m->slots[0] = partition->outside.size;
+        hpsPush(&partition->outside, node);
+        return;
+    }
+    for (i = 0; i < n; i++){
+        m->cells[i] = cells[i];
+        m->slots[i] = cells[i]->nodes.size;
+        hpsPush(&cells[i]->nodes, node);
+    }
+}
+
+/* Remove the node in the given slot of nodes, which belong to cell (NULL for the outside nodes), by swapping it with the last node */
+static void removeAt(HPSvector *nodes, unsigned int slot, PortalCell *cell){
+    Node *last = nodes->data[--nodes->size];
+    Membership *m = last->area;
+    unsigned int i = 0;
+    nodes->data[slot] = last;
+    while (cell && (m->cells[i] != cell))
+        i++;
+    m->slots[i] = slot;
+}
+
+static void unplace(PortalPartition *partition, Node *node){
+    Membership *m = node->area;
+    unsigned int i;
+    if (!m->nCells)
+        removeAt(&partition->outside, m->slots[0], NULL);
+    for (i = 0; i < m->nCells; i++)
+        removeAt(&m->cells[i]->nodes, m->slots[i], m->cells[i]);
+}
+
+/* Partition interface */
+PortalPartition *hpsPortalNew(){
+    PortalPartition *partition = malloc(sizeof(PortalPartition));
+    partition->pool = hpsMakePool(sizeof(Membership), hpsPortalPartitionPoolSize,
+                                  "Portal pool");
+    hpsInitVector(&partition->cells, 16);
+    hpsInitVector(&partition->portals, 16);
+    hpsInitVector(&partition->outside, 64);
+    return partition;
+}
+
+void hpsPortalDelete(PortalPartition *partition){
+    int i;
+    for (i = 0; i < partition->cells.size; i++){
+        PortalCell *cell = partition->cells.data[i];
+        hpsDeleteVector(&cell->portals);
+        hpsDeleteVector(&cell->nodes);
+        free(cell);
+    }
+    for (i = 0; i < partition->portals.size; i++)
+        free(partition->portals.data[i]);
+    hpsDeleteVector(&partition->cells);
+    hpsDeleteVector(&partition->portals);
+    hpsDeleteVector(&partition->outside);
+    hpsDeletePool(partition->pool);
+    free(partition);
+}
+
+void hpsPortalAddNode(Node *node, PortalPartition *partition){
+    Membership *m = hpsAllocateFrom(partition->pool);
+    m->partition = partition;
+    node->area = (void *) m;
+    node->slot = 0;
+    place(partition, node);
+}
+
+void hpsPortalRemoveNode(Node *node){
+    Membership *m = node->area;
+    HPSvector *nodes = m->nCells ? &m->cells[0]->nodes : &m->partition->outside;
+    if ((m->slots[0] >= nodes->size) || (nodes->data[m->slots[0]] != node)){
+	fprintf(stderr, "Warning, tried to remove node %p from a portal cell that it did not belong to\n", node->data);
+        return;
+    }
+    unplace(m->partition, node);
+    hpsDeleteFrom(m, m->partition->pool);
+}
+
+static bool nodeFits(Node *node){
+    Membership *m = node->area;
+    return (m->nCells == 1) && insideCell(m->cells[0], node->boundingSphere);
+}
+
+static void moveNode(Node *node){
+    Membership *m = node->area;
+    unplace(m->partition, node);
+    place(m->partition, node);
+}
+
+void hpsPortalUpdateNode(Node *node){
+    if (!nodeFits(node))
+        moveNode(node);
+}
+
+/* Nodes that stay inside of the one cell they were in need nothing done, so only the others are placed again on the calling thread */
+void hpsPortalUpdateNodes(Node **nodes, unsigned int n){
+    hpsUpdateMovedNodes(nodes, n, &nodeFits, NULL, &moveNode);
+}
+
+/* Cells and portals */
+static bool normalizePlane(Plane *plane){
+    float length = sqrt(plane->a * plane->a + plane->b * plane->b + plane->c * plane->c);
+    if (!(length > 0))
+        return false;
+    plane->a /= length; plane->b /= length; plane->c /= length; plane->d /= length;
+    return true;
+}
+
+static PortalPartition *scenePartition(HPSscene *scene){
+    if (scene->partitionInterface != &portalPartitionInterface){
+        fprintf(stderr, "Scene %p does not use the portal partition interface\n", scene);
+        return NULL;
+    }
+    return scene->partitionStruct;
+}
+
+/* Every node is placed again, since cells may be added after nodes */
+static void replaceNodes(PortalPartition *partition){
+    HPSvector nodes;
+    int i, j;
+    hpsInitVector(&nodes, partition->outside.size + 64);
+    for (i = 0; i < partition->outside.size; i++)
+        hpsPush(&nodes, partition->outside.data[i]);
+    partition->outside.size = 0;
+    for (i = 0; i < partition->cells.size; i++){
+        PortalCell *cell = partition->cells.data[i];
+        for (j = 0; j < cell->nodes.size; j++){
+            Node *node = cell->nodes.data[j];
+            if (((Membership *) node->area)->cells[0] == cell)
+                hpsPush(&nodes, node);
+        }
+    }
+    for (i = 0; i < partition->cells.size; i++)
+        ((PortalCell *) partition->cells.data[i])->nodes.size = 0;
+    for (i = 0; i < nodes.size; i++)
+        place(partition, nodes.data[i]);
+    hpsDeleteVector(&nodes);
+}
+
+HPSportalCell *hpsAddPortalCell(HPSscene *scene, float *planes, unsigned int nPlanes){
+    PortalPartition *partition = scenePartition(scene);
+    PortalCell *cell;
+    unsigned int i;
+    if (!partition)
+        return NULL;
+    if (!nPlanes || (nPlanes > MAX_CELL_PLANES)){
+        fprintf(stderr, "Portal cells must have between 1 and %d planes\n", MAX_CELL_PLANES);
+        return NULL;
+    }
+    cell = malloc(sizeof(PortalCell));
+    for (i = 0; i < nPlanes; i++){
+        Plane *plane = &cell->planes[i];
+        plane->a = planes[i*4]; plane->b = planes[i*4 + 1];
+        plane->c = planes[i*4 + 2]; plane->d = planes[i*4 + 3];
+        if (!normalizePlane(plane)){
+            fprintf(stderr, "Plane %d of portal cell has no normal\n", i);
+            free(cell);
+            return NULL;
+        }
+    }
+    cell->partition = partition;
+    cell->nPlanes = nPlanes;
+    cell->index = partition->cells.size;
+    hpsInitVector(&cell->portals, 4);
+    hpsInitVector(&cell->nodes, 16);
+    hpsPush(&partition->cells, cell);
+    replaceNodes(partition);
+    scene->version++;
+    return (HPSportalCell *) cell;
+}
+
+void hpsAddPortal(HPSscene *scene, HPSportalCell *a, HPSportalCell *b,
+                  float *vertices, unsigned int nVertices){
+    PortalPartition *partition = scenePartition(scene);
+    PortalCell *cellA = (PortalCell *) a, *cellB = (PortalCell *) b;
+    Portal *portal;
+    float normal[3] = {0, 0, 0}, centre[3] = {0, 0, 0};
+    unsigned int i;
+    if (!partition)
+        return;
+    if ((cellA->partition != partition) || (cellB->partition != partition) || (cellA == cellB)){
+        fprintf(stderr, "Portals must join two different cells of the same scene\n");
+        return;
+    }
+    if ((nVertices < 3) || (nVertices > MAX_PORTAL_VERTICES)){
+        fprintf(stderr, "Portals must have between 3 and %d vertices\n", MAX_PORTAL_VERTICES);
+        return;
+    }
+    portal = malloc(sizeof(Portal));
+    portal->cells[0] = cellA;
+    portal->cells[1] = cellB;
+    portal->nVertices = nVertices;
+    memcpy(portal->vertices, vertices, sizeof(float) * 3 * nVertices);
+    // Newell's method
+    for (i = 0; i < nVertices; i++){
+        float *p = portal->vertices[i], *q = portal->vertices[(i + 1) % nVertices];
+        normal[0] += (p[1] - q[1]) * (p[2] + q[2]);
+        normal[1] += (p[2] - q[2]) * (p[0] + q[0]);
+        normal[2] += (p[0] - q[0]) * (p[1] + q[1]);
+        centre[0] += p[0] / nVertices;
+        centre[1] += p[1] / nVertices;
+        centre[2] += p[2] / nVertices;
+    }
+    portal->plane.a = normal[0]; portal->plane.b = normal[1]; portal->plane.c = normal[2];
+    portal->plane.d = -(normal[0] * centre[0] + normal[1] * centre[1] + normal[2] * centre[2]);
+    if (!normalizePlane(&portal->plane)){
+        fprintf(stderr, "Portal has no area\n");
+        free(portal);
+        return;
+    }
+    hpsPush(&partition->portals, portal);
+    hpsPush(&cellA->portals, portal);
+    hpsPush(&cellB->portals, portal);
+    scene->version++;
+}
+
+/* Visibility testing
+   The state of a traversal is kept in a single block of memory – in the camera's cull cache, when there is one – that holds, for each cell, the first of the frusta that it was seen through, how many times it has been looked into, and whether it is on the path of portals that is being looked through, followed by the frusta themselves. Frusta are linked to the next frustum of their cell by index, since the block grows as they are added. The near plane of a frustum is not used to clip portals, so that portals closer to the camera than its near plane can still be looked through. */
+typedef struct {
+    int next; // Index of the next frustum of the same cell, or -1
+    int near; // Index of the near plane
+    unsigned int nPlanes;
+    Plane planes[MAX_FRUSTUM_PLANES];
+} Frustum;
+
+typedef struct {
+    PortalPartition *partition;
+    Plane *camera;
+    float eye[3], direction[3];
+    bool perspective;
+    void *block;
+    size_t blockSize, header;
+    int *first;
+    unsigned char *visits;
+    bool *onPath;
+    Frustum *frusta;
+    unsigned int nFrusta;
+    float polygons[2][MAX_CLIPPED_VERTICES][3];
+} Traversal;
+
+static void setPointers(Traversal *t){
+    unsigned int nCells = t->partition->cells.size;
+    t->first = t->block;
+    t->visits = (unsigned char *) (t->first + nCells);
+    t->onPath = (bool *) (t->visits + nCells);
+    t->frusta = (Frustum *) ((char *) t->block + t->header);
+}
+
+static int newFrustum(Traversal *t){
+    size_t size = t->header + sizeof(Frustum) * (t->nFrusta + 1);
+    if (size > t->blockSize){
+        t->blockSize = t->header + sizeof(Frustum) * (t->nFrusta + 1) * 2;
+        t->block = realloc(t->block, t->blockSize);
+        setPointers(t);
+    }
+    return t->nFrusta++;
+}
+
+static void startTraversal(Traversal *t, PortalPartition *partition, Plane *planes,
+                           CullCache *cache){
+    unsigned int nCells = partition->cells.size;
+    t->partition = partition;
+    t->camera = planes;
+    t->header = (nCells * (sizeof(int) + 1 + sizeof(bool)) + 7) & ~(size_t) 7;
+    t->block = cache ? cache->data : NULL;
+    t->blockSize = cache ? cache->size : 0;
+    t->nFrusta = 0;
+    if (t->blockSize < t->header + sizeof(Frustum) * nCells){
+        t->blockSize = t->header + sizeof(Frustum) * nCells * 2;
+        t->block = realloc(t->block, t->blockSize);
+    }
+    setPointers(t);
+    memset(t->first, -1, sizeof(int) * nCells);
+    memset(t->visits, 0, nCells);
+    memset(t->onPath, 0, sizeof(bool) * nCells);
+}
+
+static void endTraversal(Traversal *t, CullCache *cache){
+    if (cache){
+        cache->data = t->block;
+        cache->size = t->blockSize;
+    } else {
+        free(t->block);
+    }
+}
+
+/* Solve for the point where three planes meet */
+static bool planesMeet(const Plane *a, const Plane *b, const Plane *c, float *p){
+    float bc[3] = {b->b*c->c - b->c*c->b, b->c*c->a - b->a*c->c, b->a*c->b - b->b*c->a};
+    float ca[3] = {c->b*a->c - c->c*a->b, c->c*a->a - c->a*a->c, c->a*a->b - c->b*a->a};
+    float ab[3] = {a->b*b->c - a->c*b->b, a->c*b->a - a->a*b->c, a->a*b->b - a->b*b->a};
+    float det = a->a*bc[0] + a->b*bc[1] + a->c*bc[2];
+    int i;
+    if (fabs(det) < 1e-6) return false;
+    for (i = 0; i < 3; i++)
+        p[i] = -(a->d*bc[i] + b->d*ca[i] + c->d*ab[i]) / det;
+    return true;
+}
+
+/* The eye of a perspective frustum is where its side planes meet. Orthographic frusta have no eye, so the centre of their near plane is used instead. */
+static void findEye(Traversal *t){
+    Plane *p = t->camera;
+    t->direction[0] = p[4].a; t->direction[1] = p[4].b; t->direction[2] = p[4].c;
+    t->perspective = ((p[0].a * p[1].a + p[0].b * p[1].b + p[0].c * p[1].c) > -0.9999) &&
+        planesMeet(&p[0], &p[1], &p[2], t->eye);
+    if (!t->perspective){
+        Plane x = {p[0].a, p[0].b, p[0].c, (p[0].d - p[1].d) / 2};
+        Plane y = {p[2].a, p[2].b, p[2].c, (p[2].d - p[3].d) / 2};
+        if (!planesMeet(&x, &y, &p[4], t->eye))
+            t->eye[0] = t->eye[1] = t->eye[2] = 0;
+    }
+}
+
+static void copyCamera(Traversal *t, Frustum *f){
+    f->near = 4;
+    f->nPlanes = 6;
+    memcpy(f->planes, t->camera, sizeof(Plane) * 6);
+}
+
+/* Clip the portal to the frustum, returning the number of vertices that remain in t->polygons[0] */
+static unsigned int clipPortal(Traversal *t, Portal *portal, Frustum *f){
+    float (*in)[3] = t->polygons[0], (*out)[3] = t->polygons[1], (*swap)[3];
+    unsigned int i, j, n = portal->nVertices, m;
+    memcpy(in, portal->vertices, sizeof(float) * 3 * n);
+    for (i = 0; (i < f->nPlanes) && (n >= 3); i++){
+        if (i == f->near)
+            continue;
+        for (j = 0, m = 0; j < n; j++){
+            float *p = in[j], *q = in[(j + 1) % n];
+            float dp = distance(&f->planes[i], p), dq = distance(&f->planes[i], q);
+            if (dp >= 0)
+                memcpy(out[m++], p, sizeof(float) * 3);
+            if ((dp >= 0) != (dq >= 0)){
+                float s = dp / (dp - dq);
+                out[m][0] = p[0] + (q[0] - p[0]) * s;
+                out[m][1] = p[1] + (q[1] - p[1]) * s;
+                out[m][2] = p[2] + (q[2] - p[2]) * s;
+                m++;
+            }
+        }
+        n = m;
+        swap = in; in = out; out = swap;
+    }
+    if (in != t->polygons[0])
+        memcpy(t->polygons[0], in, sizeof(float) * 3 * n);
+    return (n >= 3) ? n : 0;
+}
+
+/* Make the frustum that the portal is seen through from frustum from, returning its index, or -1 if the portal cannot be seen. Any subset of the planes through the edges bounds the portal, so edges past the plane limit are left out. */
+static int narrow(Traversal *t, Portal *portal, int from){
+    unsigned int n = clipPortal(t, portal, &t->frusta[from]), i, k = 2;
+    float centre[3] = {0, 0, 0}, facing;
+    Frustum *f;
+    int index;
+    if (!n)
+        return -1;
+    index = newFrustum(t);
+    f = &t->frusta[index];
+    facing = t->perspective ? distance(&portal->plane, t->eye) :
+        (portal->plane.a * t->direction[0] + portal->plane.b * t->direction[1] +
+         portal->plane.c * t->direction[2]);
+    // Portals that are seen edge-on do not narrow the frustum
+    if (fabs(facing) < 1e-4){
+        *f = t->frusta[from];
+        return index;
+    }
+    for (i = 0; i < n; i++){
+        centre[0] += t->polygons[0][i][0] / n;
+        centre[1] += t->polygons[0][i][1] / n;
+        centre[2] += t->polygons[0][i][2] / n;
+    }
+    f->near = 0;
+    f->planes[0] = t->camera[4];
+    f->planes[1] = t->camera[5];
+    for (i = 0; (i < n) && (k < MAX_FRUSTUM_PLANES); i++){
+        float *p = t->polygons[0][i], *q = t->polygons[0][(i + 1) % n];
+        float u[3], v[3];
+        Plane *plane = &f->planes[k];
+        if (t->perspective){
+            u[0] = p[0] - t->eye[0]; u[1] = p[1] - t->eye[1]; u[2] = p[2] - t->eye[2];
+            v[0] = q[0] - t->eye[0]; v[1] = q[1] - t->eye[1]; v[2] = q[2] - t->eye[2];
+        } else {
+            u[0] = q[0] - p[0]; u[1] = q[1] - p[1]; u[2] = q[2] - p[2];
+            v[0] = t->direction[0]; v[1] = t->direction[1]; v[2] = t->direction[2];
+        }
+        plane->a = u[1] * v[2] - u[2] * v[1];
+        plane->b = u[2] * v[0] - u[0] * v[2];
+        plane->c = u[0] * v[1] - u[1] * v[0];
+        plane->d = -(plane->a * p[0] + plane->b * p[1] + plane->c * p[2]);
+        if (!normalizePlane(plane))
+            continue;
+        if (distance(plane, centre) < 0){
+            plane->a = -plane->a; plane->b = -plane->b;
+            plane->c = -plane->c; plane->d = -plane->d;
+        }
+        k++;
+    }
+    f->nPlanes = k;
+    return index;
+}
+
+static void lookInto(Traversal *t, PortalCell *cell, int frustum);
+
+/* Add the frustum to the cell, and look through the cell's portals */
+static void enter(Traversal *t, PortalCell *cell, int frustum){
+    unsigned int i = cell->index;
+    if (t->visits[i] == MAX_CELL_FRUSTA){
+        copyCamera(t, &t->frusta[frustum]);
+        t->first[i] = -1;
+    }
+    t->visits[i]++;
+    t->frusta[frustum].next = t->first[i];
+    t->first[i] = frustum;
+    lookInto(t, cell, frustum);
+}
+
+static void lookInto(Traversal *t, PortalCell *cell, int frustum){
+    int i;
+    t->onPath[cell->index] = true;
+    for (i = 0; i < cell->portals.size; i++){
+        Portal *portal = cell->portals.data[i];
+        PortalCell *next = (portal->cells[0] == cell) ? portal->cells[1] : portal->cells[0];
+        int f;
+        if (t->onPath[next->index] || (t->visits[next->index] > MAX_CELL_FRUSTA))
+            continue;
+        if ((f = narrow(t, portal, frustum)) >= 0)
+            enter(t, next, f);
+    }
+    t->onPath[cell->index] = false;
+}
+
+/* The cells that hold the eye, or that the near plane of the frustum overlaps, are looked into through the whole frustum. The near plane is bounded by a sphere, so that cells stay visible while the camera passes through a portal. */
+static bool startCells(Traversal *t){
+    PortalPartition *partition = t->partition;
+    Plane *p = t->camera;
+    BoundingSphere eye = {t->eye[0], t->eye[1], t->eye[2], 1e-4};
+    BoundingSphere near = {0, 0, 0, 0};
+    float corners[4][3];
+    bool started = false;
+    int i;
+    for (i = 0; i < 4; i++){
+        if (!planesMeet(&p[i & 1], &p[2 + (i >> 1)], &p[4], corners[i]))
+            return false;
+        near.x += corners[i][0] / 4;
+        near.y += corners[i][1] / 4;
+        near.z += corners[i][2] / 4;
+    }
+    for (i = 0; i < 4; i++){
+        float dx = corners[i][0] - near.x, dy = corners[i][1] - near.y, dz = corners[i][2] - near.z;
+        near.r = fmax(near.r, sqrt(dx * dx + dy * dy + dz * dz));
+    }
+    for (i = 0; i < partition->cells.size; i++){
+        PortalCell *cell = partition->cells.data[i];
+        if (overlapsCell(cell, &near) || (t->perspective && overlapsCell(cell, &eye))){
+            int f = newFrustum(t);
+            copyCamera(t, &t->frusta[f]);
+            enter(t, cell, f);
+            started = true;
+        }
+    }
+    return started;
+}
+
+static bool inFrusta(Traversal *t, Node *node){
+    Membership *m = node->area;
+    unsigned int i;
+    int f;
+    for (i = 0; i < m->nCells; i++)
+        for (f = t->first[m->cells[i]->index]; f >= 0; f = t->frusta[f].next)
+            if (hpsSpheresInPlanes(&node, 1, t->frusta[f].planes,
+                                   hpsPlaneMask(t->frusta[f].nPlanes)))
+                return true;
+    return false;
+}
+
+// Test the nodes of every cell against the planes in mask, passing on those in several cells once
+static void cellsInPlanes(PortalPartition *partition, Plane *planes, unsigned int mask,
+                          void (*func)(Node *)){
+    int i, j;
+    for (i = 0; i < partition->cells.size; i++){
+        PortalCell *cell = partition->cells.data[i];
+        for (j = 0; j < cell->nodes.size; j++){
+            Node *node = cell->nodes.data[j];
+            if (((Membership *) node->area)->cells[0] == cell)
+                hpsNodesInPlanes(&node, 1, planes, mask, func, NULL);
+        }
+    }
+}
+
+void hpsPortalDoVisible(PortalPartition *partition, Plane *planes, CullCache *cache,
+                        void (*func)(Node *)){
+    Traversal t;
+    int i, j;
+    hpsNodesInPlanes((Node **) partition->outside.data, partition->outside.size, planes,
+                     hpsPlaneMask(6), func, NULL);
+    if (!partition->cells.size)
+        return;
+    startTraversal(&t, partition, planes, cache);
+    findEye(&t);
+    if (!startCells(&t)){
+        // Seen from outside, every cell is seen through the camera's frustum
+        cellsInPlanes(partition, planes, hpsPlaneMask(6), func);
+        endTraversal(&t, cache);
+        return;
+    }
+    for (i = 0; i < partition->cells.size; i++){
+        PortalCell *cell = partition->cells.data[i];
+        if (t.first[i] < 0)
+            continue;
+        for (j = 0; j < cell->nodes.size; j++){
+            Node *node = cell->nodes.data[j];
+            Membership *m = node->area;
+            unsigned int k = 0;
+            // Nodes in several cells are only passed on by the first of them that was seen
+            while (t.first[m->cells[k]->index] < 0)
+                k++;
+            if ((m->cells[k] == cell) && inFrusta(&t, node))
+                func(node);
+        }
+    }
+    endTraversal(&t, cache);
+}
+
+/* A volume has no eye to look through portals from, so every cell is seen through the whole of it */
+void hpsPortalDoVisibleVolume(PortalPartition *partition, Plane *planes, int nPlanes,
+                              void (*func)(Node *)){
+    unsigned int mask = hpsPlaneMask(nPlanes);
+    hpsNodesInPlanes((Node **) partition->outside.data, partition->outside.size, planes, mask,
+                     func, NULL);
+    cellsInPlanes(partition, planes, mask, func);
+}
@@ -1,10 +1,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include "scene.h"
+#include "cull.h"
+#include "jobs.h"
+
+#define STORAGE_PASS_RATIO 16 // Update contiguous storage in one pass when more than 1/16 of its nodes are dirty
+#define STORAGE_BLOCK 1024 // Slots handed to a worker at a time by a parallel storage pass
 
 unsigned int hpsNodePoolSize = 4096;
 
+bool hpsContiguousNodeStorage = false;
+
 HPSpartitionInterface *hpsPartitionInterface;
 
 static HPSvector activeScenes, freeScenes;
@@ -17,9 +25,16 @@ void hpsInit(){
 }
 
 /* Nodes */
+static void freeOccluder(Occluder *occluder){
+    free(occluder->vertices);
+    free(occluder->indices);
+    free(occluder);
+}
+
 static void freeNode(HPSnode *node, HPSscene *scene){
     int i;
     if (node->delete) node->delete(node->data);
+    if (node->occluder) freeOccluder(node->occluder);
     if (node->children.capacity){
 	HPSvector *v = &node->children;
 	for (i = 0; i < v->size; i++)
@@ -28,36 +43,183 @@ static void freeNode(HPSnode *node, HPSscene *scene){
     }
 }
 
+static void computeTransform(HPSnode *node, HPMpoint *position, HPMquat *rotation,
+                             float *parentTransform){
+    if (!parentTransform){
+        hpmQuaternionRotation((float *) rotation, node->transform);
+        hpmTranslate((float *) position, node->transform);
+    } else {
+        float trans[16];
+        hpmQuaternionRotation((float *) rotation, trans);
+        hpmTranslate((float *) position, trans);
+        hpmMultMat4(trans, parentTransform, node->transform);
+    }
+    BoundingSphere *bs = node->partitionData.boundingSphere;
+    bs->x = 0;
+    bs->y = 0;
+    bs->z = 0;
+    hpmMat4VecMult(node->transform, (float*) bs);
+    if (node->inverseTranspose)
+        hpmFastInverseTranspose(node->transform, node->inverseTranspose);
+}
+
+/* Let the extension know that the node has moved, and log it for the partition and the cameras' frame caches */
+static void finishUpdate(HPSnode *node, HPSscene *scene){
+    node->movedVersion = scene->version;
+    hpsPush(&scene->movedNodes, &node->partitionData);
+    if (node->extension){
+        hpsUpdateExtensionNode(node);
+    }
+}
+
+static void updateTransform(HPSnode *node, HPSscene *scene,
+                            HPMpoint *position, HPMquat *rotation,
+                            float *parentTransform){
+    computeTransform(node, position, rotation, parentTransform);
+    finishUpdate(node, scene);
+}
+
 static void updateNode(HPSnode *node, HPSscene *scene){
     int i;
-    if (node->needsUpdate){
-        if ((HPSscene *) node->parent == scene){
-            hpmQuaternionRotation((float *) &node->rotation, node->transform);
-            hpmTranslate((float *) &node->position, node->transform);
-        } else {
-            float trans[16];
-            hpmQuaternionRotation((float *) &node->rotation, trans);
-            hpmTranslate((float *) &node->position, trans);
-            hpmMultMat4(trans, node->parent->transform, node->transform);
-        }
-        BoundingSphere *bs = node->partitionData.boundingSphere;
-        bs->x = 0;
-        bs->y = 0;
-        bs->z = 0;
-        hpmMat4VecMult(node->transform, (float*) bs);
-        if (node->extension){
-            hpsUpdateExtensionNode(node);
-        }
-	scene->partitionInterface->updateNode(&node->partitionData);
-        for (i = 0; i < node->children.size; i++){
-            HPSnode *child = node->children.data[i];
-            child->needsUpdate = true;
-            updateNode(child, scene);
+    float *parentTransform = ((HPSscene *) node->parent == scene) ?
+        NULL : node->parent->transform;
+    updateTransform(node, scene, nodePosition(node), nodeRotation(node),
+                    parentTransform);
+    for (i = 0; i < node->children.size; i++){
+        HPSnode *child = node->children.data[i];
+        child->needsUpdate = true;
+        updateNode(child, scene);
+    }
+    node->needsUpdate = false;
+}
+
+static bool hasDirtyAncestor(HPSnode *node){
+    HPSnode *p;
+    for (p = node->parent; (HPSscene *) p != node->scene; p = p->parent)
+        if (p->needsUpdate) return true;
+    return false;
+}
+
+/* Flag the node as needing an update. Only the highest flagged node of any branch is registered with the scene: its update covers everything beneath it */
+static void flagNode(HPSnode *node){
+    if (node->needsUpdate) return;
+    node->needsUpdate = true;
+    if (!hasDirtyAncestor(node))
+        hpsPush(&node->scene->dirtyNodes, node);
+}
+
+/* Contiguous node storage */
+static StorageChunk *newStorageChunk(unsigned int size){
+    StorageChunk *c = malloc(sizeof(StorageChunk));
+    c->positions = malloc(sizeof(HPMpoint) * size);
+    c->rotations = malloc(sizeof(HPMquat) * size);
+    c->transforms = malloc(sizeof(float) * 16 * size);
+    c->boundingSpheres = malloc(sizeof(BoundingSphere) * size);
+    c->nodes = calloc(size, sizeof(HPSnode *));
+    c->parents = malloc(sizeof(int) * size);
+    c->depths = malloc(sizeof(unsigned int) * size);
+    c->updated = calloc(size, sizeof(unsigned int));
+    return c;
+}
+
+static void deleteStorageChunk(StorageChunk *c){
+    free(c->positions);
+    free(c->rotations);
+    free(c->transforms);
+    free(c->boundingSpheres);
+    free(c->nodes);
+    free(c->parents);
+    free(c->depths);
+    free(c->updated);
+    free(c);
+}
+
+static NodeStorage *newStorage(unsigned int chunkSize){
+    NodeStorage *s = malloc(sizeof(NodeStorage));
+    s->chunkSize = chunkSize;
+    s->size = 0;
+    s->frame = 0;
+    s->maxDepth = 0;
+    hpsInitVector(&s->chunks, 4);
+    hpsInitVector(&s->freeSlots, 64);
+    return s;
+}
+
+static void deleteStorage(NodeStorage *s){
+    int i;
+    for (i = 0; i < s->chunks.size; i++)
+        deleteStorageChunk(s->chunks.data[i]);
+    hpsDeleteVector(&s->chunks);
+    hpsDeleteVector(&s->freeSlots);
+    free(s);
+}
+
+/* A free slot is only reused if it comes after the slot of the parent, otherwise a new one is taken from the end of the storage */
+static unsigned int allocateSlot(NodeStorage *s, int parent){
+    HPSvector *free = &s->freeSlots;
+    if (free->size && (int) (size_t) free->data[free->size - 1] > parent)
+        return (size_t) hpsPop(free);
+    if (s->size == s->chunks.size * s->chunkSize)
+        hpsPush(&s->chunks, newStorageChunk(s->chunkSize));
+    return s->size++;
+}
+
+static void addToStorage(HPSnode *node, HPSscene *scene){
+    NodeStorage *s = scene->storage;
+    int parent = ((HPSscene *) node->parent == scene) ? -1 : node->parent->slot;
+    unsigned int slot = allocateSlot(s, parent);
+    unsigned int i = slot % s->chunkSize;
+    StorageChunk *c = storageChunk(s, slot);
+    node->slot = slot;
+    node->transform = &c->transforms[i * 16];
+    node->partitionData.boundingSphere = &c->boundingSpheres[i];
+    c->nodes[i] = node;
+    c->parents[i] = parent;
+    c->depths[i] = (parent < 0) ? 0 :
+        storageChunk(s, parent)->depths[parent % s->chunkSize] + 1;
+    if (c->depths[i] > s->maxDepth)
+        s->maxDepth = c->depths[i];
+    c->updated[i] = 0;
+}
+
+static void removeFromStorage(HPSnode *node, HPSscene *scene){
+    NodeStorage *s = scene->storage;
+    storageChunk(s, node->slot)->nodes[node->slot % s->chunkSize] = NULL;
+    hpsPush(&s->freeSlots, (void *) (size_t) node->slot);
+}
+
+/* A stored node needs updating when it has been flagged, or when its parent has been updated in the same frame, in which case parentTransform is set to the parent's transform */
+static bool slotNeedsUpdate(NodeStorage *s, StorageChunk *c, unsigned int j,
+                            unsigned int frame, float **parentTransform){
+    int parent = c->parents[j];
+    *parentTransform = NULL;
+    if (parent < 0)
+        return c->nodes[j]->needsUpdate;
+    StorageChunk *pc = storageChunk(s, parent);
+    unsigned int pi = parent % s->chunkSize;
+    if (!c->nodes[j]->needsUpdate && (pc->updated[pi] != frame))
+        return false;
+    *parentTransform = &pc->transforms[pi * 16];
+    return true;
+}
+
+/* Walk the storage in slot order: since parents come before their children, a node's parent has always been updated earlier in the same pass */
+static void updateStorage(HPSscene *scene){
+    NodeStorage *s = scene->storage;
+    unsigned int frame = ++s->frame;
+    unsigned int i, j, slot = 0;
+    float *parentTransform;
+    for (i = 0; i < s->chunks.size; i++){
+        StorageChunk *c = s->chunks.data[i];
+        for (j = 0; (j < s->chunkSize) && (slot < s->size); j++, slot++){
+            HPSnode *node = c->nodes[j];
+            if (!node || !slotNeedsUpdate(s, c, j, frame, &parentTransform))
+                continue;
+            updateTransform(node, scene, &c->positions[j], &c->rotations[j],
+                            parentTransform);
+            c->updated[j] = frame;
+            node->needsUpdate = false;
         }
-        node->needsUpdate = false;
-    } else {
-        for (i = 0; i < node->children.size; i++)
-            updateNode(node->children.data[i], scene);
     }
 }
 
@@ -69,7 +231,7 @@ static void initBoundingSphere(BoundingSphere *bs){
 HPSscene *hpsGetScene(HPSnode *node){
     if (!node->parent)
         return (HPSscene *) node;
-    return hpsGetScene(node->parent);
+    return node->scene;
 }
 
 HPSnode *hpsAddNode(HPSnode *parent, void *data,
@@ -77,34 +239,57 @@ HPSnode *hpsAddNode(HPSnode *parent, void *data,
                     void (*deleteFunc)(void *)){
     HPSscene *scene = hpsGetScene(parent);
     HPSnode *node = hpsAllocateFrom(scene->nodePool);
-    node->transform = hpsAllocateFrom(scene->transformPool);
+    node->scene = scene;
+    node->parent = parent;
+    if (scene->storage){
+        addToStorage(node, scene);
+    } else {
+        node->transform = hpsAllocateFrom(scene->transformPool);
+        node->partitionData.boundingSphere = hpsAllocateFrom(scene->boundingSpherePool);
+    }
     node->partitionData.data = node;
-    node->partitionData.boundingSphere = hpsAllocateFrom(scene->boundingSpherePool);
     hpmIdentityMat4(node->transform);
     initBoundingSphere(node->partitionData.boundingSphere);
-    node->position.x = 0.0; node->position.y = 0.0; node->position.z = 0.0;
-    node->rotation.x = 0.0; node->rotation.y = 0.0; node->rotation.z = 0.0; 
-    node->rotation.w = 1.0;
+    HPMpoint *position = nodePosition(node);
+    HPMquat *rotation = nodeRotation(node);
+    position->x = 0.0; position->y = 0.0; position->z = 0.0;
+    rotation->x = 0.0; rotation->y = 0.0; rotation->z = 0.0; 
+    rotation->w = 1.0;
     node->data = data;
     node->pipeline = pipeline;
+    node->inverseTranspose = NULL;
+    node->occluder = NULL;
     node->extension = NULL;
-    node->parent = parent;
     node->delete = deleteFunc;
-    node->needsUpdate = true;
+    node->sortBits = 0;
+    node->needsUpdate = false;
+    node->movedVersion = 0;
     hpsInitVector(&node->children, 0);
     scene->partitionInterface->addNode(&node->partitionData, scene->partitionStruct);
     if ((HPSscene *) parent == scene)
         hpsPush(&scene->topLevelNodes, node);
     else
         hpsPush(&parent->children, node);
+    flagNode(node);
+    scene->version++;
     return node;
 }
 
 static void deleteNode(HPSnode *node, HPSscene *scene){
     int i;
+    if (node->needsUpdate)
+        hpsRemove(&scene->dirtyNodes, node);
     scene->partitionInterface->removeNode(&node->partitionData);
-    hpsDeleteFrom(node->partitionData.boundingSphere, scene->boundingSpherePool);
-    hpsDeleteFrom(node->transform, scene->transformPool);
+    if (node->occluder)
+        hpsRemove(&scene->occluders, node);
+    if (node->inverseTranspose)
+        hpsDeleteFrom(node->inverseTranspose, scene->inverseTransposePool);
+    if (scene->storage){
+        removeFromStorage(node, scene);
+    } else {
+        hpsDeleteFrom(node->partitionData.boundingSphere, scene->boundingSpherePool);
+        hpsDeleteFrom(node->transform, scene->transformPool);
+    }
     for (i = 0; i < node->children.size; i++)
         deleteNode(node->children.data[i], scene);
     if ((HPSscene *) node->parent == scene)
@@ -115,12 +300,14 @@ static void deleteNode(HPSnode *node, HPSscene *scene){
 }
 
 void hpsDeleteNode(HPSnode *node){
-    deleteNode(node, hpsGetScene(node));
+    HPSscene *scene = hpsGetScene(node);
+    deleteNode(node, scene);
+    scene->version++;
 }
 
 void hpsSetNodeBoundingSphere(HPSnode *node, float radius){
     node->partitionData.boundingSphere->r = radius;
-    node->needsUpdate = true;
+    flagNode(node);
 }
 
 float *hpsNodeBoundingSphere(HPSnode *node){
@@ -128,29 +315,82 @@ float *hpsNodeBoundingSphere(HPSnode *node){
 }
 
 void hpsMoveNode(HPSnode *node, float *vec){
-    node->position.x += vec[0];
-    node->position.y += vec[1];
-    node->position.z += vec[2];
-    node->needsUpdate = true;
+    HPMpoint *position = nodePosition(node);
+    position->x += vec[0];
+    position->y += vec[1];
+    position->z += vec[2];
+    flagNode(node);
 }
 
 void hpsSetNodePosition(HPSnode *node, float *p){
-    node->position.x = p[0];
-    node->position.y = p[1];
-    node->position.z = p[2];
-    node->needsUpdate = true;
+    HPMpoint *position = nodePosition(node);
+    position->x = p[0];
+    position->y = p[1];
+    position->z = p[2];
+    flagNode(node);
+}
+
+/* Nodes that are rendered by several cameras, or that rarely move, can keep their inverse transpose model matrix rather than having it computed every time they are rendered */
+void hpsSetNodeInverseTransposeCaching(HPSnode *node, bool cache){
+    HPSscene *scene = node->scene;
+    if (cache && !node->inverseTranspose){
+        if (!scene->inverseTransposePool)
+            scene->inverseTransposePool = hpsMakePool(sizeof(float) * 16, hpsNodePoolSize,
+                                                      "Inverse transpose pool");
+        node->inverseTranspose = hpsAllocateFrom(scene->inverseTransposePool);
+        hpmFastInverseTranspose(node->transform, node->inverseTranspose);
+    } else if (!cache && node->inverseTranspose){
+        hpsDeleteFrom(node->inverseTranspose, scene->inverseTransposePool);
+        node->inverseTranspose = NULL;
+    }
+}
+
+/* Occluders are copied, so that the given arrays may be freed */
+void hpsSetNodeOccluder(HPSnode *node, float *vertices, unsigned int nVertices,
+                        unsigned int *indices, unsigned int nIndices){
+    HPSscene *scene = node->scene;
+    Occluder *occluder;
+    unsigned int i;
+    for (i = 0; vertices && (i < nIndices); i++){
+        if (indices[i] >= nVertices){
+            fprintf(stderr, "Occluder of node %p has an index out of range\n", node->data);
+            return;
+        }
+    }
+    if (node->occluder){
+        freeOccluder(node->occluder);
+        node->occluder = NULL;
+        hpsRemove(&scene->occluders, node);
+    }
+    scene->version++;
+    if (!vertices || (nIndices < 3))
+        return;
+    occluder = malloc(sizeof(Occluder));
+    occluder->vertices = malloc(sizeof(float) * 3 * nVertices);
+    occluder->indices = malloc(sizeof(unsigned int) * nIndices);
+    memcpy(occluder->vertices, vertices, sizeof(float) * 3 * nVertices);
+    memcpy(occluder->indices, indices, sizeof(unsigned int) * nIndices);
+    occluder->nVertices = nVertices;
+    occluder->nIndices = nIndices;
+    node->occluder = occluder;
+    hpsPush(&scene->occluders, node);
+}
+
+void hpsSetNodeSortBits(HPSnode *node, unsigned short bits){
+    node->sortBits = bits;
+    node->scene->version++;
 }
 
 void hpsNodeNeedsUpdate(HPSnode *node){
-    node->needsUpdate = true;
+    flagNode(node);
 }
 
 float* hpsNodeRotation(HPSnode *node){
-    return (float *) &node->rotation;
+    return (float *) nodeRotation(node);
 }
 
 float* hpsNodePosition(HPSnode *node){
-    return (float *) &node->position;
+    return (float *) nodePosition(node);
 }
 
 float* hpsNodeTransform(HPSnode *node){
@@ -163,19 +403,35 @@ void* hpsNodeData(HPSnode *node){
 
 /* Scenes */
 HPSscene *hpsMakeScene(){
-    HPSscene *scene = (freeScenes.size) ?
-	hpsPop(&freeScenes) : malloc(sizeof(HPSscene));
+    bool reused = freeScenes.size;
+    HPSscene *scene = reused ? hpsPop(&freeScenes) : malloc(sizeof(HPSscene));
     scene->partitionInterface = hpsPartitionInterface;
     scene->nodePool = hpsMakePool(sizeof(HPSnode), hpsNodePoolSize, "Node pool");
-    scene->transformPool = hpsMakePool(sizeof(float) * 16, hpsNodePoolSize,
-				       "Transform pool");
-    scene->boundingSpherePool = hpsMakePool(sizeof(BoundingSphere),
-					    hpsNodePoolSize,
-					    "Bounding sphere pool");
+    if (hpsContiguousNodeStorage){
+        scene->storage = newStorage(hpsNodePoolSize);
+        scene->transformPool = NULL;
+        scene->boundingSpherePool = NULL;
+    } else {
+        scene->storage = NULL;
+        scene->transformPool = hpsMakePool(sizeof(float) * 16, hpsNodePoolSize,
+                                           "Transform pool");
+        scene->boundingSpherePool = hpsMakePool(sizeof(BoundingSphere),
+                                                hpsNodePoolSize,
+                                                "Bounding sphere pool");
+    }
+    scene->inverseTransposePool = NULL;
     scene->partitionStruct = scene->partitionInterface->new();
     scene->null = NULL;
     hpsInitVector(&scene->topLevelNodes, 1024);
+    hpsInitVector(&scene->dirtyNodes, 1024);
     hpsInitVector(&scene->extensions, 4);
+    hpsInitVector(&scene->movedNodes, 1024);
+    hpsInitVector(&scene->occluders, 16);
+    scene->updatedNodes = NULL;
+    scene->nUpdatedNodes = 0;
+    // A reused scene keeps counting, so that no camera mistakes it for the scene it was
+    scene->version = reused ? scene->version + 1 : 1;
+    scene->movedFrom = scene->movedVersion = 0;
     hpsPush(&activeScenes, (void *) scene);
     return scene;
 }
@@ -186,9 +442,25 @@ void hpsDeleteScene(HPSscene *scene){
         freeNode(scene->topLevelNodes.data[i], scene);
     scene->partitionInterface->delete(scene->partitionStruct);
     hpsDeleteExtensions(scene);
+    hpsDeleteVector(&scene->topLevelNodes);
+    hpsDeleteVector(&scene->dirtyNodes);
+    hpsDeleteVector(&scene->movedNodes);
+    hpsDeleteVector(&scene->occluders);
+    for (i = 0; i < scene->nUpdatedNodes; i++)
+        hpsDeleteVector(&scene->updatedNodes[i]);
+    free(scene->updatedNodes);
     hpsClearPool(scene->nodePool);
-    hpsClearPool(scene->transformPool);
-    hpsClearPool(scene->boundingSpherePool);
+    if (scene->storage){
+        deleteStorage(scene->storage);
+        scene->storage = NULL;
+    } else {
+        hpsClearPool(scene->transformPool);
+        hpsClearPool(scene->boundingSpherePool);
+    }
+    if (scene->inverseTransposePool){
+        hpsDeletePool(scene->inverseTransposePool);
+        scene->inverseTransposePool = NULL;
+    }
     hpsRemove(&activeScenes, (void *) scene);
     hpsPush(&freeScenes, (void *) scene);
 }
@@ -202,10 +474,145 @@ void hpsDeactivateScene(HPSscene *s){
     hpsRemove(&activeScenes, (void *) s);
 }
 
+/* Parallel updates
+   Each worker computes the transforms of whole subtrees, or, for a pass over contiguous storage, of the nodes of one depth in a block of slots at a time. Extensions whose updates are concurrent are updated by the workers, while the other extension updates and the log of moved nodes are collected in the scene's list for each worker and completed afterwards on the calling thread. */
+typedef struct {
+    HPSscene *scene;
+    HPSvector *roots;
+} UpdateJob;
+
+typedef struct {
+    HPSscene *scene;
+    unsigned int depth, frame;
+} StorageJob;
+
+static void deferUpdate(HPSnode *node, HPSscene *scene, HPSvector *updated){
+    node->movedVersion = scene->version;
+    if (node->extension && ((HPSextension *) node->extension[0])->concurrentUpdates)
+        hpsUpdateExtensionNode(node);
+    hpsPush(updated, node);
+}
+
+static void updateNodeDeferred(HPSnode *node, HPSscene *scene, HPSvector *updated){
+    int i;
+    float *parentTransform = ((HPSscene *) node->parent == scene) ?
+        NULL : node->parent->transform;
+    computeTransform(node, nodePosition(node), nodeRotation(node),
+                     parentTransform);
+    deferUpdate(node, scene, updated);
+    for (i = 0; i < node->children.size; i++){
+        HPSnode *child = node->children.data[i];
+        child->needsUpdate = true;
+        updateNodeDeferred(child, scene, updated);
+    }
+    node->needsUpdate = false;
+}
+
+static void updateJob(void *data, unsigned int item, unsigned int worker){
+    UpdateJob *job = (UpdateJob *) data;
+    updateNodeDeferred(job->roots->data[item], job->scene, &job->scene->updatedNodes[worker]);
+}
+
+static void storageJob(void *data, unsigned int item, unsigned int worker){
+    StorageJob *job = (StorageJob *) data;
+    NodeStorage *s = job->scene->storage;
+    unsigned int slot = item * STORAGE_BLOCK, end = slot + STORAGE_BLOCK;
+    float *parentTransform;
+    if (end > s->size) end = s->size;
+    for (; slot < end; slot++){
+        StorageChunk *c = storageChunk(s, slot);
+        unsigned int j = slot % s->chunkSize;
+        HPSnode *node = c->nodes[j];
+        if (!node || (c->depths[j] != job->depth) ||
+            !slotNeedsUpdate(s, c, j, job->frame, &parentTransform))
+            continue;
+        computeTransform(node, &c->positions[j], &c->rotations[j], parentTransform);
+        deferUpdate(node, job->scene, &job->scene->updatedNodes[worker]);
+        c->updated[j] = job->frame;
+        node->needsUpdate = false;
+    }
+}
+
+static void parallelUpdateStorage(HPSscene *scene){
+    NodeStorage *s = scene->storage;
+    StorageJob job = {scene, 0, ++s->frame};
+    for (job.depth = 0; job.depth <= s->maxDepth; job.depth++)
+        hpsParallelFor((s->size + STORAGE_BLOCK - 1) / STORAGE_BLOCK, &storageJob, &job);
+}
+
+static void parallelUpdate(HPSscene *scene, unsigned int nWorkers, bool storagePass){
+    int i, j, n = 0;
+    HPSvector *dirty = &scene->dirtyNodes;
+    if (scene->nUpdatedNodes < nWorkers){
+        scene->updatedNodes = realloc(scene->updatedNodes, sizeof(HPSvector) * nWorkers);
+        for (i = scene->nUpdatedNodes; i < nWorkers; i++)
+            hpsInitVector(&scene->updatedNodes[i], 1024);
+        scene->nUpdatedNodes = nWorkers;
+    }
+    if (storagePass){
+        parallelUpdateStorage(scene);
+    } else {
+        for (i = 0; i < dirty->size; i++){
+            HPSnode *node = dirty->data[i];
+            if (node->needsUpdate && !hasDirtyAncestor(node))
+                dirty->data[n++] = node;
+        }
+        dirty->size = n;
+        UpdateJob job = {scene, dirty};
+        hpsParallelFor(n, &updateJob, &job);
+    }
+    for (i = 0; i < nWorkers; i++){
+        HPSvector *updated = &scene->updatedNodes[i];
+        for (j = 0; j < updated->size; j++){
+            HPSnode *node = updated->data[j];
+            hpsPush(&scene->movedNodes, &node->partitionData);
+            if (node->extension && !((HPSextension *) node->extension[0])->concurrentUpdates)
+                hpsUpdateExtensionNode(node);
+        }
+        updated->size = 0;
+    }
+}
+
+/* The partition is told about the moved nodes once all of their transforms are up to date, as a batch when it supports one */
+static void updatePartition(HPSscene *scene){
+    PartitionInterface *p = scene->partitionInterface;
+    Node **moved = (Node **) scene->movedNodes.data;
+    unsigned int i, n = scene->movedNodes.size;
+    if (p->updateNodes){
+        p->updateNodes(moved, n);
+    } else {
+        for (i = 0; i < n; i++)
+            p->updateNode(moved[i]);
+    }
+}
+
+/* Nodes registered with the scene may since have had an ancestor flagged, in which case the ancestor's update takes care of them. An update that moves nodes starts a new log of moved nodes, so the log of the last update that did stays valid until then. */
 static void hpsUpdateScene(HPSscene *scene){
     int i;
-    for (i = 0; i < scene->topLevelNodes.size; i++)
-        updateNode(scene->topLevelNodes.data[i], scene);
+    HPSvector *dirty = &scene->dirtyNodes;
+    unsigned int nWorkers = hpsWorkerCount();
+    bool storagePass = scene->storage &&
+        (dirty->size * STORAGE_PASS_RATIO > scene->storage->size);
+    if (dirty->size){
+        scene->movedFrom = scene->version;
+        scene->movedVersion = ++scene->version;
+        scene->movedNodes.size = 0;
+        if (nWorkers > 1){
+            parallelUpdate(scene, nWorkers, storagePass);
+        } else if (storagePass){
+            updateStorage(scene);
+        } else {
+            for (i = 0; i < dirty->size; i++){
+                HPSnode *node = dirty->data[i];
+                if (node->needsUpdate && !hasDirtyAncestor(node))
+                    updateNode(node, scene);
+            }
+        }
+        updatePartition(scene);
+    }
+    dirty->size = 0;
+    if (scene->partitionInterface->maintain)
+        scene->partitionInterface->maintain(scene->partitionStruct);
 }
 
 void hpsUpdateScenes(){
@@ -214,22 +621,267 @@ void hpsUpdateScenes(){
 	hpsUpdateScene((HPSscene *) activeScenes.data[i]);
 }
 
+/* Volume queries
+   The volume is handed to the partition, or, when the partition cannot test volumes, the scene's nodes are walked and tested one by one. The function and its data are kept per thread, and restored once the query is done, so that queries may be made from within the function. */
+static _Thread_local void (*volumeFunc)(HPSnode *, void *) = NULL;
+static _Thread_local void *volumeData = NULL;
+
+static void nodeInVolume(Node *node){
+    volumeFunc((HPSnode *) node->data, volumeData);
+}
+
+static void walkVolume(HPSvector *nodes, Plane *planes, unsigned int mask){
+    int i;
+    for (i = 0; i < nodes->size; i++){
+        HPSnode *node = nodes->data[i];
+        Node *partitionData = &node->partitionData;
+        hpsNodesInPlanes(&partitionData, 1, planes, mask, &nodeInVolume, NULL);
+        walkVolume(&node->children, planes, mask);
+    }
+}
+
+void hpsNodesInVolume(HPSscene *scene, float *planes, unsigned int nPlanes,
+                      void (*func)(HPSnode *, void *), void *data){
+    Plane volume[HPS_MAX_PLANES];
+    void (*oldFunc)(HPSnode *, void *) = volumeFunc;
+    void *oldData = volumeData;
+    unsigned int i;
+    if (!nPlanes || (nPlanes > HPS_MAX_PLANES)){
+        fprintf(stderr, "Volumes must have between 1 and %d planes\n", HPS_MAX_PLANES);
+        return;
+    }
+    for (i = 0; i < nPlanes; i++){
+        Plane *plane = &volume[i];
+        float length = sqrt(planes[i*4] * planes[i*4] + planes[i*4 + 1] * planes[i*4 + 1] +
+                            planes[i*4 + 2] * planes[i*4 + 2]);
+        if (!(length > 0)){
+            fprintf(stderr, "Plane %d of volume has no normal\n", i);
+            return;
+        }
+        plane->a = planes[i*4] / length; plane->b = planes[i*4 + 1] / length;
+        plane->c = planes[i*4 + 2] / length; plane->d = planes[i*4 + 3] / length;
+    }
+    volumeFunc = func;
+    volumeData = data;
+    if (scene->partitionInterface->doVisibleVolume)
+        scene->partitionInterface->doVisibleVolume(scene->partitionStruct, volume, nPlanes,
+                                                   &nodeInVolume);
+    else
+        walkVolume(&scene->topLevelNodes, volume, hpsPlaneMask(nPlanes));
+    volumeFunc = oldFunc;
+    volumeData = oldData;
+}
+
+/* Ray queries
+   Hits are collected by shortening the ray: to the nearest hit so far, or, once maxHits hits have been found, to the furthest of them. */
+typedef struct {
+    Ray ray;
+    HPSnode **nodes;
+    float *distances;
+    unsigned int nHits, maxHits;
+} RayHits;
+
+static void rayHit(Node *node, float distance, void *data){
+    RayHits *hits = (RayHits *) data;
+    unsigned int i;
+    if ((hits->nHits == hits->maxHits) && (distance >= hits->distances[hits->nHits - 1]))
+        return;
+    if (hits->nHits < hits->maxHits)
+        hits->nHits++;
+    for (i = hits->nHits - 1; (i > 0) && (hits->distances[i - 1] > distance); i--){
+        hits->nodes[i] = hits->nodes[i - 1];
+        hits->distances[i] = hits->distances[i - 1];
+    }
+    hits->nodes[i] = (HPSnode *) node->data;
+    hits->distances[i] = distance;
+    if (hits->nHits == hits->maxHits)
+        hits->ray.length = hits->distances[hits->nHits - 1];
+}
 
+static void walkRay(HPSvector *nodes, RayHits *hits){
+    int i;
+    float distance;
+    for (i = 0; i < nodes->size; i++){
+        HPSnode *node = nodes->data[i];
+        if (hpsRayHitsSphere(&hits->ray, node->partitionData.boundingSphere, &distance))
+            rayHit(&node->partitionData, distance, hits);
+        walkRay(&node->children, hits);
+    }
+}
+
+static void castRay(HPSscene *scene, RayHits *hits){
+    if (scene->partitionInterface->raycast)
+        scene->partitionInterface->raycast(scene->partitionStruct, &hits->ray, &rayHit, hits);
+    else
+        walkRay(&scene->topLevelNodes, hits);
+}
+
+static bool makeRay(Ray *ray, float *origin, float *direction, float length){
+    if (hpsMakeRay(ray, origin, direction, length))
+        return true;
+    fprintf(stderr, "Rays must have a direction\n");
+    return false;
+}
+
+HPSnode *hpsRaycast(HPSscene *scene, float *origin, float *direction, float length,
+                    float *distance){
+    HPSnode *node = NULL;
+    float d;
+    RayHits hits = {.nodes = &node, .distances = &d, .nHits = 0, .maxHits = 1};
+    if (!makeRay(&hits.ray, origin, direction, length))
+        return NULL;
+    castRay(scene, &hits);
+    if (node && distance)
+        *distance = d;
+    return node;
+}
+
+unsigned int hpsRaycastAll(HPSscene *scene, float *origin, float *direction, float length,
+                           HPSnode **nodes, float *distances, unsigned int maxHits){
+    RayHits hits = {.nodes = nodes, .distances = distances, .nHits = 0, .maxHits = maxHits};
+    if (!maxHits || !makeRay(&hits.ray, origin, direction, length))
+        return 0;
+    castRay(scene, &hits);
+    return hits.nHits;
+}
+
+/* Batches of rays are split into groups that are handed to the workers. Each ray only writes its own results. */
+#define RAYS_PER_GROUP 64
+
+typedef struct {
+    HPSscene *scene;
+    float *rays;
+    unsigned int nRays;
+    HPSnode **nodes;
+    float *distances;
+} RayBatch;
+
+static void rayJob(void *data, unsigned int item, unsigned int worker){
+    RayBatch *batch = (RayBatch *) data;
+    unsigned int i, last = (item + 1) * RAYS_PER_GROUP;
+    if (last > batch->nRays)
+        last = batch->nRays;
+    for (i = item * RAYS_PER_GROUP; i < last; i++){
+        float *r = &batch->rays[i*7];
+        HPSnode *node = NULL;
+        float d = 0;
+        RayHits hits = {.nodes = &node, .distances = &d, .nHits = 0, .maxHits = 1};
+        if (hpsMakeRay(&hits.ray, r, r + 3, r[6]))
+            castRay(batch->scene, &hits);
+        batch->nodes[i] = node;
+        if (batch->distances)
+            batch->distances[i] = d;
+    }
+}
+
+void hpsRaycastBatch(HPSscene *scene, float *rays, unsigned int nRays, HPSnode **nodes,
+                     float *distances){
+    RayBatch batch = {scene, rays, nRays, nodes, distances};
+    hpsParallelFor((nRays + RAYS_PER_GROUP - 1) / RAYS_PER_GROUP, &rayJob, &batch);
+}
+
+/* Overlap queries
+   The first maxNodes of the overlapping nodes are written to the caller's array, and the rest are only counted, so that nothing is allocated. */
+typedef struct {
+    HPSnode **nodes;
+    unsigned int nNodes, maxNodes;
+} Overlaps;
+
+static void overlapping(Node *node, void *data){
+    Overlaps *overlaps = (Overlaps *) data;
+    if (overlaps->nNodes < overlaps->maxNodes)
+        overlaps->nodes[overlaps->nNodes] = (HPSnode *) node->data;
+    overlaps->nNodes++;
+}
+
+static void walkRegion(HPSvector *nodes, Region *region, Overlaps *overlaps){
+    int i;
+    for (i = 0; i < nodes->size; i++){
+        HPSnode *node = nodes->data[i];
+        if (hpsSphereInRegion(node->partitionData.boundingSphere, region))
+            overlapping(&node->partitionData, overlaps);
+        walkRegion(&node->children, region, overlaps);
+    }
+}
+
+static unsigned int findOverlaps(HPSscene *scene, Region *region, HPSnode **nodes,
+                                 unsigned int maxNodes){
+    Overlaps overlaps = {nodes, 0, maxNodes};
+    if (scene->partitionInterface->overlap)
+        scene->partitionInterface->overlap(scene->partitionStruct, region, &overlapping,
+                                           &overlaps);
+    else
+        walkRegion(&scene->topLevelNodes, region, &overlaps);
+    return overlaps.nNodes;
+}
+
+unsigned int hpsNodesInSphere(HPSscene *scene, float *center, float radius,
+                              HPSnode **nodes, unsigned int maxNodes){
+    Region region;
+    hpsMakeSphereRegion(&region, center, radius);
+    return findOverlaps(scene, &region, nodes, maxNodes);
+}
+
+unsigned int hpsNodesInBox(HPSscene *scene, float *min, float *max,
+                           HPSnode **nodes, unsigned int maxNodes){
+    float axes[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    float center[3], extents[3];
+    Region region;
+    int i;
+    for (i = 0; i < 3; i++){
+        center[i] = (min[i] + max[i]) * 0.5;
+        extents[i] = (max[i] - min[i]) * 0.5;
+    }
+    hpsMakeBoxRegion(&region, center, axes, extents);
+    return findOverlaps(scene, &region, nodes, maxNodes);
+}
+
+unsigned int hpsNodesInOrientedBox(HPSscene *scene, float *center, float *halfExtents,
+                                   float *rotation, HPSnode **nodes, unsigned int maxNodes){
+    float axes[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    float q[4];
+    Region region;
+    int i;
+    hpmCopyQuat(rotation, q);
+    hpmQuatNormalize(q);
+    for (i = 0; i < 3; i++)
+        hpmQuatVecRotate(q, &axes[i*3]);
+    hpsMakeBoxRegion(&region, center, axes, halfExtents);
+    return findOverlaps(scene, &region, nodes, maxNodes);
+}
+
+/* Pipelines
+   The ids of deleted pipelines are reused, so that no two pipelines share an id – and thus sort keys – as long as there are no more than HPS_MAX_PIPELINES at once */
+static HPSvector freePipelineIds;
+static unsigned int nPipelineIds = 0;
 
-/* Pipelines */
 HPSpipeline *hpsAddPipeline(void (*preRender)(void *),
 			    void (*render)(void *),
 			    void (*postRender)(),
                             bool isAlpha){
     HPSpipeline *pipeline = malloc(sizeof(HPSpipeline));
+    if (freePipelineIds.size){
+        pipeline->id = (size_t) hpsPop(&freePipelineIds);
+    } else if (nPipelineIds < HPS_MAX_PIPELINES){
+        pipeline->id = nPipelineIds++;
+    } else {
+        fprintf(stderr, "Unable to create more than %d pipelines\n", HPS_MAX_PIPELINES);
+        exit(EXIT_FAILURE);
+    }
     pipeline->isAlpha = isAlpha;
+    pipeline->matrices = HPS_MVP_MATRIX | HPS_MODEL_MATRIX | HPS_INVERSE_TRANSPOSE_MATRIX;
     pipeline->preRender = preRender;
     pipeline->render = render;
     pipeline->postRender = postRender;
     return pipeline;
 }
 
+void hpsSetPipelineMatrices(HPSpipeline *pipeline, int matrices){
+    pipeline->matrices = matrices;
+}
+
 void hpsDeletePipeline(HPSpipeline *pipeline){
+    hpsPush(&freePipelineIds, (void *) (size_t) pipeline->id);
     free(pipeline);
 }
 
@@ -242,6 +894,7 @@ void hpsSetNodeExtension(HPSnode *node, HPSextension *extension){
         HPSextension *e = (HPSextension *) scene->extensions.data[i];
         if ((void*) extension == (void*) e){
             node->extension = &scene->extensions.data[i];
+            scene->version++;
             return;
         }
     }
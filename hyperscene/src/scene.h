@@ -1,12 +1,20 @@
+#ifndef HPS_SCENE
+#define HPS_SCENE 1
+
 #include <hypermath.h>
 #include <hyperscene.h>
 #include "memory.h"
 #include "partition.h"
+#include "occlusion.h"
 
 typedef void (*cameraUpdateFun)(HPScamera*);
 
+#define HPS_MAX_PIPELINES 65536 // Pipeline ids are unsigned shorts
+
 struct pipeline {
+    unsigned short id; // Most significant bits of the sort keys of the pipeline's nodes
     bool isAlpha;
+    int matrices; // HPSpipelineMatrices flags: the matrices computed for the pipeline's nodes
     void (*preRender)(void *);
     void (*render)(void *);
     void (*postRender)();
@@ -17,47 +25,112 @@ struct node {
     Node partitionData;
     HPSscene *scene;
     HPSvector children;
-    HPMpoint position;
+    HPMpoint position; // Unused when the scene has contiguous node storage
     HPMquat rotation;
     float *transform;
+    float *inverseTranspose; // Cached inverse transpose of transform, or NULL when not cached
+    Occluder *occluder; // NULL unless the node hides what is behind it
     struct pipeline *pipeline;
     void **extension;
     void (*delete)(void *); //(data)
     void *data;
+    unsigned int slot; // Index into the scene's contiguous node storage
+    unsigned int movedVersion; // Scene version given by the last update that moved the node
+    unsigned short sortBits; // Sorts nodes within a pipeline before their depth does
     bool needsUpdate;
 };
 
+/* Contiguous node storage
+   Each chunk holds the per-node data of hpsNodePoolSize slots as parallel arrays. A node's parent always occupies a lower slot than the node itself, so the storage can be updated with a single pass over the arrays. When the update is split between workers, each depth gets a pass of its own instead, so that parents are done before their children. */
+typedef struct {
+    HPMpoint *positions;
+    HPMquat *rotations;
+    float *transforms;
+    BoundingSphere *boundingSpheres;
+    struct node **nodes;
+    int *parents; // -1 for top-level nodes
+    unsigned int *depths; // Number of ancestors
+    unsigned int *updated; // Value of storage->frame when the slot was last updated
+} StorageChunk;
+
+typedef struct {
+    HPSvector chunks;
+    HPSvector freeSlots;
+    unsigned int chunkSize, size, frame;
+    unsigned int maxDepth; // Greatest depth of any node that has been stored
+} NodeStorage;
+
 struct scene {
     void *null; // used to distinguish top-level nodes;
     HPSvector topLevelNodes;
+    HPSvector dirtyNodes; // Highest nodes of each branch that need updating
     PartitionInterface *partitionInterface;
     void *partitionStruct;
     HPSpool nodePool, boundingSpherePool, transformPool, partitionPool;
+    HPSpool inverseTransposePool; // Made when a node first caches its inverse transpose
+    NodeStorage *storage; // NULL unless the scene was made with contiguous node storage
     HPSvector extensions;
+    HPSvector occluders; // Nodes that have occluders
+    unsigned int version; // Changes whenever anything that a camera could see does
+    unsigned int movedFrom, movedVersion; // The last update that moved nodes changed the version from movedFrom to movedVersion
+    HPSvector movedNodes; // Partition data of the nodes moved by that update
+    HPSvector *updatedNodes; // One list per worker, made by the first parallel update
+    unsigned int nUpdatedNodes;
 };
 
+static inline StorageChunk *storageChunk(NodeStorage *s, unsigned int slot){
+    return (StorageChunk *) s->chunks.data[slot / s->chunkSize];
+}
+
+static inline HPMpoint *nodePosition(struct node *node){
+    NodeStorage *s = node->scene->storage;
+    if (!s) return &node->position;
+    return &storageChunk(s, node->slot)->positions[node->slot % s->chunkSize];
+}
+
+static inline HPMquat *nodeRotation(struct node *node){
+    NodeStorage *s = node->scene->storage;
+    if (!s) return &node->rotation;
+    return &storageChunk(s, node->slot)->rotations[node->slot % s->chunkSize];
+}
+
 struct camera {
     HPSscene *scene;
+    HPScameraType type;
     HPScameraStyle style;
     HPMpoint position, up, object;
     float n, f, viewAngle, vw, vh, vwRatio, vhRatio;
     float vl, vr, vb, vt, vx, vy;
     bool viewportIsStatic;
+    int alphaSorting; // HPS_ROUGH_ALPHA and HPS_VOLUMETRIC_ALPHA flags
+    bool occlusionCulling;
     HPMquat rotation; // yaw, pitch, roll, distance for ORBIT camera
     float view[16];
     float projection[16];
     float viewProjection[16];
     float modelViewProjection[16];
     Plane planes[6];
+    CullCache *cullCache; // Kept apart from the camera, since the camera is copied while it is rendered
+    struct frameCache *frameCache; // The queues of the last frame rendered, kept apart for the same reason
+    unsigned int version; // Changes whenever the camera's view projection or alpha sorting does
     cameraUpdateFun update;
+    void (*faceFunction)(HPScamera *, int); // Called before each face of an HPS_CUBE camera is rendered
     void (*sort)(const HPMpoint*, const HPMpoint*, float *, float*); // used to sort points based on camera positioning
 };
 
 void hpsInitCameras();
 
+/* Render contexts
+   The lighting extension keeps the lights that a context can see in the context, made when it is first needed */
+typedef struct contextLights ContextLights;
+ContextLights **hpsContextLights(); // Of the context rendering on the calling thread, or of the thread's default context
+void hpsDeleteContextLights(ContextLights *lights);
+
 /* Extensions */
 void hpsPreRenderExtensions(HPSscene *scene);
 void hpsPostRenderExtensions(HPSscene *scene);
 void hpsDeleteExtensions(HPSscene *scene);
 void hpsVisibleExtensionNode(HPSnode *node);
 void hpsUpdateExtensionNode(HPSnode *node);
+
+#endif
@@ -0,0 +1,35 @@
+/* LSD radix sort
+   Keys are sorted a byte at a time, starting from the least significant. The histograms of every byte are gathered in a single pass, and bytes that are the same for every key are skipped. */
+
+#include <string.h>
+#include "sort.h"
+
+HPSsortItem *hpsRadixSort(HPSsortItem *items, HPSsortItem *scratch, size_t n){
+    size_t counts[8][256];
+    size_t i;
+    int byte, b;
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; i++){
+        uint64_t key = items[i].key;
+        for (byte = 0; byte < 8; byte++)
+            counts[byte][(key >> (byte * 8)) & 0xff]++;
+    }
+    for (byte = 0; byte < 8; byte++){
+        size_t *count = counts[byte];
+        size_t offset = 0;
+        int shift = byte * 8;
+        if (n && (count[(items[0].key >> shift) & 0xff] == n))
+            continue;
+        for (b = 0; b < 256; b++){
+            size_t c = count[b];
+            count[b] = offset;
+            offset += c;
+        }
+        for (i = 0; i < n; i++)
+            scratch[count[(items[i].key >> shift) & 0xff]++] = items[i];
+        HPSsortItem *t = items;
+        items = scratch;
+        scratch = t;
+    }
+    return items;
+}
@@ -0,0 +1,15 @@
+#ifndef HPS_SORT
+#define HPS_SORT 1
+
+#include <stdlib.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t key;
+    void *value;
+} HPSsortItem;
+
+/* Sort the n items by increasing key, using scratch (which must have room for n items) as temporary storage. Items with equal keys keep their order. Returns whichever of items or scratch holds the sorted items. */
+HPSsortItem *hpsRadixSort(HPSsortItem *items, HPSsortItem *scratch, size_t n);
+
+#endif
@@ -1,5 +1,10 @@
 #include "cheat.h"
 #include "src/memory.h"
+#include "src/sort.h"
+#include "src/cull.h"
+#include "src/occlusion.h"
+#include "src/scene.h"
+#include <hypersceneLighting.h>
 
 /* Vectors */
 CHEAT_TEST(vector_push_pop,
@@ -69,3 +74,495 @@ CHEAT_TEST(pool,
            cheat_assert(*second = 2);
            cheat_assert(*third = 3);
     )
+
+/* Sorting */
+CHEAT_TEST(radix_sort,
+           HPSsortItem items[6], scratch[6];
+           uint64_t keys[6] = {0x0100000000000002, 5, 0x0100000000000001, 5, 0, 0xffffffffffffffff};
+           int i;
+           for (i = 0; i < 6; i++){
+               items[i].key = keys[i];
+               items[i].value = (void *) (size_t) i;
+           }
+           HPSsortItem *sorted = hpsRadixSort(items, scratch, 6);
+           cheat_assert(sorted[0].value == (void *) 4);
+           cheat_assert(sorted[1].value == (void *) 1); // Equal keys stay in order
+           cheat_assert(sorted[2].value == (void *) 3);
+           cheat_assert(sorted[3].value == (void *) 2);
+           cheat_assert(sorted[4].value == (void *) 0);
+           cheat_assert(sorted[5].value == (void *) 5);
+           cheat_assert(hpsRadixSort(items, scratch, 0) == items);
+    )
+
+/* Culling */
+CHEAT_TEST(box_in_frusta,
+           // Two axis-aligned frusta: x, y, z in [-1, 1], and x in [2, 4], y, z in [-1, 1]
+           Plane planes[12] = {{-1, 0, 0, 1}, {1, 0, 0, 1}, {0, -1, 0, 1},
+                               {0, 1, 0, 1}, {0, 0, 1, 1}, {0, 0, -1, 1},
+                               {-1, 0, 0, 4}, {1, 0, 0, -2}, {0, -1, 0, 1},
+                               {0, 1, 0, 1}, {0, 0, 1, 1}, {0, 0, -1, 1}};
+           HPSfrustum frusta[2];
+           float inFirst[2][3] = {{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}};
+           float straddling[2][3] = {{0.5, -0.5, -0.5}, {2.5, 0.5, 0.5}};
+           float outside[2][3] = {{5, 0, 0}, {6, 1, 1}};
+           int masks[2] = {63, 63};
+           hpsMakeFrusta(planes, 2, frusta);
+           cheat_assert(hpsBoxInFrusta(inFirst[0], inFirst[1], frusta, 3, masks) == 1);
+           cheat_assert(masks[0] == 0);
+           masks[0] = masks[1] = 63;
+           cheat_assert(hpsBoxInFrusta(straddling[0], straddling[1], frusta, 3, masks) == 3);
+           cheat_assert(masks[0] == 1); // Only the right plane of the first frustum
+           cheat_assert(masks[1] == 2); // Only the left plane of the second
+           masks[0] = masks[1] = 63;
+           cheat_assert(hpsBoxInFrusta(outside[0], outside[1], frusta, 3, masks) == 0);
+           masks[0] = masks[1] = 63;
+           cheat_assert(hpsBoxInFrusta(straddling[0], straddling[1], frusta, 2, masks) == 2);
+    )
+
+CHEAT_TEST(box_in_many_planes,
+           // A 32 plane volume, of which only the last plane, x <= 1, is not far away
+           Plane planes[32];
+           float inside[2][3] = {{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}};
+           float straddling[2][3] = {{0.5, -0.5, -0.5}, {1.5, 0.5, 0.5}};
+           float outside[2][3] = {{2, 0, 0}, {3, 1, 1}};
+           unsigned int mask;
+           int i;
+           for (i = 0; i < 31; i++){
+               Plane far = {0, 1, 0, 100};
+               planes[i] = far;
+           }
+           Plane last = {-1, 0, 0, 1};
+           planes[31] = last;
+           cheat_assert(hpsPlaneMask(32) == ~0u);
+           cheat_assert(hpsPlaneMask(6) == 63);
+           mask = 0;
+           cheat_assert(hpsBoxInPlanes(inside[0], inside[1], planes, hpsPlaneMask(32), &mask)
+                        == HPS_INSIDE);
+           cheat_assert(mask == 0);
+           cheat_assert(hpsBoxInPlanes(straddling[0], straddling[1], planes, hpsPlaneMask(32),
+                                       &mask) == HPS_INTERSECT);
+           cheat_assert(mask == 1u << 31);
+           cheat_assert(hpsBoxInPlanes(outside[0], outside[1], planes, hpsPlaneMask(32), &mask)
+                        == HPS_OUTSIDE);
+           cheat_assert(hpsBoxInPlanes(outside[0], outside[1], planes, hpsPlaneMask(31), &mask)
+                        == HPS_INSIDE);
+    )
+
+CHEAT_TEST(rays,
+           float origin[3] = {0, 0, -10}, direction[3] = {0, 0, 2}, none[3] = {0, 0, 0};
+           float min[3] = {-1, -1, -1}, max[3] = {1, 1, 1};
+           float beside[2][3] = {{2, -1, -1}, {3, 1, 1}};
+           BoundingSphere sphere = {0, 0, 0, 1}, around = {0, 0, -10, 1};
+           Ray ray;
+           float distance;
+           cheat_assert(!hpsMakeRay(&ray, origin, none, 100));
+           cheat_assert(hpsMakeRay(&ray, origin, direction, 100));
+           cheat_assert(ray.direction[2] == 1);
+           cheat_assert(hpsRayHitsBox(&ray, min, max, &distance));
+           cheat_assert(distance == 9);
+           cheat_assert(!hpsRayHitsBox(&ray, beside[0], beside[1], &distance));
+           cheat_assert(hpsRayHitsSphere(&ray, &sphere, &distance));
+           cheat_assert(distance == 9);
+           cheat_assert(hpsRayHitsSphere(&ray, &around, &distance));
+           cheat_assert(distance == 0); // The ray starts inside of the sphere
+           ray.length = 5; // Too short to reach the box
+           cheat_assert(!hpsRayHitsBox(&ray, min, max, &distance));
+           cheat_assert(!hpsRayHitsSphere(&ray, &sphere, &distance));
+    )
+
+CHEAT_TEST(regions,
+           float center[3] = {0, 0, 0}, extents[3] = {1, 2, 3};
+           // A box turned 90° about z, so that its x half-extent of 1 lies along y
+           float axes[9] = {0, 1, 0, -1, 0, 0, 0, 0, 1};
+           float inside[2][3] = {{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}};
+           float straddling[2][3] = {{1.5, -0.5, -0.5}, {2.5, 0.5, 0.5}};
+           float outside[2][3] = {{2.5, -0.5, -0.5}, {3.5, 0.5, 0.5}};
+           BoundingSphere near = {2.5, 0, 0, 1}, far = {0, 2.5, 0, 1};
+           Region region;
+           unsigned int mask = 0;
+           hpsMakeBoxRegion(&region, center, axes, extents);
+           cheat_assert(hpsBoxInRegion(inside[0], inside[1], &region, 63, &mask) == HPS_INSIDE);
+           cheat_assert(hpsBoxInRegion(straddling[0], straddling[1], &region, 63, &mask)
+                        == HPS_INTERSECT);
+           cheat_assert(hpsBoxInRegion(outside[0], outside[1], &region, 63, &mask)
+                        == HPS_OUTSIDE);
+           cheat_assert(hpsSphereInRegion(&near, &region));
+           cheat_assert(!hpsSphereInRegion(&far, &region));
+           hpsMakeSphereRegion(&region, center, 2);
+           cheat_assert(hpsBoxInRegion(inside[0], inside[1], &region, 0, &mask) == HPS_INSIDE);
+           cheat_assert(hpsBoxInRegion(straddling[0], straddling[1], &region, 0, &mask)
+                        == HPS_INTERSECT);
+           cheat_assert(hpsBoxInRegion(outside[0], outside[1], &region, 0, &mask)
+                        == HPS_OUTSIDE);
+           cheat_assert(hpsSphereInRegion(&near, &region));
+           cheat_assert(hpsSphereInRegion(&far, &region));
+    )
+
+/* Occlusion */
+CHEAT_DECLARE(
+    static float identity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    static unsigned int quadIndices[6] = {0, 1, 2, 0, 2, 3};
+
+    // A buffer holding a quad at depth 0 that spans x from left to right and the whole of y
+    static OcclusionBuffer *quadBuffer(float left, float right){
+        OcclusionBuffer *buffer = hpsMakeOcclusionBuffer(64, 64);
+        float vertices[12] = {left, -2, 0,  right, -2, 0,  right, 2, 0,  left, 2, 0};
+        Occluder quad = {vertices, 4, quadIndices, 6};
+        hpsClearOcclusionBuffer(buffer, identity);
+        hpsRasterizeOccluder(buffer, &quad, identity);
+        hpsBuildOcclusionPyramid(buffer);
+        return buffer;
+    }
+    )
+
+CHEAT_TEST(occlusion,
+           OcclusionBuffer *full = quadBuffer(-2, 2), *half = quadBuffer(-2, 0);
+           float front[2][3] = {{-0.2, -0.2, -0.5}, {0.2, 0.2, -0.2}};
+           float behind[2][3] = {{-0.2, -0.2, 0.2}, {0.2, 0.2, 0.5}};
+           cheat_assert(!hpsBoxOccluded(full, front[0], front[1]));
+           cheat_assert(hpsBoxOccluded(full, behind[0], behind[1]));
+           // The same box behind a quad that only covers the left half of the screen
+           cheat_assert(!hpsBoxOccluded(half, behind[0], behind[1]));
+           behind[1][0] = -0.1;
+           cheat_assert(hpsBoxOccluded(half, behind[0], behind[1]));
+           hpsDeleteOcclusionBuffer(full);
+           hpsDeleteOcclusionBuffer(half);
+    )
+
+/* Scenes */
+CHEAT_DECLARE(
+    static HPSscene *nestedScene;
+    static float nestedPlanes[24] = {1, 0, 0, 50, -1, 0, 0, 50, 0, 1, 0, 50,
+                                     0, -1, 0, 50, 0, 0, 1, 50, 0, 0, -1, 50};
+    static unsigned int nInner, nOuter;
+
+    static void pipelineFunc(void *data){}
+
+    static void countInner(HPSnode *node, void *data){
+        nInner++;
+    }
+
+    static void countOuter(HPSnode *node, void *data){
+        nOuter++;
+        if (nOuter % 100 == 0)
+            hpsNodesInVolume(nestedScene, nestedPlanes, 6, &countInner, NULL);
+    }
+    )
+
+CHEAT_TEST(nested_volume_queries,
+           // A 100 unit cube of nodes, queried from within a query of the same cube
+           HPSpipeline *pipeline;
+           unsigned int i, total;
+           hpsInit();
+           hpsSetWorkerCount(4);
+           pipeline = hpsAddPipeline(&pipelineFunc, &pipelineFunc, NULL, false);
+           nestedScene = hpsMakeScene();
+           for (i = 0; i < 8000; i++){
+               HPSnode *node = hpsAddNode((HPSnode *) nestedScene, NULL, pipeline, NULL);
+               float position[3] = {(i % 20) * 5 - 47.5, (i / 20 % 20) * 5 - 47.5,
+                                    (i / 400) * 5 - 47.5};
+               hpsSetNodePosition(node, position);
+           }
+           hpsUpdateScenes();
+           nInner = nOuter = 0;
+           hpsNodesInVolume(nestedScene, nestedPlanes, 6, &countInner, NULL);
+           total = nInner;
+           cheat_assert(total == 8000);
+           nInner = 0;
+           hpsNodesInVolume(nestedScene, nestedPlanes, 6, &countOuter, NULL);
+           cheat_assert(nOuter == total);
+           cheat_assert(nInner == (total / 100) * total);
+           hpsSetWorkerCount(1);
+    )
+
+CHEAT_TEST(parallel_storage_updates,
+           // Chains of three nodes, each one unit along x from its parent, all moved at once
+           HPSpipeline *pipeline;
+           HPSnode *roots[1000], *leaves[1000];
+           float planes[24] = {1, 0, 0, -99.5, -1, 0, 0, 200, 0, 1, 0, 50,
+                               0, -1, 0, 50, 0, 0, 1, 50, 0, 0, -1, 50};
+           float offset[3] = {100, 0, 0};
+           unsigned int i, bad = 0;
+           hpsInit();
+           hpsSetWorkerCount(4);
+           hpsContiguousNodeStorage = true;
+           pipeline = hpsAddPipeline(&pipelineFunc, &pipelineFunc, NULL, false);
+           nestedScene = hpsMakeScene();
+           hpsContiguousNodeStorage = false;
+           for (i = 0; i < 1000; i++){
+               float position[3] = {0, (i % 40) - 20.0, (i / 40) - 20.0};
+               float step[3] = {1, 0, 0};
+               HPSnode *child;
+               roots[i] = hpsAddNode((HPSnode *) nestedScene, NULL, pipeline, NULL);
+               hpsSetNodePosition(roots[i], position);
+               child = hpsAddNode(roots[i], NULL, pipeline, NULL);
+               hpsSetNodePosition(child, step);
+               leaves[i] = hpsAddNode(child, NULL, pipeline, NULL);
+               hpsSetNodePosition(leaves[i], step);
+           }
+           hpsUpdateScenes();
+           for (i = 0; i < 1000; i++)
+               hpsMoveNode(roots[i], offset);
+           hpsUpdateScenes();
+           for (i = 0; i < 1000; i++)
+               if (hpsNodeTransform(leaves[i])[12] != 102)
+                   bad++;
+           cheat_assert(bad == 0);
+           // Only the nodes that were moved past x = 99.5 are inside of the volume
+           nInner = 0;
+           hpsNodesInVolume(nestedScene, planes, 6, &countInner, NULL);
+           cheat_assert(nInner == 3000);
+           hpsSetWorkerCount(1);
+    )
+
+/* Partitions */
+CHEAT_DECLARE(
+    #define FUZZ_NODES 2000
+    static bool drawn[FUZZ_NODES];
+    static unsigned int fuzzSeed;
+
+    static void drawNode(void *data){
+        drawn[(size_t) data] = true;
+    }
+
+    static float fuzzRandom(){
+        fuzzSeed = fuzzSeed * 1664525 + 1013904223;
+        return (fuzzSeed >> 8) / (float) (1 << 24);
+    }
+
+    static void randomPosition(float *p, float range){
+        p[0] = (fuzzRandom() * 2 - 1) * range;
+        p[1] = (fuzzRandom() * 2 - 1) * range / 4;
+        p[2] = (fuzzRandom() * 2 - 1) * range;
+    }
+
+    /* Render a camera over nodes that move about every frame, and count the nodes that are drawn while clearly outside of its frustum, or not drawn while clearly inside of it */
+    static unsigned int cullingErrors(void *partitionInterface, unsigned int nWorkers){
+        HPSnode *nodes[FUZZ_NODES];
+        HPSscene *scene;
+        HPScamera *camera;
+        HPSpipeline *pipeline;
+        unsigned int i, j, frame, errors = 0;
+        float position[3];
+        fuzzSeed = 1;
+        hpsInit();
+        hpsSetWorkerCount(nWorkers);
+        hpsPartitionInterface = partitionInterface;
+        pipeline = hpsAddPipeline(&pipelineFunc, &drawNode, &pipelineFunc, false);
+        scene = hpsMakeScene();
+        for (i = 0; i < FUZZ_NODES; i++){
+            nodes[i] = hpsAddNode((HPSnode *) scene, (void *) (size_t) i, pipeline, NULL);
+            randomPosition(position, 400);
+            hpsSetNodePosition(nodes[i], position);
+            hpsSetNodeBoundingSphere(nodes[i], 1 + fuzzRandom() * 4);
+        }
+        camera = hpsMakeCamera(HPS_PERSPECTIVE, HPS_FIRST_PERSON, scene, 800, 600);
+        hpsSetCameraClipPlanes(camera, 1, 300);
+        for (frame = 0; frame < 60; frame++){
+            for (i = 0; i < FUZZ_NODES; i += 1 + frame % 5){
+                randomPosition(position, 30);
+                hpsMoveNode(nodes[i], position);
+            }
+            hpsUpdateScenes();
+            hpsUpdateCamera(camera);
+            memset(drawn, 0, sizeof(drawn));
+            hpsRenderCamera(camera);
+            for (i = 0; i < FUZZ_NODES; i++){
+                float *bs = hpsNodeBoundingSphere(nodes[i]);
+                float nearest = 1e30;
+                for (j = 0; j < 6; j++){
+                    Plane *p = &camera->planes[j];
+                    float d = p->a * bs[0] + p->b * bs[1] + p->c * bs[2] + p->d + bs[3];
+                    if (d < nearest) nearest = d;
+                }
+                if ((drawn[i] && (nearest < -0.01)) || (!drawn[i] && (nearest > 0.01)))
+                    errors++;
+            }
+        }
+        hpsDeleteCamera(camera);
+        hpsDeleteScene(scene);
+        hpsSetWorkerCount(1);
+        return errors;
+    }
+    )
+
+CHEAT_TEST(bvh_culling,
+           cheat_assert(cullingErrors(hpsBVHpartitionInterface, 1) == 0);
+           cheat_assert(cullingErrors(hpsBVHpartitionInterface, 4) == 0);
+    )
+
+CHEAT_TEST(octree_culling,
+           cheat_assert(cullingErrors(hpsOctreePartitionInterface, 1) == 0);
+           cheat_assert(cullingErrors(hpsOctreePartitionInterface, 4) == 0);
+    )
+
+CHEAT_TEST(grid_culling,
+           cheat_assert(cullingErrors(hpsGridPartitionInterface, 1) == 0);
+           cheat_assert(cullingErrors(hpsGridPartitionInterface, 4) == 0);
+    )
+
+CHEAT_TEST(bvh_split_after_moves,
+           // Full leaves of eight nodes at x = -130 and x = -100. A node moves into the second leaf, which is split before the update of that leaf's nodes, which have all moved away
+           HPSpipeline *pipeline;
+           HPSnode *a[8], *b[8], *c[8];
+           float planes[24] = {1, 0, 0, 320, -1, 0, 0, -260, 0, 1, 0, 50,
+                               0, -1, 0, 50, 0, 0, 1, 50, 0, 0, -1, 50};
+           float pa[3] = {-100, 0, 0}, pc[3] = {-130, 0, 0};
+           float away[3] = {-200, 0, 0}, across[3] = {-265, 0, 0};
+           unsigned int i;
+           hpsInit();
+           hpsPartitionInterface = hpsBVHpartitionInterface;
+           pipeline = hpsAddPipeline(&pipelineFunc, &pipelineFunc, &pipelineFunc, false);
+           nestedScene = hpsMakeScene();
+           for (i = 0; i < 8; i++){
+               float pb[3] = {100.0 + i * 10, 0, 0};
+               a[i] = hpsAddNode((HPSnode *) nestedScene, NULL, pipeline, NULL);
+               hpsSetNodePosition(a[i], pa);
+               b[i] = hpsAddNode((HPSnode *) nestedScene, NULL, pipeline, NULL);
+               hpsSetNodePosition(b[i], pb);
+               c[i] = hpsAddNode((HPSnode *) nestedScene, NULL, pipeline, NULL);
+               hpsSetNodePosition(c[i], pc);
+           }
+           hpsUpdateScenes();
+           hpsMoveNode(b[7], across);
+           for (i = 0; i < 8; i++)
+               hpsMoveNode(a[i], away);
+           hpsUpdateScenes();
+           nInner = 0;
+           hpsNodesInVolume(nestedScene, planes, 6, &countInner, NULL);
+           cheat_assert(nInner == 8);
+           hpsDeleteScene(nestedScene);
+    )
+
+CHEAT_TEST(portal_cube_camera,
+           // A node seen at an angle through a doorway, from a cube camera in the next room
+           HPSpipeline *pipeline;
+           HPSportalCell *near, *far;
+           HPSnode *node;
+           HPScamera *camera;
+           float nearPlanes[24] = {1, 0, 0, 10, -1, 0, 0, 10, 0, 1, 0, 10,
+                                   0, -1, 0, 10, 0, 0, 1, 10, 0, 0, -1, 10};
+           float farPlanes[24] = {1, 0, 0, 10, -1, 0, 0, 10, 0, 1, 0, 10,
+                                  0, -1, 0, 10, 0, 0, 1, 30, 0, 0, -1, -10};
+           float doorway[12] = {-2, -2, -10, 2, -2, -10, 2, 2, -10, -2, 2, -10};
+           float position[3] = {3, 0, -18}, origin[3] = {0, 0, 0};
+           hpsInit();
+           hpsPartitionInterface = hpsPortalPartitionInterface;
+           pipeline = hpsAddPipeline(&pipelineFunc, &drawNode, &pipelineFunc, false);
+           nestedScene = hpsMakeScene();
+           near = hpsAddPortalCell(nestedScene, nearPlanes, 6);
+           far = hpsAddPortalCell(nestedScene, farPlanes, 6);
+           hpsAddPortal(nestedScene, near, far, doorway, 4);
+           node = hpsAddNode((HPSnode *) nestedScene, (void *) 0, pipeline, NULL);
+           hpsSetNodePosition(node, position);
+           hpsSetNodeBoundingSphere(node, 0.5);
+           hpsUpdateScenes();
+           camera = hpsMakeCamera(HPS_CUBE, HPS_POSITION, nestedScene, 512, 512);
+           hpsSetCameraClipPlanes(camera, 1, 20);
+           hpsSetCameraPosition(camera, origin);
+           hpsUpdateCamera(camera);
+           drawn[0] = false;
+           hpsRenderCamera(camera);
+           cheat_assert(drawn[0]);
+           hpsDeleteCamera(camera);
+           hpsDeleteScene(nestedScene);
+    )
+
+CHEAT_TEST(portal_moved_nodes,
+           // A node behind the wall of the next room, moved while the camera stays still
+           HPSpipeline *pipeline;
+           HPSportalCell *near, *far;
+           HPSnode *node;
+           HPScamera *camera;
+           float nearPlanes[24] = {1, 0, 0, 10, -1, 0, 0, 10, 0, 1, 0, 10,
+                                   0, -1, 0, 10, 0, 0, 1, 10, 0, 0, -1, 10};
+           float farPlanes[24] = {1, 0, 0, 10, -1, 0, 0, 10, 0, 1, 0, 10,
+                                  0, -1, 0, 10, 0, 0, 1, 30, 0, 0, -1, -10};
+           float doorway[12] = {-2, -2, -10, 2, -2, -10, 2, 2, -10, -2, 2, -10};
+           float position[3] = {8, 0, -18}, step[3] = {0, 0, 1}, origin[3] = {0, 0, 0};
+           hpsInit();
+           hpsPartitionInterface = hpsPortalPartitionInterface;
+           pipeline = hpsAddPipeline(&pipelineFunc, &drawNode, &pipelineFunc, false);
+           nestedScene = hpsMakeScene();
+           near = hpsAddPortalCell(nestedScene, nearPlanes, 6);
+           far = hpsAddPortalCell(nestedScene, farPlanes, 6);
+           hpsAddPortal(nestedScene, near, far, doorway, 4);
+           node = hpsAddNode((HPSnode *) nestedScene, (void *) 0, pipeline, NULL);
+           hpsSetNodePosition(node, position);
+           hpsSetNodeBoundingSphere(node, 0.5);
+           hpsUpdateScenes();
+           camera = hpsMakeCamera(HPS_PERSPECTIVE, HPS_POSITION, nestedScene, 800, 600);
+           hpsSetCameraClipPlanes(camera, 1, 100);
+           hpsSetCameraPosition(camera, origin);
+           hpsUpdateCamera(camera);
+           drawn[0] = false;
+           hpsRenderCamera(camera);
+           cheat_assert(!drawn[0]);
+           hpsMoveNode(node, step);
+           hpsUpdateScenes();
+           hpsRenderCamera(camera);
+           cheat_assert(!drawn[0]);
+           hpsDeleteCamera(camera);
+           hpsDeleteScene(nestedScene);
+    )
+
+/* Lighting */
+CHEAT_DECLARE(
+    static HPScamera *innerCamera;
+    static HPSrenderContext *innerContext;
+    static unsigned int innerLights, outerLights;
+    static float outerAmbient;
+
+    static void renderInner(void *data){
+        hpsRenderCameraInContext(innerCamera, innerContext);
+        outerLights = *hpsNCurrentLights();
+        outerAmbient = hpsCurrentAmbientLight()[0];
+    }
+
+    static void countLights(void *data){
+        innerLights = *hpsNCurrentLights();
+    }
+    )
+
+CHEAT_TEST(nested_context_lights,
+           // A camera rendered in its own context, from within the rendering of a camera that sees a light
+           HPSpipeline *outerPipeline, *innerPipeline;
+           HPSscene *outer, *inner;
+           HPScamera *camera;
+           HPSnode *light, *node;
+           float red[3] = {1, 0, 0}, green[3] = {0, 1, 0}, direction[3] = {0, 0, 0};
+           float position[3] = {0, 0, -10}, origin[3] = {0, 0, 0};
+           hpsInit();
+           outerPipeline = hpsAddPipeline(&pipelineFunc, &renderInner, &pipelineFunc, false);
+           innerPipeline = hpsAddPipeline(&pipelineFunc, &countLights, &pipelineFunc, false);
+           outer = hpsMakeScene();
+           inner = hpsMakeScene();
+           hpsActivateExtension(outer, hpsLighting);
+           hpsActivateExtension(inner, hpsLighting);
+           hpsSetAmbientLight(outer, red);
+           hpsSetAmbientLight(inner, green);
+           light = hpsAddLight((HPSnode *) outer, red, 1, direction, 0);
+           hpsSetNodePosition(light, position);
+           node = hpsAddNode((HPSnode *) outer, NULL, outerPipeline, NULL);
+           hpsSetNodePosition(node, position);
+           node = hpsAddNode((HPSnode *) inner, NULL, innerPipeline, NULL);
+           hpsSetNodePosition(node, position);
+           hpsUpdateScenes();
+           camera = hpsMakeCamera(HPS_PERSPECTIVE, HPS_POSITION, outer, 800, 600);
+           innerCamera = hpsMakeCamera(HPS_PERSPECTIVE, HPS_POSITION, inner, 800, 600);
+           hpsSetCameraPosition(camera, origin);
+           hpsSetCameraPosition(innerCamera, origin);
+           hpsUpdateCamera(camera);
+           hpsUpdateCamera(innerCamera);
+           innerContext = hpsMakeRenderContext();
+           innerLights = outerLights = 2;
+           hpsRenderCamera(camera);
+           cheat_assert(innerLights == 0);
+           cheat_assert(outerLights == 1);
+           cheat_assert(outerAmbient == 1);
+           hpsDeleteRenderContext(innerContext);
+           hpsDeleteCamera(camera);
+           hpsDeleteCamera(innerCamera);
+           hpsDeleteScene(outer);
+           hpsDeleteScene(inner);
+    )